@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "capture.h"
+
+/*
+ * Traffic capture. With captureFile set every frame received from a
+ * client is recorded together with its connection and the time it
+ * arrived, so redq-replay can send the same traffic to another build.
+ */
+static FILE *capture;
+static struct timeval capture_start;
+static u_int32_t capture_conns;
+
+int capture_init(void)
+{
+    const char *file = configget("captureFile");
+    int fd;
+
+    if(strlen(file) == 0)
+        return 0;
+
+    /* Message bodies are nobody else's business */
+    fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(fd == -1 || fchmod(fd, 0600) != 0 || (capture = fdopen(fd, "w")) == NULL){
+        logerror("Capture to %s failed: %s", file, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        return 1;
+    }
+
+    setvbuf(capture, NULL, _IOFBF, 65536);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture);
+    gettimeofday(&capture_start, NULL);
+
+    loginfo("Capturing client traffic to %s", file);
+
+    return 0;
+}
+
+void capture_free(void)
+{
+    if(capture == NULL)
+        return;
+
+    fclose(capture);
+    capture = NULL;
+}
+
+static void capture_record(u_int8_t type, u_int32_t conn, const char *data, size_t len)
+{
+    struct timeval now;
+    u_int64_t offset;
+    u_int32_t value[4];
+
+    gettimeofday(&now, NULL);
+    offset = (u_int64_t)(now.tv_sec - capture_start.tv_sec) * 1000000 + now.tv_usec - capture_start.tv_usec;
+
+    value[0] = htonl(conn);
+    value[1] = htonl((u_int32_t)(offset >> 32));
+    value[2] = htonl((u_int32_t)offset);
+    value[3] = htonl(len);
+
+    fwrite(&type, 1, 1, capture);
+    fwrite(value, sizeof(value), 1, capture);
+    if(len > 0)
+        fwrite(data, 1, len, capture);
+}
+
+void capture_open(struct client *client)
+{
+    if(capture == NULL)
+        return;
+
+    client->capture_id = ++capture_conns;
+    capture_record(CAPTURE_OPEN, client->capture_id, NULL, 0);
+}
+
+/*
+ * Copies a CONNECT frame with the values of its login and passcode
+ * headers replaced, credentials are not recorded.
+ */
+static char* capture_redact(const char *frame, size_t len, size_t *redacted_len)
+{
+    const char *line, *line_end, *end = frame + len;
+    char *redacted, *out;
+    int blank, command = 0;
+
+    /* A redacted header line is never more than twice as long */
+    redacted = malloc(len*2 + 1);
+    if(redacted == NULL)
+        return NULL;
+
+    out = redacted;
+    for(line = frame; line < end; line = line_end){
+        line_end = memchr(line, '\n', end - line);
+        line_end = (line_end != NULL) ? line_end+1 : end;
+        blank = (line[0] == '\n' || (line[0] == '\r' && line_end - line == 2));
+
+        /* Everything after the headers is copied as it is */
+        if(command && blank){
+            memcpy(out, line, end - line);
+            out += end - line;
+            break;
+        }
+
+        if(!blank)
+            command = 1;
+
+        if(strncmp(line, "login:", 6) == 0 || strncmp(line, "passcode:", 9) == 0){
+            out += sprintf(out, "%.*s***\n", (int)(strchr(line, ':')+1 - line), line);
+            continue;
+        }
+
+        memcpy(out, line, line_end - line);
+        out += line_end - line;
+    }
+
+    *redacted_len = out - redacted;
+    return redacted;
+}
+
+void capture_frame(struct client *client, const char *frame, size_t len)
+{
+    const char *command = frame;
+    char *redacted;
+    size_t redacted_len;
+
+    if(capture == NULL || client->capture_id == 0)
+        return;
+
+    while(command < frame + len && (*command == '\r' || *command == '\n'))
+        command++;
+
+    if(strncmp(command, "CONNECT", 7) == 0 || strncmp(command, "STOMP", 5) == 0){
+        redacted = capture_redact(frame, len, &redacted_len);
+        if(redacted == NULL)
+            return;
+
+        capture_record(CAPTURE_FRAME, client->capture_id, redacted, redacted_len);
+        free(redacted);
+        return;
+    }
+
+    capture_record(CAPTURE_FRAME, client->capture_id, frame, len);
+}
+
+void capture_close(struct client *client)
+{
+    if(capture == NULL || client->capture_id == 0)
+        return;
+
+    capture_record(CAPTURE_CLOSE, client->capture_id, NULL, 0);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*
+ * Capture file: the magic followed by records of
+ *
+ *   u_int8 type, u_int32 connection, u_int64 microseconds since the
+ *   start of the capture, u_int32 length, length bytes of the frame
+ *
+ * with all numbers in network byte order. Frames are recorded as
+ * received, without the terminating NUL.
+ */
+#define CAPTURE_MAGIC "REDQCAP1"
+
+enum capture_record {
+    CAPTURE_OPEN = 1,
+    CAPTURE_FRAME,
+    CAPTURE_CLOSE
+};
+
+struct client;
+
+extern int capture_init(void);
+extern void capture_free(void);
+
+extern void capture_open(struct client *client);
+extern void capture_frame(struct client *client, const char *frame, size_t len);
+extern void capture_close(struct client *client);
+
+#endif /* _CAPTURE_H_ */
@@ -29,21 +29,22 @@
 
 #include <sys/queue.h>
 
+/* Number of message priority levels (STOMP priority header 0-9). */
+#define MAXPRIORITY 10
+
 /**
- * A struct for client specific data, also includes
- * pointer to create a list of clients.
+ * Token bucket of a rate limit (see ratelimit.c).
  */
-struct client {
-   /* The clients socket. */
-   int fd;
-
-   /* Authentication flag for this connection. */
-   int authenticated;
-
-   /* The bufferedevent for this client. */
-   struct bufferevent *bev;
-
+struct tokenbucket {
+   double tokens;
+   u_int64_t updated;
+};
 
+/**
+ * State of one request. It only exists while buffered_on_frame()
+ * handles a frame of the client.
+ */
+struct request {
    /* Request with probably padding */
    char *rawrequest;
 
@@ -60,7 +61,7 @@ struct client {
    struct evkeyvalq *request_headers;
 
 
-   /* The output buffer for this client. */
+   /* The output buffer for this request. */
    struct evbuffer *response_buf;
 
    /* Response command */
@@ -71,7 +72,67 @@ struct client {
 
    /* Response Headers */
    struct evkeyvalq *response_headers;
+};
 
+/**
+ * A struct for client specific data, also includes
+ * pointer to create a list of clients.
+ */
+struct client {
+   /* The clients socket. */
+   int fd;
+
+   /* Authentication flag for this connection. */
+   int authenticated;
+
+   /* The bufferedevent for this client. */
+   struct bufferevent *bev;
+
+
+   /* The request being handled, NULL between requests */
+   struct request *req;
+
+   /* Output held back until the end of the loop iteration, the
+    * buffer is kept until the connection was idle for a while */
+   struct evbuffer *cork;
+   int corked;
+   int cork_used;
+   TAILQ_ENTRY(client) cork_entries;
+
+   /* Bytes buffered for this connection and, in output order, the
+    * destinations they are charged to (see memory.c). */
+   size_t memory;
+   TAILQ_HEAD(chargeq, charge) charges;
+   struct queue *charging;
+
+   /* Set while reading is stopped by producer flow control */
+   int paused;
+   struct queue *paused_queue;
+   TAILQ_ENTRY(client) paused_entries;
+
+   /* Rate limits of the connection and its login, reading is
+    * stopped while throttled */
+   struct tokenbucket rate_messages;
+   struct tokenbucket rate_bytes;
+   struct login *login;
+   int throttled;
+   struct event *ev_throttle;
+
+
+   /* Connection number in the traffic capture, 0 if not recorded */
+   u_int capture_id;
+
+   /* Set for the link of another cluster node. */
+   int peer;
+
+   /* Route id: on a peer link the remote client of the current
+    * request, otherwise the id this client has on peer links. */
+   u_int route;
+   struct client *route_next;
+
+
+   /* Destinations this client is subscribed to. */
+   TAILQ_HEAD(, subscription) subscriptions;
 
    TAILQ_ENTRY(client) entries;
 };
@@ -79,12 +140,178 @@ struct client {
 TAILQ_HEAD(, client) clients;
 
 
-struct queue {
-   char *queuename;
+enum ack_mode {
+   ACK_AUTO = 0,
+   ACK_CLIENT
+};
+
+/**
+ * Links a client to a destination. It is part of the subscriber
+ * list of the queue and of the subscription list of the client.
+ */
+struct subscription {
+   struct client *client;
+   struct queue *queue;
+
+   /* Remote client of a subscription over a peer link */
+   u_int route;
+
+   /* Acknowledgement mode from the ack header */
+   enum ack_mode ack;
+
+   /* Maximum and current number of unacknowledged messages */
+   u_int prefetch;
+   u_int inflight;
+
+   /* Set for browser subscriptions, which get no new messages */
+   struct browse *browse;
+
+   /* Increases with every subscription (see fanout.c) */
+   u_int64_t serial;
+
+   /* Set for durable topic subscriptions (see durable.c) */
+   struct durable *durable;
+
+   TAILQ_ENTRY(subscription) entries;
+   TAILQ_ENTRY(subscription) client_entries;
+};
+
+
+/**
+ * A browser subscription walks a storage snapshot of the queue in
+ * batches, highest priority first, without consuming anything.
+ */
+struct browse {
+   void *cursor;
+   struct event *ev;
+
+   /* Current priority and sequence, range and messages left */
+   int priority;
+   u_int seq;
+   u_int from;
+   u_int to;
+   u_int left;
+};
+
+
+/**
+ * A delivered but not yet acknowledged message, or a message which
+ * waits for its redelivery (subscription is NULL then).
+ */
+struct inflight {
+   struct subscription *subscription;
+
+   int priority;
+   u_int seq;
+
+   /* Id of the shared message the stored record refers to, or 0 */
+   u_int64_t shared;
+
+   /* Number of failed deliveries */
+   u_int count;
+
+   /* Time of the next delivery attempt */
+   u_int64_t due;
+
+   TAILQ_ENTRY(inflight) entries;
+
+   /* Unacknowledged messages of the bucket in sequence order and
+    * the chain of the lookup table of the queue */
+   TAILQ_ENTRY(inflight) bucket_entries;
+   struct inflight *index_next;
+};
+
+TAILQ_HEAD(inflightq, inflight);
+
+
+/**
+ * Ring of sequence numbers for one priority level. Messages between
+ * read and write are kept in the storage backend, messages between
+ * read and deliver have been handed out but are not acknowledged.
+ */
+struct bucket {
    volatile u_int read;
+   volatile u_int deliver;
    volatile u_int write;
 
-   TAILQ_HEAD(, client) subscribers;
+   /* Consumed messages below are compacted in the storage */
+   u_int compacted;
+
+   /* Messages between read and this were dropped by the overflow
+    * policy while older ones were still unacknowledged */
+   u_int dropped;
+
+   /* Delivered messages which are not acknowledged, lowest first */
+   struct inflightq unacked;
+};
+
+struct queue {
+   char *queuename;
+
+   /* Set for /topic/ and /temp-topic/ destinations */
+   int topic;
+
+   /* Temporary destinations (/temp-queue/, /temp-topic/) belong to
+    * the client which subscribed first and go away with it */
+   struct client *owner;
+   u_int owner_route;
+
+   /* Last use, the queue list is kept in order of use */
+   u_int64_t used;
+
+   /* Settings from the matching config policy */
+   struct policy *policy;
+
+   /* Set while stored messages may carry an expiration time */
+   int expiring;
+
+   /* Set once stored messages may refer to shared messages */
+   int shared;
+
+   /* One ring per priority, indexed by the STOMP priority header */
+   struct bucket buckets[MAXPRIORITY];
+
+   /* Bitmask of buckets with undelivered messages */
+   u_int pending;
+
+   /* Stored bytes of undelivered messages, estimated after a restart */
+   size_t bytes;
+
+   /* Unacknowledged messages and messages waiting for redelivery */
+   struct inflightq inflight;
+   struct inflightq redeliver;
+   struct event *ev_redeliver;
+
+   /* Both of them by priority and sequence (see stomputil.c) */
+   struct inflight **index;
+   u_int index_size;
+   u_int index_count;
+
+   /* Bytes of this destination buffered for subscribers */
+   size_t memory;
+
+   /* Set while delivery waits for memory to be released */
+   int spilled;
+
+   /* Rate limits of producers from the policy */
+   struct tokenbucket rate_messages;
+   struct tokenbucket rate_bytes;
+
+   /* Recent ids of idempotent producers (see dedup.c) */
+   struct dedup *dedup;
+
+   /* Topic messages still being sent out and the next subscriber
+    * of the first one (see fanout.c) */
+   TAILQ_HEAD(fanoutq, fanout) fanouts;
+   struct subscription *fanout_next;
+   struct event *ev_fanout;
+
+   /* Durable subscriptions of a topic, set while their cursors
+    * moved since they were stored (see durable.c) */
+   TAILQ_HEAD(durableq, durable) durables;
+   int durable_dirty;
+
+   TAILQ_HEAD(, subscription) subscribers;
    TAILQ_ENTRY(queue) entries;
 };
 
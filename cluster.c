@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "stomp.h"
+#include "stomputil.h"
+#include "cluster.h"
+
+/*
+ * Destinations are spread over the nodes of a cluster with a
+ * consistent hashing ring. Requests for a destination owned by
+ * another node are forwarded over a single STOMP connection to that
+ * node, the peer link. Frames on a peer link carry a route header
+ * with the id of the client they belong to, so the owner can keep
+ * subscriptions per remote client and answers find their way back.
+ */
+/*
+ * A SUBSCRIBE forwarded to a peer, sent again when the link comes
+ * back since the other node drops everything of a lost link.
+ */
+struct remotesub {
+    u_int route;
+    char *destination;
+    char *frame;
+    size_t len;
+
+    TAILQ_ENTRY(remotesub) entries;
+};
+
+struct peer {
+    struct node *node;
+    struct bufferevent *bev;
+    int connected;
+    struct event *ev_reconnect;
+
+    TAILQ_HEAD(, remotesub) subscriptions;
+};
+
+struct point {
+    u_int32_t hash;
+
+    /* NULL for this node */
+    struct peer *peer;
+};
+
+static struct event_base *cluster_base;
+
+static struct peer *peers;
+static int peer_count;
+
+static struct point *ring;
+static int ring_size;
+
+/* Route ids handed out to local clients, hashed to find the client
+ * of frames coming back */
+static u_int next_route;
+static struct client **routes;
+static u_int route_size;
+static u_int route_count;
+
+
+/* FNV-1a */
+static u_int32_t cluster_hash(const char *data, size_t len)
+{
+    u_int32_t hash = 2166136261U;
+
+    while(len-- > 0){
+        hash ^= (unsigned char)*data++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static int cluster_point_cmp(const void *a, const void *b)
+{
+    const struct point *pa = a, *pb = b;
+
+    return (pa->hash > pb->hash) - (pa->hash < pb->hash);
+}
+
+/*
+ * Returns the peer owning a destination or NULL if it is this node.
+ * Dead letter queues stay with the queue they belong to.
+ */
+static struct peer* cluster_owner(const char *queuename)
+{
+    char name[MAXQUEUELEN];
+    u_int32_t hash;
+    int lo, hi, mid;
+
+    if(strncmp(queuename, "/queue/DLQ.", 11) == 0){
+        snprintf(name, sizeof(name), "/queue/%s", queuename+11);
+        queuename = name;
+    }
+
+    hash = cluster_hash(queuename, strlen(queuename));
+
+    lo = 0;
+    hi = ring_size;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return ring[lo % ring_size].peer;
+}
+
+/*
+ * Whether this node owns a destination.
+ */
+int cluster_local(const char *queuename)
+{
+    return ring_size == 0 || cluster_owner(queuename) == NULL;
+}
+
+static int cluster_grow_routes(void)
+{
+    struct client **table, *client, *next;
+    u_int size, i;
+
+    size = route_size ? route_size * 2 : 64;
+    table = calloc(size, sizeof(*table));
+    if(table == NULL)
+        return 1;
+
+    for(i=0; i < route_size; i++){
+        for(client = routes[i]; client != NULL; client = next){
+            next = client->route_next;
+            client->route_next = table[client->route & (size - 1)];
+            table[client->route & (size - 1)] = client;
+        }
+    }
+
+    free(routes);
+    routes = table;
+    route_size = size;
+
+    return 0;
+}
+
+/*
+ * Hands out the route id of a local client.
+ */
+static int cluster_add_route(struct client *client)
+{
+    if(route_count >= route_size && cluster_grow_routes() != 0)
+        return 1;
+
+    /* 0 means no route */
+    if(++next_route == 0)
+        ++next_route;
+
+    client->route = next_route;
+    client->route_next = routes[client->route & (route_size - 1)];
+    routes[client->route & (route_size - 1)] = client;
+    route_count++;
+
+    return 0;
+}
+
+static void cluster_remove_route(struct client *client)
+{
+    struct client **link;
+
+    link = &routes[client->route & (route_size - 1)];
+    while(*link != NULL && *link != client)
+        link = &(*link)->route_next;
+
+    if(*link != NULL){
+        *link = client->route_next;
+        route_count--;
+    }
+}
+
+/*
+ * Hands a frame which came back over a peer link to the local
+ * client named by its route header.
+ */
+static void cluster_route_frame(struct peer *peer, char *frame, size_t len)
+{
+    struct client *client;
+    char *header_end, *line, *line_end;
+    u_int route;
+
+    while(*frame == '\r' || *frame == '\n'){
+        frame++;
+        len--;
+    }
+
+    if((header_end = strstr(frame, "\n\n")) == NULL && (header_end = strstr(frame, "\r\n\r\n")) == NULL)
+        return;
+
+    for(line = strchr(frame, '\n'); line != NULL && line < header_end; line = strchr(line+1, '\n')){
+        if(strncmp(line+1, "route:", 6) == 0)
+            break;
+    }
+
+    /* CONNECTED and errors of the link itself */
+    if(line == NULL || line >= header_end){
+        if(strncmp(frame, "ERROR", 5) == 0)
+            logerror("Cluster node %s: %.*s", peer->node->address, (int)len, frame);
+        return;
+    }
+
+    route = strtoul(line+7, NULL, 10);
+    line_end = strchr(line+1, '\n');
+
+    client = route_size ? routes[route & (route_size - 1)] : NULL;
+    while(client != NULL && client->route != route)
+        client = client->route_next;
+
+    /* The client is gone, unacknowledged messages get redelivered */
+    if(client == NULL)
+        return;
+
+    stomp_write(client, frame, line - frame);
+    stomp_write(client, line_end, len - (line_end - frame));
+    stomp_write(client, "\0", 1);
+}
+
+/*
+ * Forgets the subscriptions of a route on a peer, all of them if
+ * destination is NULL.
+ */
+static void cluster_forget(struct peer *peer, u_int route, const char *destination)
+{
+    struct remotesub *sub, *tmp_sub;
+
+    for(sub = TAILQ_FIRST(&peer->subscriptions); sub != NULL; sub = tmp_sub){
+        tmp_sub = TAILQ_NEXT(sub, entries);
+
+        if(sub->route != route || (destination != NULL && strcmp(sub->destination, destination) != 0))
+            continue;
+
+        TAILQ_REMOVE(&peer->subscriptions, sub, entries);
+        free(sub->destination);
+        free(sub->frame);
+        free(sub);
+    }
+}
+
+/*
+ * Keeps a copy of a forwarded SUBSCRIBE without its receipt, the
+ * client already got that one.
+ */
+static void cluster_remember(struct peer *peer, struct client *client, const char *destination)
+{
+    struct remotesub *sub;
+    struct evbuffer *frame;
+    const char *line, *line_end;
+
+    cluster_forget(peer, client->route, destination);
+
+    sub = calloc(1, sizeof(*sub));
+    frame = evbuffer_new();
+    if(sub == NULL || frame == NULL){
+        logerror("Remembering the subscription to %s failed", destination);
+        free(sub);
+        if(frame != NULL)
+            evbuffer_free(frame);
+        return;
+    }
+
+    line_end = strchr(client->req->request, '\n');
+    evbuffer_add(frame, client->req->request, line_end+1 - client->req->request);
+    evbuffer_add_printf(frame, "route:%u\n", client->route);
+
+    for(line = line_end+1; *line != '\n' && *line != '\r' && (line_end = strchr(line, '\n')) != NULL; line = line_end+1){
+        if(strncmp(line, "receipt:", 8) != 0)
+            evbuffer_add(frame, line, line_end+1 - line);
+    }
+
+    evbuffer_add(frame, "\n", 1);
+    evbuffer_add(frame, "\0", 1);
+
+    sub->route = client->route;
+    sub->destination = strdup(destination);
+    sub->len = evbuffer_get_length(frame);
+    sub->frame = malloc(sub->len);
+    if(sub->destination == NULL || sub->frame == NULL){
+        logerror("Remembering the subscription to %s failed", destination);
+        free(sub->destination);
+        free(sub->frame);
+        free(sub);
+        evbuffer_free(frame);
+        return;
+    }
+
+    evbuffer_remove(frame, sub->frame, sub->len);
+    evbuffer_free(frame);
+
+    TAILQ_INSERT_TAIL(&peer->subscriptions, sub, entries);
+}
+
+static void cluster_read(struct bufferevent *bev, void *arg)
+{
+    struct peer *peer = (struct peer *)arg;
+    char *frame;
+    size_t len;
+
+    while((frame = evbuffer_readln(bufferevent_get_input(bev), &len, EVBUFFER_EOL_NUL)) != NULL){
+        cluster_route_frame(peer, frame, len);
+        free(frame);
+    }
+}
+
+static void cluster_schedule_reconnect(struct peer *peer)
+{
+    struct timeval tv = { 1, 0 };
+
+    evtimer_add(peer->ev_reconnect, &tv);
+}
+
+static void cluster_event(struct bufferevent *bev, short what, void *arg)
+{
+    struct peer *peer = (struct peer *)arg;
+
+    if(what & BEV_EVENT_CONNECTED){
+        loginfo("Cluster link to %s established", peer->node->address);
+        peer->connected = 1;
+        return;
+    }
+
+    if(peer->connected)
+        logwarn("Cluster link to %s lost, subscriptions are renewed on reconnect", peer->node->address);
+
+    bufferevent_free(peer->bev);
+    peer->bev = NULL;
+    peer->connected = 0;
+    cluster_schedule_reconnect(peer);
+}
+
+static void cluster_connect(evutil_socket_t fd, short what, void *arg)
+{
+    struct peer *peer = (struct peer *)arg;
+    struct remotesub *sub;
+    struct evbuffer *output;
+    struct sockaddr_storage addr;
+    int addr_len = sizeof(addr);
+
+    if(evutil_parse_sockaddr_port(peer->node->address, (struct sockaddr *)&addr, &addr_len) != 0){
+        logerror("Invalid cluster node address %s", peer->node->address);
+        return;
+    }
+
+    peer->bev = bufferevent_socket_new(cluster_base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(peer->bev, cluster_read, NULL, cluster_event, peer);
+    bufferevent_enable(peer->bev, EV_READ|EV_WRITE);
+
+    if(bufferevent_socket_connect(peer->bev, (struct sockaddr *)&addr, addr_len) != 0){
+        bufferevent_free(peer->bev);
+        peer->bev = NULL;
+        cluster_schedule_reconnect(peer);
+        return;
+    }
+
+    /* Queued until the connection is established */
+    output = bufferevent_get_output(peer->bev);
+    evbuffer_add_printf(output, "CONNECT\npeer:%s\n", configget("clusterSelf"));
+    if(strlen(configget("authUser")) > 0)
+        evbuffer_add_printf(output, "login:%s\npasscode:%s\n", configget("authUser"), configget("authPass"));
+    evbuffer_add(output, "\n", 1);
+    evbuffer_add(output, "\0", 1);
+
+    /* The other node lost the subscriptions with the last link */
+    TAILQ_FOREACH(sub, &peer->subscriptions, entries) {
+        evbuffer_add(output, sub->frame, sub->len);
+    }
+}
+
+/*
+ * Forwards a request for a destination of another node. Returns 0
+ * if the request has to be handled locally.
+ */
+int cluster_forward(struct client *client, int cmd)
+{
+    struct evbuffer *output;
+    struct peer *peer;
+    char queuename[MAXQUEUELEN];
+    const char *value, *members;
+    char *line_end;
+    int priority;
+    u_int seq;
+
+    if(ring_size == 0 || client->peer)
+        return 0;
+
+    switch(cmd){
+    case STOMP_CMD_SEND:
+        value = evhttp_find_header(client->req->request_headers, "destination");
+        if(value == NULL)
+            return 0;
+        /* A composite destination goes to the owner of its first queue */
+        members = stomp_composite(value);
+        if(members != NULL){
+            snprintf(queuename, sizeof(queuename), "%.*s", (int)strcspn(members, ","), members);
+            value = queuename;
+        }
+        peer = cluster_owner(value);
+        break;
+    case STOMP_CMD_SUBSCRIBE:
+    case STOMP_CMD_UNSUBSCRIBE:
+        value = evhttp_find_header(client->req->request_headers, "destination");
+        if(value == NULL)
+            return 0;
+        peer = cluster_owner(value);
+        break;
+    case STOMP_CMD_ACK:
+    case STOMP_CMD_NACK:
+        value = evhttp_find_header(client->req->request_headers, "message-id");
+        if(value == NULL || stomp_parse_messageid(value, queuename, sizeof(queuename), &priority, &seq) != 0)
+            return 0;
+        peer = cluster_owner(queuename);
+        break;
+    default:
+        return 0;
+    }
+
+    if(peer == NULL)
+        return 0;
+
+    if(peer->connected == 0){
+        client->req->response_cmd = STOMP_CMD_ERROR;
+        evhttp_add_header(client->req->response_headers, "message", "Cluster node unavailable");
+        return 1;
+    }
+
+    line_end = strchr(client->req->request, '\n');
+    if(line_end == NULL)
+        return 0;
+
+    if(client->route == 0 && cluster_add_route(client) != 0){
+        client->req->response_cmd = STOMP_CMD_ERROR;
+        evhttp_add_header(client->req->response_headers, "message", "Out of memory");
+        return 1;
+    }
+
+    /* The route header goes right after the command line */
+    output = bufferevent_get_output(peer->bev);
+    evbuffer_add(output, client->req->request, line_end+1 - client->req->request);
+    evbuffer_add_printf(output, "route:%u\n", client->route);
+    evbuffer_add(output, line_end+1, strlen(line_end+1));
+    evbuffer_add(output, "\0", 1);
+
+    if(cmd == STOMP_CMD_SUBSCRIBE)
+        cluster_remember(peer, client, value);
+    else if(cmd == STOMP_CMD_UNSUBSCRIBE)
+        cluster_forget(peer, client->route, value);
+
+    /* The owner sends the receipt */
+    evhttp_remove_header(client->req->request_headers, "receipt");
+    client->req->response_cmd = STOMP_CMD_NONE;
+
+    return 1;
+}
+
+/*
+ * Takes the route header of a request which came in over a peer
+ * link off the frame, it must neither be stored nor delivered.
+ */
+void cluster_accept_route(struct client *client)
+{
+    const char *value;
+    char *line_end, *route_end;
+
+    value = evhttp_find_header(client->req->request_headers, "route");
+    if(value == NULL){
+        client->route = 0;
+        return;
+    }
+
+    client->route = strtoul(value, NULL, 10);
+    evhttp_remove_header(client->req->request_headers, "route");
+
+    line_end = strchr(client->req->request, '\n');
+    if(line_end == NULL || strncmp(line_end+1, "route:", 6) != 0)
+        return;
+
+    route_end = strchr(line_end+1, '\n');
+    if(route_end == NULL)
+        return;
+
+    memmove(line_end, route_end, strlen(route_end)+1);
+    if(client->req->request_body != NULL)
+        client->req->request_body -= route_end - line_end;
+}
+
+/*
+ * Whether a connection may act as the peer link of node name. Only
+ * the other nodes of the node list are accepted, from their address.
+ */
+int cluster_accept_peer(struct client *client, const char *name)
+{
+    struct sockaddr_storage addr, remote;
+    int addr_len = sizeof(addr);
+    socklen_t remote_len = sizeof(remote);
+    int i;
+
+    for(i=0; i < peer_count; i++){
+        if(peers[i].ev_reconnect != NULL && strcmp(peers[i].node->address, name) == 0)
+            break;
+    }
+
+    if(i == peer_count)
+        return 1;
+
+    if(evutil_parse_sockaddr_port(name, (struct sockaddr *)&addr, &addr_len) != 0)
+        return 1;
+
+    if(getpeername(client->fd, (struct sockaddr *)&remote, &remote_len) != 0 || remote.ss_family != addr.ss_family)
+        return 1;
+
+    /* The link comes from an ephemeral port, only the host counts */
+    if(addr.ss_family == AF_INET)
+        return memcmp(&((struct sockaddr_in *)&addr)->sin_addr, &((struct sockaddr_in *)&remote)->sin_addr, sizeof(struct in_addr)) != 0;
+
+    if(addr.ss_family == AF_INET6)
+        return memcmp(&((struct sockaddr_in6 *)&addr)->sin6_addr, &((struct sockaddr_in6 *)&remote)->sin6_addr, sizeof(struct in6_addr)) != 0;
+
+    return 1;
+}
+
+/*
+ * Drops the subscriptions a local client holds on other nodes.
+ */
+void cluster_free_client(struct client *client)
+{
+    int i;
+
+    if(client->route == 0 || client->peer)
+        return;
+
+    cluster_remove_route(client);
+
+    for(i=0; i < peer_count; i++){
+        cluster_forget(&peers[i], client->route, NULL);
+
+        if(peers[i].connected == 0)
+            continue;
+
+        evbuffer_add_printf(bufferevent_get_output(peers[i].bev), "DISCONNECT\nroute:%u\n\n", client->route);
+        evbuffer_add(bufferevent_get_output(peers[i].bev), "\0", 1);
+    }
+}
+
+int cluster_init(struct event_base *base)
+{
+    struct node *node;
+    char point[MAXQUEUELEN];
+    int found = 0;
+    int i, v;
+
+    cluster_base = base;
+
+    if(TAILQ_EMPTY(&nodes))
+        return 0;
+
+    if(strlen(configget("clusterSelf")) == 0){
+        snprintf(point, sizeof(point), "%s:%s", configget("listenIP"), configget("listenPort"));
+        configset("clusterSelf", point);
+    }
+
+    TAILQ_FOREACH(node, &nodes, entries) {
+        peer_count++;
+    }
+
+    peers = calloc(peer_count, sizeof(*peers));
+    ring = calloc(peer_count * CLUSTERVNODES, sizeof(*ring));
+    if(peers == NULL || ring == NULL)
+        return 1;
+
+    i = 0;
+    TAILQ_FOREACH(node, &nodes, entries) {
+        peers[i].node = node;
+        TAILQ_INIT(&peers[i].subscriptions);
+
+        for(v=0; v < CLUSTERVNODES; v++){
+            snprintf(point, sizeof(point), "%s#%d", node->address, v);
+            ring[ring_size].hash = cluster_hash(point, strlen(point));
+            ring[ring_size].peer = &peers[i];
+            ring_size++;
+        }
+
+        if(strcmp(node->address, configget("clusterSelf")) == 0){
+            found = 1;
+            for(v=ring_size-CLUSTERVNODES; v < ring_size; v++)
+                ring[v].peer = NULL;
+        }
+        else {
+            peers[i].ev_reconnect = evtimer_new(base, cluster_connect, &peers[i]);
+            cluster_connect(-1, 0, &peers[i]);
+        }
+
+        i++;
+    }
+
+    if(found == 0){
+        logerror("Cluster node %s is not in the node list", configget("clusterSelf"));
+        return 1;
+    }
+
+    qsort(ring, ring_size, sizeof(*ring), cluster_point_cmp);
+
+    loginfo("Cluster of %d nodes, this is %s", peer_count, configget("clusterSelf"));
+
+    return 0;
+}
+
+int cluster_free(void)
+{
+    int i;
+
+    for(i=0; i < peer_count; i++){
+        while(!TAILQ_EMPTY(&peers[i].subscriptions))
+            cluster_forget(&peers[i], TAILQ_FIRST(&peers[i].subscriptions)->route, NULL);
+        if(peers[i].bev != NULL)
+            bufferevent_free(peers[i].bev);
+        if(peers[i].ev_reconnect != NULL)
+            event_free(peers[i].ev_reconnect);
+    }
+
+    free(peers);
+    free(ring);
+    free(routes);
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "dedup.h"
+
+/*
+ * Duplicate detection for idempotent producers. A producer which
+ * retries a SEND after a lost RECEIPT gives every message an id in
+ * the dedup-id header, and a destination with the dedup=N option of
+ * its policy drops a message whose id is among the last N ids it
+ * has taken.
+ *
+ * Only a 64 bit fingerprint of every id is kept, in a ring ordered
+ * by arrival and in an open addressing hash table for the lookup,
+ * which is 24 bytes per id regardless of the length of the ids.
+ * Unlike a bloom or cuckoo filter this never drops a message which
+ * was not sent before, unless two fingerprints collide. The storage
+ * keeps the ids of a queue next to its messages, written in the same
+ * batch (see leveldb.c), so the window survives a restart.
+ */
+struct dedup {
+    u_int window;
+
+    /* Number of the next id, the ring holds the last count ones */
+    u_int seq;
+    u_int count;
+    u_int64_t *ring;
+
+    /* Number the next id written to the storage gets, ids of messages
+     * which are only kept in memory have none */
+    u_int stored;
+
+    /* Fingerprints with linear probing, 0 is a free slot */
+    u_int64_t *table;
+    u_int mask;
+};
+
+static u_int64_t dedup_hash(const char *data)
+{
+    u_int64_t hash = 14695981039346656037ULL;
+
+    while(*data != '\0'){
+        hash ^= (unsigned char)*data++;
+        hash *= 1099511628211ULL;
+    }
+
+    /* Spreads the bits for the table index */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash != 0 ? hash : 1;
+}
+
+u_int dedup_window(struct queue *queue)
+{
+    return queue->policy->dedup;
+}
+
+/*
+ * Fingerprint of the producer id of a message, 0 if it has none or
+ * the destination does not look for duplicates.
+ */
+u_int64_t dedup_id(struct queue *queue, struct evkeyvalq *headers)
+{
+    const char *id;
+
+    if(dedup_window(queue) == 0)
+        return 0;
+
+    id = evhttp_find_header(headers, DEDUP_HEADER);
+    if(id == NULL || *id == '\0')
+        return 0;
+
+    return dedup_hash(id);
+}
+
+static struct dedup* dedup_create(struct queue *queue)
+{
+    struct dedup *dedup;
+    u_int size = 2;
+
+    dedup = calloc(1, sizeof(*dedup));
+    if(dedup == NULL)
+        return NULL;
+
+    /* At most half full */
+    dedup->window = dedup_window(queue);
+    while(size < dedup->window*2)
+        size <<= 1;
+
+    dedup->mask = size-1;
+    dedup->ring = malloc(dedup->window*sizeof(*dedup->ring));
+    dedup->table = calloc(size, sizeof(*dedup->table));
+    if(dedup->ring == NULL || dedup->table == NULL){
+        free(dedup->ring);
+        free(dedup->table);
+        free(dedup);
+        return NULL;
+    }
+
+    return dedup;
+}
+
+int dedup_find(struct queue *queue, u_int64_t id)
+{
+    struct dedup *dedup = queue->dedup;
+    u_int i;
+
+    if(dedup == NULL)
+        return 0;
+
+    for(i = id & dedup->mask; dedup->table[i] != 0; i = (i+1) & dedup->mask){
+        if(dedup->table[i] == id)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Removes a fingerprint and moves the following ones of its probe
+ * sequence back, so no tombstones are needed.
+ */
+static void dedup_remove(struct dedup *dedup, u_int64_t id)
+{
+    u_int i, j, home;
+
+    for(i = id & dedup->mask; dedup->table[i] != id; i = (i+1) & dedup->mask){
+        if(dedup->table[i] == 0)
+            return;
+    }
+
+    for(j = (i+1) & dedup->mask; dedup->table[j] != 0; j = (j+1) & dedup->mask){
+        home = dedup->table[j] & dedup->mask;
+
+        /* Stays if its home lies cyclically in (i, j] */
+        if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        dedup->table[i] = dedup->table[j];
+        i = j;
+    }
+
+    dedup->table[i] = 0;
+}
+
+/*
+ * Records the id of a message which was taken, the oldest one falls
+ * out of the window. If stored, its number in the storage is the one
+ * dedup_next() returned.
+ */
+int dedup_add(struct queue *queue, u_int64_t id, int stored)
+{
+    struct dedup *dedup;
+    u_int slot, i;
+
+    if(queue->dedup == NULL && (queue->dedup = dedup_create(queue)) == NULL){
+        logerror("Dedup index of %s failed: Out of memory", queue->queuename);
+        return 1;
+    }
+
+    dedup = queue->dedup;
+    slot = dedup->seq % dedup->window;
+
+    if(dedup->count == dedup->window)
+        dedup_remove(dedup, dedup->ring[slot]);
+    else
+        dedup->count++;
+
+    dedup->ring[slot] = id;
+    dedup->seq++;
+    if(stored)
+        dedup->stored++;
+
+    for(i = id & dedup->mask; dedup->table[i] != 0; i = (i+1) & dedup->mask)
+        ;
+    dedup->table[i] = id;
+
+    return 0;
+}
+
+/*
+ * Adds an id loaded from the storage, in the order of their numbers.
+ */
+void dedup_restore(struct queue *queue, u_int seq, u_int64_t id)
+{
+    if(queue->dedup == NULL && (queue->dedup = dedup_create(queue)) == NULL)
+        return;
+
+    if(dedup_find(queue, id))
+        return;
+
+    queue->dedup->stored = seq;
+    dedup_add(queue, id, 1);
+}
+
+/*
+ * Number the next id will get in the storage.
+ */
+u_int dedup_next(struct queue *queue)
+{
+    return queue->dedup != NULL ? queue->dedup->stored : 0;
+}
+
+void dedup_free(struct queue *queue)
+{
+    if(queue->dedup == NULL)
+        return;
+
+    free(queue->dedup->ring);
+    free(queue->dedup->table);
+    free(queue->dedup);
+    queue->dedup = NULL;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "log.h"
+#include "util.h"
+#include "server.h"
+#include "client.h"
+#include "stomp.h"
+#include "stomputil.h"
+#include "leveldb.h"
+#include "durable.h"
+
+/*
+ * Durable topic subscriptions. A topic with durable subscriptions
+ * keeps every message once in its log, the DURABLE_PRIORITY bucket
+ * of the topic, and each durable subscription only a cursor into it.
+ * A connected subscriber which is up to date gets new messages from
+ * the fan-out like any other. One which is behind, or whose prefetch
+ * window is full, reads them back from the log, durableBatch messages
+ * per loop iteration, and goes live again once it reaches the end.
+ *
+ * The cursors of a topic are stored together under one key every
+ * durableSync milliseconds instead of with every message, and the
+ * log is trimmed up to the slowest subscription in the same write.
+ * After a crash a subscriber may get the messages of the last
+ * durableSync milliseconds once more.
+ */
+static struct event *ev_sync;
+
+static int durable_batch;
+
+static void durable_on_catchup(int fd, short ev, void *arg);
+
+int durable_active(struct queue *queue)
+{
+    return !TAILQ_EMPTY(&queue->durables);
+}
+
+struct durable* durable_find(struct queue *queue, const char *name)
+{
+    struct durable *durable;
+
+    TAILQ_FOREACH(durable, &queue->durables, entries) {
+        if(strcmp(durable->name, name) == 0)
+            return durable;
+    }
+
+    return NULL;
+}
+
+static struct durable* durable_new(struct queue *queue, const char *name, u_int acked)
+{
+    struct durable *durable;
+
+    durable = calloc(1, sizeof(*durable));
+    if(durable == NULL)
+        return NULL;
+
+    durable->name = strdup(name);
+    durable->ev = event_new(base, -1, 0, durable_on_catchup, durable);
+    if(durable->name == NULL || durable->ev == NULL){
+        if(durable->ev != NULL)
+            event_free(durable->ev);
+        free(durable->name);
+        free(durable);
+        return NULL;
+    }
+
+    durable->cursor = durable->acked = acked;
+    TAILQ_INSERT_TAIL(&queue->durables, durable, entries);
+
+    return durable;
+}
+
+static void durable_release(struct queue *queue, struct durable *durable)
+{
+    if(durable->subscription != NULL)
+        durable->subscription->durable = NULL;
+
+    TAILQ_REMOVE(&queue->durables, durable, entries);
+    event_free(durable->ev);
+    free(durable->name);
+    free(durable);
+}
+
+/*
+ * Stores the cursors of a topic and drops the messages of its log
+ * which every durable subscription acknowledged, all of them once
+ * the last durable subscription is gone.
+ */
+static int durable_sync(struct queue *queue)
+{
+    struct bucket *bucket = &queue->buckets[DURABLE_PRIORITY];
+    struct durable *durable;
+    struct evbuffer *record;
+    u_int from = bucket->read;
+    u_int lowest = bucket->write - 1;
+    size_t len;
+    int ret;
+
+    record = evbuffer_new();
+    if(record == NULL)
+        return 1;
+
+    /* Compared as distances from the last dropped message */
+    TAILQ_FOREACH(durable, &queue->durables, entries) {
+        evbuffer_add_printf(record, "%u %s\n", durable->acked, durable->name);
+        if(durable->acked - (from-1) < lowest - (from-1))
+            lowest = durable->acked;
+    }
+
+    bucket->read = lowest+1;
+
+    len = evbuffer_get_length(record);
+    ret = leveldb_sync_durables(queue, (char *)evbuffer_pullup(record, len), len, from, bucket->read - from);
+    evbuffer_free(record);
+
+    if(ret == 0)
+        queue->durable_dirty = 0;
+
+    return ret;
+}
+
+static void durable_on_sync(int fd, short ev, void *arg)
+{
+    durable_flush();
+}
+
+/*
+ * Stores the cursors of all topics which moved since.
+ */
+void durable_flush(void)
+{
+    struct queue *queue;
+
+    TAILQ_FOREACH(queue, &queues, entries) {
+        if(queue->durable_dirty)
+            durable_sync(queue);
+    }
+}
+
+int durable_restore(struct queue *queue, const char *name, u_int acked)
+{
+    return durable_new(queue, name, acked) == NULL;
+}
+
+static int durable_full(struct durable *durable)
+{
+    struct subscription *subscription = durable->subscription;
+
+    return subscription->ack == ACK_CLIENT && durable->cursor - durable->acked >= subscription->prefetch;
+}
+
+static void durable_advance(struct durable *durable, u_int seq)
+{
+    durable->cursor = seq;
+    if(durable->subscription->ack == ACK_AUTO)
+        durable->acked = seq;
+
+    durable->subscription->queue->durable_dirty = 1;
+}
+
+/*
+ * Reads the log from the cursor on, unless the subscriber is up to
+ * date.
+ */
+static void durable_catchup(struct durable *durable)
+{
+    struct queue *queue = durable->subscription->queue;
+
+    durable->catchup = (durable->cursor+1 != queue->buckets[DURABLE_PRIORITY].write);
+    if(durable->catchup)
+        event_active(durable->ev, EV_TIMEOUT, 0);
+}
+
+static void durable_on_catchup(int fd, short ev, void *arg)
+{
+    struct durable *durable = (struct durable *)arg;
+    struct subscription *subscription = durable->subscription;
+    int count;
+
+    if(subscription == NULL)
+        return;
+
+    for(count = 0; count < durable_batch; count++){
+        /* Up to date, the fan-out takes over */
+        if(durable->cursor+1 == subscription->queue->buckets[DURABLE_PRIORITY].write){
+            durable->catchup = 0;
+            return;
+        }
+
+        /* Continued by durable_ack() or durable_resume() */
+        if(durable_full(durable) || stomp_output_length(subscription->client) >= MAXOUTPUTBUF)
+            return;
+
+        durable_advance(durable, durable->cursor+1);
+        stomp_deliver_stored(subscription, DURABLE_PRIORITY, durable->cursor);
+    }
+
+    event_active(durable->ev, EV_TIMEOUT, 0);
+}
+
+/*
+ * Attaches a subscription to the durable subscription of the given
+ * name, a new one starts at the end of the log. Messages which were
+ * not acknowledged are sent again.
+ */
+int durable_subscribe(struct subscription *subscription, const char *name)
+{
+    struct queue *queue = subscription->queue;
+    struct durable *durable;
+
+    durable = durable_find(queue, name);
+    if(durable != NULL && durable->subscription != NULL)
+        return 1;
+
+    if(durable == NULL){
+        durable = durable_new(queue, name, queue->buckets[DURABLE_PRIORITY].write - 1);
+        if(durable == NULL)
+            return 1;
+
+        /* From now on the topic is stored */
+        if(durable_sync(queue) != 0){
+            durable_release(queue, durable);
+            return 1;
+        }
+
+        loginfo("Created durable subscription %s of %s", name, queue->queuename);
+    }
+
+    durable->subscription = subscription;
+    durable->cursor = durable->acked;
+    subscription->durable = durable;
+
+    durable_catchup(durable);
+
+    return 0;
+}
+
+/*
+ * Detaches a subscription which goes away, the durable subscription
+ * stays and collects messages.
+ */
+void durable_unsubscribe(struct subscription *subscription)
+{
+    struct durable *durable = subscription->durable;
+
+    if(durable == NULL)
+        return;
+
+    event_del(durable->ev);
+    durable->catchup = 0;
+    durable->cursor = durable->acked;
+    durable->subscription = NULL;
+    subscription->durable = NULL;
+    subscription->queue->durable_dirty = 1;
+}
+
+/*
+ * Removes a durable subscription which is not attached.
+ */
+int durable_remove(struct queue *queue, const char *name)
+{
+    struct durable *durable;
+
+    durable = durable_find(queue, name);
+    if(durable == NULL || durable->subscription != NULL)
+        return 1;
+
+    durable_release(queue, durable);
+    loginfo("Removed durable subscription %s of %s", name, queue->queuename);
+
+    return durable_sync(queue);
+}
+
+/*
+ * Whether the fan-out may deliver the message with sequence seq of
+ * the log to a durable subscription. A subscription which is behind
+ * reads it from the log later on instead.
+ */
+int durable_live(struct subscription *subscription, u_int seq)
+{
+    struct durable *durable = subscription->durable;
+
+    if(!durable->catchup && seq == durable->cursor+1 && !durable_full(durable)){
+        durable_advance(durable, seq);
+        return 1;
+    }
+
+    if(!durable->catchup && (int)(seq - durable->cursor) > 0)
+        durable_catchup(durable);
+
+    return 0;
+}
+
+/*
+ * Acknowledges all messages of a durable subscription up to the
+ * given one. Returns 0 if the message is not from a durable
+ * subscription of the client.
+ */
+int durable_ack(struct client *client, const char *messageid)
+{
+    struct subscription *subscription;
+    struct durable *durable;
+    char queuename[MAXQUEUELEN];
+    int priority;
+    u_int seq;
+
+    if(stomp_parse_messageid(messageid, queuename, sizeof(queuename), &priority, &seq) != 0)
+        return 0;
+
+    TAILQ_FOREACH(subscription, &client->subscriptions, client_entries) {
+        durable = subscription->durable;
+        if(durable == NULL || subscription->route != client->route || strcmp(subscription->queue->queuename, queuename) != 0)
+            continue;
+
+        if((int)(seq - durable->acked) > 0 && (int)(durable->cursor - seq) >= 0){
+            durable->acked = seq;
+            subscription->queue->durable_dirty = 1;
+
+            if(durable->catchup)
+                event_active(durable->ev, EV_TIMEOUT, 0);
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Called when the output of the subscriber drained.
+ */
+void durable_resume(struct subscription *subscription)
+{
+    if(subscription->durable != NULL && subscription->durable->catchup)
+        event_active(subscription->durable->ev, EV_TIMEOUT, 0);
+}
+
+void durable_forget_queue(struct queue *queue)
+{
+    struct durable *durable;
+
+    if(queue->durable_dirty)
+        durable_sync(queue);
+
+    while((durable = TAILQ_FIRST(&queue->durables)) != NULL)
+        durable_release(queue, durable);
+}
+
+int durable_init(struct event_base *base)
+{
+    struct timeval tv;
+    int interval;
+
+    durable_batch = atoi(configget("durableBatch"));
+    if(durable_batch < 1)
+        durable_batch = 1;
+
+    interval = atoi(configget("durableSync"));
+    if(interval < 1)
+        interval = 1;
+
+    tv.tv_sec = interval / 1000;
+    tv.tv_usec = (interval % 1000) * 1000;
+
+    ev_sync = event_new(base, -1, EV_PERSIST, durable_on_sync, NULL);
+    if(ev_sync == NULL || event_add(ev_sync, &tv) != 0)
+        return 1;
+
+    return 0;
+}
+
+void durable_free(void)
+{
+    durable_flush();
+    event_free(ev_sync);
+}
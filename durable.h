@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DURABLE_H_
+#define _DURABLE_H_
+
+#include <event2/event.h>
+
+/* Header of SUBSCRIBE and UNSUBSCRIBE with the name of a durable subscription */
+#define DURABLE_HEADER "durable"
+
+/* Bucket which holds the log of a topic */
+#define DURABLE_PRIORITY 0
+
+struct queue;
+struct subscription;
+struct client;
+
+/**
+ * A named durable subscription of a topic. Its cursor is the last
+ * message of the topic log sent to the subscriber, acked the last
+ * one it acknowledged, which is where it continues after a restart.
+ */
+struct durable {
+    char *name;
+
+    u_int cursor;
+    u_int acked;
+
+    /* Set while it is connected */
+    struct subscription *subscription;
+
+    /* Set while messages are read back from the log */
+    int catchup;
+    struct event *ev;
+
+    TAILQ_ENTRY(durable) entries;
+};
+
+extern int durable_init(struct event_base *base);
+extern void durable_free(void);
+
+extern int durable_active(struct queue *queue);
+extern struct durable* durable_find(struct queue *queue, const char *name);
+extern int durable_restore(struct queue *queue, const char *name, u_int acked);
+extern int durable_subscribe(struct subscription *subscription, const char *name);
+extern void durable_unsubscribe(struct subscription *subscription);
+extern int durable_remove(struct queue *queue, const char *name);
+extern int durable_live(struct subscription *subscription, u_int seq);
+extern int durable_ack(struct client *client, const char *messageid);
+extern void durable_resume(struct subscription *subscription);
+extern void durable_flush(void);
+extern void durable_forget_queue(struct queue *queue);
+
+#endif /* _DURABLE_H_ */
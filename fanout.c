@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "util.h"
+#include "server.h"
+#include "client.h"
+#include "stomp.h"
+#include "fanout.h"
+#include "durable.h"
+#include "memory.h"
+#include "probes.h"
+
+/*
+ * Fan-out of topic messages. A SEND to a topic is delivered to the
+ * first fanoutBatch subscribers right away. If there are more, a
+ * copy of the message is queued on the topic and the rest gets it
+ * in slices of fanoutBatch subscribers, one slice per loop
+ * iteration, so a broadcast to a huge topic does not hold up the
+ * other connections. The messages of a topic are sent out one after
+ * the other, which keeps their order for every subscriber, and a
+ * subscription made after the SEND does not get the message.
+ *
+ * How long it took until the last subscriber got a queued message
+ * is the fan-out lag, which is logged on SIGUSR1. Queued copies count
+ * against the memory limits of the topic, so producers are paused or
+ * rejected by its memory policy when subscribers fall behind.
+ */
+static struct event *ev_report;
+
+static int fanout_batch;
+
+/* Serial of the last subscription */
+static u_int64_t fanout_serial;
+
+/* Queued messages, the ones sent out since the last report and their lag */
+static u_int fanout_pending;
+static u_int fanout_done;
+static u_int64_t fanout_lag_last;
+static u_int64_t fanout_lag_max;
+
+/* Zero timeout, a slice runs after the next poll for I/O */
+static const struct timeval fanout_next_iteration = { 0, 0 };
+
+static void fanout_on_slice(int fd, short ev, void *arg);
+
+/*
+ * Delivers a message to the next subscribers of the topic, as long
+ * as the budget lasts. Returns 1 when all subscribers got it.
+ */
+static int fanout_slice(struct queue *queue, struct evkeyvalq *headers, char *body, u_int seq, u_int64_t serial, int *budget)
+{
+    struct subscription *subscription;
+
+    /* Subscribers are in the order they subscribed */
+    while((subscription = queue->fanout_next) != NULL && subscription->serial <= serial){
+        if(*budget <= 0)
+            return 0;
+
+        (*budget)--;
+        queue->fanout_next = TAILQ_NEXT(subscription, entries);
+
+#ifdef WITH_LEVELDB
+        /* Durable subscriptions which are behind read the log */
+        if(subscription->durable != NULL && seq != 0 && !durable_live(subscription, seq))
+            continue;
+#endif
+
+        stomp_deliver(subscription, headers, body);
+    }
+
+    queue->fanout_next = NULL;
+
+    return 1;
+}
+
+static void fanout_release(struct queue *queue, struct fanout *fanout)
+{
+    TAILQ_REMOVE(&queue->fanouts, fanout, entries);
+    memory_unhold(queue, fanout->bytes);
+    evhttp_clear_headers(&fanout->headers);
+    free(fanout->body);
+    free(fanout);
+
+    fanout_pending--;
+
+    /* The next message starts at the first subscriber */
+    queue->fanout_next = TAILQ_FIRST(&queue->subscribers);
+}
+
+/*
+ * Works on the queued messages of a topic until budget subscribers
+ * got one.
+ */
+static void fanout_run(struct queue *queue, int budget)
+{
+    struct fanout *fanout;
+    u_int64_t lag;
+
+    while((fanout = TAILQ_FIRST(&queue->fanouts)) != NULL){
+        if(!fanout_slice(queue, &fanout->headers, fanout->body, fanout->seq, fanout->serial, &budget))
+            break;
+
+        lag = mstime() - fanout->queued;
+        REDQ_PROBE2(fanout_done, queue->queuename, lag);
+        fanout_lag_last = lag;
+        if(lag > fanout_lag_max)
+            fanout_lag_max = lag;
+        fanout_done++;
+
+        fanout_release(queue, fanout);
+    }
+
+    if(!TAILQ_EMPTY(&queue->fanouts))
+        event_add(queue->ev_fanout, &fanout_next_iteration);
+}
+
+static void fanout_on_slice(int fd, short ev, void *arg)
+{
+    fanout_run((struct queue *)arg, fanout_batch);
+}
+
+/*
+ * Sends a message to all subscribers of a topic, the ones which do
+ * not get it right away later on. seq is its sequence in the log of
+ * the topic if it is stored for durable subscriptions.
+ */
+int fanout_send(struct queue *queue, struct evkeyvalq *headers, char *body, u_int seq)
+{
+    struct fanout *fanout;
+    struct evkeyval *header;
+    int budget = fanout_batch;
+
+    REDQ_PROBE1(fanout_start, queue->queuename);
+
+    if(TAILQ_EMPTY(&queue->fanouts)){
+        queue->fanout_next = TAILQ_FIRST(&queue->subscribers);
+        if(fanout_slice(queue, headers, body, seq, fanout_serial, &budget)){
+            REDQ_PROBE2(fanout_done, queue->queuename, 0);
+            return 0;
+        }
+    }
+
+    if(queue->ev_fanout == NULL && (queue->ev_fanout = evtimer_new(base, fanout_on_slice, queue)) == NULL)
+        goto error;
+
+    fanout = calloc(1, sizeof(*fanout));
+    if(fanout == NULL)
+        goto error;
+
+    fanout->bytes = sizeof(*fanout);
+
+    TAILQ_INIT(&fanout->headers);
+    TAILQ_FOREACH(header, headers, next) {
+        evhttp_add_header(&fanout->headers, header->key, header->value);
+        fanout->bytes += sizeof(*header) + strlen(header->key) + strlen(header->value) + 2;
+    }
+
+    if(body != NULL && (fanout->body = strdup(body)) == NULL){
+        evhttp_clear_headers(&fanout->headers);
+        free(fanout);
+        goto error;
+    }
+
+    if(body != NULL)
+        fanout->bytes += strlen(body) + 1;
+
+    fanout->serial = fanout_serial;
+    fanout->seq = seq;
+    fanout->queued = mstime();
+
+    TAILQ_INSERT_TAIL(&queue->fanouts, fanout, entries);
+    memory_hold(queue, fanout->bytes);
+    fanout_pending++;
+
+    event_add(queue->ev_fanout, &fanout_next_iteration);
+
+    return 0;
+
+error:
+    logerror("Fan-out to %s failed: Out of memory", queue->queuename);
+
+    /* A message which was partly delivered is not sent again */
+    if(TAILQ_EMPTY(&queue->fanouts))
+        queue->fanout_next = NULL;
+
+    return 1;
+}
+
+/*
+ * Sends out all queued messages, before the connections are handed
+ * off to a new process.
+ */
+void fanout_flush(void)
+{
+    struct queue *queue;
+
+    TAILQ_FOREACH(queue, &queues, entries) {
+        if(!TAILQ_EMPTY(&queue->fanouts)){
+            fanout_run(queue, INT_MAX);
+            event_del(queue->ev_fanout);
+        }
+    }
+}
+
+void fanout_subscribe(struct subscription *subscription)
+{
+    subscription->serial = ++fanout_serial;
+}
+
+/*
+ * Moves the position of the current fan-out past a subscription
+ * which goes away.
+ */
+void fanout_unsubscribe(struct subscription *subscription)
+{
+    if(subscription->queue->fanout_next == subscription)
+        subscription->queue->fanout_next = TAILQ_NEXT(subscription, entries);
+}
+
+void fanout_forget_queue(struct queue *queue)
+{
+    struct fanout *fanout;
+
+    while((fanout = TAILQ_FIRST(&queue->fanouts)) != NULL)
+        fanout_release(queue, fanout);
+
+    if(queue->ev_fanout != NULL)
+        event_free(queue->ev_fanout);
+}
+
+static void fanout_on_report(int fd, short ev, void *arg)
+{
+    struct queue *queue;
+    struct fanout *fanout;
+    u_int count;
+
+    loginfo("Fan-out: %u messages pending, %u sent out in slices, lag %llu ms, max %llu ms", fanout_pending, fanout_done,
+        (unsigned long long)fanout_lag_last, (unsigned long long)fanout_lag_max);
+
+    TAILQ_FOREACH(queue, &queues, entries) {
+        if(TAILQ_EMPTY(&queue->fanouts))
+            continue;
+
+        count = 0;
+        TAILQ_FOREACH(fanout, &queue->fanouts, entries) {
+            count++;
+        }
+
+        loginfo("Fan-out: %s %u messages pending, oldest %llu ms", queue->queuename, count,
+            (unsigned long long)(mstime() - TAILQ_FIRST(&queue->fanouts)->queued));
+    }
+
+    fanout_done = 0;
+    fanout_lag_max = 0;
+}
+
+int fanout_init(struct event_base *base)
+{
+    fanout_batch = atoi(configget("fanoutBatch"));
+    if(fanout_batch < 1)
+        fanout_batch = 1;
+
+    ev_report = evsignal_new(base, SIGUSR1, fanout_on_report, NULL);
+    if(ev_report == NULL || event_add(ev_report, NULL) != 0)
+        return 1;
+
+    return 0;
+}
+
+void fanout_free(void)
+{
+    event_free(ev_report);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <event2/event.h>
+#include <event2/keyvalq_struct.h>
+
+struct queue;
+struct subscription;
+
+/**
+ * A topic message which is still being sent out to the subscribers
+ * of the topic, in slices of fanoutBatch subscribers.
+ */
+struct fanout {
+    struct evkeyvalq headers;
+    char *body;
+
+    /* Subscribers up to this serial were there when it was sent */
+    u_int64_t serial;
+
+    /* Sequence in the log of the topic, 0 if it is not stored */
+    u_int seq;
+
+    /* Time it was sent, for the fan-out lag */
+    u_int64_t queued;
+
+    /* Size of the copy, charged to the topic */
+    size_t bytes;
+
+    TAILQ_ENTRY(fanout) entries;
+};
+
+extern int fanout_init(struct event_base *base);
+extern void fanout_free(void);
+
+extern int fanout_send(struct queue *queue, struct evkeyvalq *headers, char *body, u_int seq);
+extern void fanout_flush(void);
+
+extern void fanout_subscribe(struct subscription *subscription);
+extern void fanout_unsubscribe(struct subscription *subscription);
+extern void fanout_forget_queue(struct queue *queue);
+
+#endif /* _FANOUT_H_ */
@@ -0,0 +1,808 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* struct ucred */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "log.h"
+#include "util.h"
+#include "server.h"
+#include "client.h"
+#include "stomp.h"
+#include "stomputil.h"
+#include "ratelimit.h"
+#include "fanout.h"
+#include "durable.h"
+#include "handoff.h"
+#ifdef WITH_LEVELDB
+#include "leveldb.h"
+#endif
+#ifdef WITH_URING
+#include "uring.h"
+#endif
+
+/*
+ * Graceful upgrade. A running redqd listens on handoffSocket. A new
+ * redqd started with the same config connects to it and takes over
+ * the listening sockets and the client connections. Each of them
+ * comes with the session (authentication, login, subscriptions)
+ * and the bytes still buffered in both directions. The queues follow
+ * with their deliver pointers and unacknowledged messages. The old
+ * process then closes the storage and sends "end", after which the
+ * new one opens it. Clients do not notice anything.
+ *
+ * Every message on the Unix socket is a 32 bit length, a text payload
+ * and optionally a descriptor passed with SCM_RIGHTS. The socket lives
+ * in a directory only its owner can write to and both sides check
+ * that the other one runs as the same user.
+ *
+ * Replication followers are not handed off, they reconnect to the new
+ * process and get a new snapshot.
+ */
+struct handoffrecord {
+    int fd;
+    struct evbuffer *payload;
+
+    TAILQ_ENTRY(handoffrecord) entries;
+};
+
+static TAILQ_HEAD(, handoffrecord) records = TAILQ_HEAD_INITIALIZER(records);
+
+static int received_listeners[MAXLISTENERS];
+static int received_count;
+
+/* Old process */
+static int handoff_listen = -1;
+static struct event *ev_handoff;
+static int *listeners;
+static int listener_count;
+static int handoff_conn = -1;
+
+
+static int handoff_write(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while(len > 0){
+        n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 1;
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int handoff_send(int conn, int fd, struct evbuffer *payload)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    u_int32_t len;
+    size_t chunk;
+
+    len = htonl(evbuffer_get_length(payload));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd >= 0){
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if(sendmsg(conn, &msg, 0) != sizeof(len))
+        return 1;
+
+    while((chunk = evbuffer_get_length(payload)) > 0){
+        if(handoff_write(conn, evbuffer_pullup(payload, chunk > 65536 ? 65536 : chunk), chunk > 65536 ? 65536 : chunk) != 0)
+            return 1;
+        evbuffer_drain(payload, chunk > 65536 ? 65536 : chunk);
+    }
+
+    return 0;
+}
+
+static int handoff_send_line(int conn, int fd, const char *line)
+{
+    struct evbuffer *payload;
+    int ret;
+
+    payload = evbuffer_new();
+    if(payload == NULL)
+        return 1;
+
+    evbuffer_add_printf(payload, "%s\n", line);
+    ret = handoff_send(conn, fd, payload);
+    evbuffer_free(payload);
+
+    return ret;
+}
+
+/*
+ * Reads exactly len bytes, the descriptor of the message arrives
+ * with the first ones.
+ */
+static int handoff_recv(int conn, void *data, size_t len, int *fd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t n;
+
+    while(len > 0){
+        iov.iov_base = data;
+        iov.iov_len = len;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if(fd != NULL){
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+        }
+
+        n = recvmsg(conn, &msg, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 1;
+
+        if(fd != NULL){
+            for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+                if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+
+            /* Descriptors beyond the one expected were discarded */
+            if(msg.msg_flags & MSG_CTRUNC){
+                logerror("Handoff message with truncated control data");
+                if(*fd >= 0)
+                    close(*fd);
+                *fd = -1;
+                return 1;
+            }
+
+            fd = NULL;
+        }
+
+        data = (char *)data + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the process at the other end of conn runs as this user.
+ */
+static int handoff_trusted(int conn)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if(getpeereid(conn, &uid, &gid) != 0)
+        return 0;
+
+    return uid == geteuid();
+#endif
+}
+
+/*
+ * Whether the directory of path can only be changed by this user
+ * (or root), so nobody else can put a socket there.
+ */
+static int handoff_private_dir(const char *path)
+{
+    char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct stat st;
+    char *slash;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if(slash == NULL)
+        strcpy(dir, ".");
+    else if(slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    if(stat(dir, &st) != 0)
+        return 0;
+
+    return (st.st_uid == geteuid() || st.st_uid == 0) && (st.st_mode & (S_IWGRP|S_IWOTH)) == 0;
+}
+
+static int handoff_connect(const char *path, int *conn)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+    strcpy(addr.sun_path, path);
+
+    *conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(*conn < 0)
+        return 1;
+
+    if(connect(*conn, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        close(*conn);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Takes over from a running redqd if one listens on handoffSocket.
+ * Called before the storage is opened, returns once the previous
+ * process closed it.
+ */
+int handoff_receive(void)
+{
+    struct handoffrecord *record;
+    struct evbuffer *payload;
+    const char *path = configget("handoffSocket");
+    u_int32_t len;
+    char *line;
+    int conn, fd, clients = 0;
+
+    if(strlen(path) == 0 || handoff_connect(path, &conn) != 0)
+        return 0;
+
+    if(!handoff_trusted(conn)){
+        logerror("Process on %s runs as another user, not taking over", path);
+        close(conn);
+        return 1;
+    }
+
+    loginfo("Taking over from the running process on %s", path);
+
+    for(;;){
+        fd = -1;
+        if(handoff_recv(conn, &len, sizeof(len), &fd) != 0)
+            goto error;
+
+        len = ntohl(len);
+        payload = evbuffer_new();
+        if(payload == NULL)
+            goto error;
+
+        while(evbuffer_get_length(payload) < len){
+            if(evbuffer_read(payload, conn, len - evbuffer_get_length(payload)) <= 0){
+                evbuffer_free(payload);
+                goto error;
+            }
+        }
+
+        line = evbuffer_readln(payload, NULL, EVBUFFER_EOL_LF);
+        if(line == NULL){
+            evbuffer_free(payload);
+            goto error;
+        }
+
+        if(strcmp(line, "end") == 0){
+            free(line);
+            evbuffer_free(payload);
+            break;
+        }
+
+        if(strcmp(line, "listen") == 0 && fd >= 0 && received_count < MAXLISTENERS){
+            received_listeners[received_count++] = fd;
+            evbuffer_free(payload);
+        }
+        else {
+            record = calloc(1, sizeof(*record));
+            if(record == NULL){
+                free(line);
+                evbuffer_free(payload);
+                goto error;
+            }
+
+            /* The first line goes back in front for handoff_restore() */
+            evbuffer_prepend(payload, "\n", 1);
+            evbuffer_prepend(payload, line, strlen(line));
+
+            if(fd >= 0)
+                clients++;
+            record->fd = fd;
+            record->payload = payload;
+            TAILQ_INSERT_TAIL(&records, record, entries);
+        }
+
+        free(line);
+    }
+
+    close(conn);
+
+    loginfo("Took over %d listening socket(s) and %d connection(s)", received_count, clients);
+
+    return 0;
+
+error:
+    logerror("Handoff from the running process failed");
+    close(conn);
+
+    return 1;
+}
+
+int handoff_listeners(int *fds, int max)
+{
+    int i;
+
+    for(i = 0; i < received_count && i < max; i++)
+        fds[i] = received_listeners[i];
+
+    return i;
+}
+
+static void handoff_restore_client(struct handoffrecord *record, char *line)
+{
+    struct client *client;
+    struct subscription *subscription = NULL;
+    struct inflight *inflight;
+    struct queue *queue;
+    struct evbuffer *input, *output;
+    char *name;
+    int ack, priority, n;
+    u_int prefetch, seq, count;
+    unsigned long long shared;
+    size_t len;
+
+    client = client_new(record->fd);
+
+    client->authenticated = strtol(line+7, &name, 10);
+    if(*name == ' ' && name[1] != '\0')
+        ratelimit_login(client, name+1);
+
+    while((line = evbuffer_readln(record->payload, NULL, EVBUFFER_EOL_LF)) != NULL){
+        if(sscanf(line, "sub %d %u %n", &ack, &prefetch, &n) == 2){
+            name = line+n;
+            subscription = NULL;
+
+            queue = stomp_find_queue(name);
+            if(queue == NULL && (queue = stomp_add_queue(name)) == NULL){
+                logwarn("Handoff: Subscription to %s of client %d lost", name, client->fd);
+                free(line);
+                continue;
+            }
+
+            if(stomp_is_temporary(name) && queue->owner == NULL)
+                queue->owner = client;
+
+            subscription = stomp_add_subscription(client, queue);
+            if(subscription != NULL){
+                subscription->ack = ack;
+                subscription->prefetch = prefetch;
+            }
+        }
+#ifdef WITH_LEVELDB
+        else if(strncmp(line, "durable ", 8) == 0){
+            if(subscription != NULL && durable_subscribe(subscription, line+8) != 0)
+                logwarn("Handoff: Durable subscription %s of client %d lost", line+8, client->fd);
+        }
+#endif
+        else if((n = sscanf(line, "inflight %d %u %u %llx", &priority, &seq, &count, &shared)) >= 3){
+            /* Without the shared id of an earlier version the message
+             * is kept until the record is dropped or purged */
+            if(subscription != NULL && priority >= 0 && priority < MAXPRIORITY &&
+               (inflight = calloc(1, sizeof(*inflight))) != NULL){
+                inflight->subscription = subscription;
+                inflight->priority = priority;
+                inflight->seq = seq;
+                inflight->shared = (n == 4) ? shared : 0;
+                inflight->count = count;
+                subscription->inflight++;
+                TAILQ_INSERT_TAIL(&subscription->queue->inflight, inflight, entries);
+                stomp_track_inflight(subscription->queue, inflight);
+            }
+        }
+        else if(sscanf(line, "input %zu", &len) == 1){
+            /* The end of a socket bufferevent's input is frozen */
+            input = bufferevent_get_input(client->bev);
+            evbuffer_unfreeze(input, 0);
+            evbuffer_remove_buffer(record->payload, input, len);
+            evbuffer_freeze(input, 0);
+        }
+        else if(sscanf(line, "output %zu", &len) == 1){
+            if((output = evbuffer_new()) != NULL){
+                evbuffer_remove_buffer(record->payload, output, len);
+                stomp_write_buffer(client, output);
+                evbuffer_free(output);
+            }
+        }
+
+        free(line);
+    }
+
+    /* Frames which were already received */
+    if(evbuffer_get_length(bufferevent_get_input(client->bev)) > 0)
+        bufferevent_trigger(client->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+static void handoff_restore_queue(struct handoffrecord *record, char *name)
+{
+    struct queue *queue;
+    struct bucket *bucket;
+    struct inflight *inflight;
+    char *line;
+    int priority;
+    u_int seq, count;
+    u_int64_t wait;
+
+    queue = stomp_find_queue(name);
+    if(queue == NULL && (queue = stomp_add_queue(name)) == NULL){
+        logwarn("Handoff: State of %s lost, its unacknowledged messages are delivered again", name);
+        return;
+    }
+
+    while((line = evbuffer_readln(record->payload, NULL, EVBUFFER_EOL_LF)) != NULL){
+        if(sscanf(line, "bucket %d %u", &priority, &seq) == 2 && priority >= 0 && priority < MAXPRIORITY){
+            bucket = &queue->buckets[priority];
+            if(seq - bucket->read <= bucket->write - bucket->read){
+                bucket->deliver = seq;
+                if(bucket->deliver == bucket->write)
+                    queue->pending &= ~(1 << priority);
+            }
+        }
+        else if(sscanf(line, "redeliver %d %u %u %llu", &priority, &seq, &count, (unsigned long long *)&wait) == 4 &&
+                priority >= 0 && priority < MAXPRIORITY){
+            inflight = calloc(1, sizeof(*inflight));
+            if(inflight != NULL){
+                inflight->priority = priority;
+                inflight->seq = seq;
+                inflight->count = count;
+                inflight->due = mstime() + wait;
+                TAILQ_INSERT_TAIL(&queue->redeliver, inflight, entries);
+                stomp_track_inflight(queue, inflight);
+            }
+        }
+
+        free(line);
+    }
+}
+
+/*
+ * Creates the clients and the queue state received by
+ * handoff_receive(), once everything else is initialized.
+ */
+int handoff_restore(void)
+{
+    struct handoffrecord *record;
+    struct queue *queue;
+    char *line;
+
+    while((record = TAILQ_FIRST(&records)) != NULL){
+        TAILQ_REMOVE(&records, record, entries);
+
+        line = evbuffer_readln(record->payload, NULL, EVBUFFER_EOL_LF);
+        if(line != NULL && strncmp(line, "client ", 7) == 0 && record->fd >= 0)
+            handoff_restore_client(record, line);
+        else if(line != NULL && strncmp(line, "queue ", 6) == 0)
+            handoff_restore_queue(record, line+6);
+        else if(record->fd >= 0)
+            close(record->fd);
+
+        free(line);
+        evbuffer_free(record->payload);
+        free(record);
+    }
+
+    /* Deliver what arrived in the meantime */
+    TAILQ_FOREACH(queue, &queues, entries)
+        stomp_dispatch(queue);
+
+    return 0;
+}
+
+static void handoff_add_bytes(struct evbuffer *payload, const char *name, struct evbuffer *buffer)
+{
+    size_t len = evbuffer_get_length(buffer);
+
+    evbuffer_add_printf(payload, "%s %zu\n", name, len);
+    if(len > 0)
+        evbuffer_add(payload, evbuffer_pullup(buffer, len), len);
+}
+
+/*
+ * Sends everything to the new process. The buffers of the clients
+ * are copied, so this process can go on if the handoff fails.
+ */
+static int handoff_send_all(int conn)
+{
+    struct client *client;
+    struct subscription *subscription;
+    struct inflight *inflight;
+    struct queue *queue;
+    struct evbuffer *payload;
+    const char *login;
+    size_t header;
+    u_int64_t now;
+    int i, priority;
+
+    for(i = 0; i < listener_count; i++){
+        if(handoff_send_line(conn, listeners[i], "listen") != 0)
+            return 1;
+    }
+
+    payload = evbuffer_new();
+    if(payload == NULL)
+        return 1;
+
+    /* Topic messages are not handed off but sent out now */
+    fanout_flush();
+
+#ifdef WITH_LEVELDB
+    /* Durable subscriptions continue from the stored cursors */
+    durable_flush();
+#endif
+
+    /* Peer links are not handed off, the other nodes reconnect */
+    TAILQ_FOREACH(client, &clients, entries) {
+        if(client->peer)
+            continue;
+
+        stomp_uncork(client);
+
+        login = ratelimit_login_name(client);
+        evbuffer_add_printf(payload, "client %d %s\n", client->authenticated, login != NULL ? login : "");
+
+        TAILQ_FOREACH(subscription, &client->subscriptions, client_entries) {
+            if(subscription->browse != NULL)
+                continue;
+
+            evbuffer_add_printf(payload, "sub %d %u %s\n", subscription->ack, subscription->prefetch, subscription->queue->queuename);
+            if(subscription->durable != NULL)
+                evbuffer_add_printf(payload, "durable %s\n", subscription->durable->name);
+
+            TAILQ_FOREACH(inflight, &subscription->queue->inflight, entries) {
+                if(inflight->subscription == subscription)
+                    evbuffer_add_printf(payload, "inflight %d %u %u %llx\n", inflight->priority, inflight->seq, inflight->count,
+                                        (unsigned long long)inflight->shared);
+            }
+        }
+
+        handoff_add_bytes(payload, "input", bufferevent_get_input(client->bev));
+        handoff_add_bytes(payload, "output", bufferevent_get_output(client->bev));
+
+        if(handoff_send(conn, client->fd, payload) != 0)
+            goto error;
+    }
+
+    now = mstime();
+
+    TAILQ_FOREACH(queue, &queues, entries) {
+        evbuffer_add_printf(payload, "queue %s\n", queue->queuename);
+        header = evbuffer_get_length(payload);
+
+        for(priority = 0; priority < MAXPRIORITY; priority++){
+            if(queue->buckets[priority].deliver != queue->buckets[priority].read)
+                evbuffer_add_printf(payload, "bucket %d %u\n", priority, queue->buckets[priority].deliver);
+        }
+
+        /* Messages of peer links are due again right away */
+        TAILQ_FOREACH(inflight, &queue->inflight, entries) {
+            if(inflight->subscription->client->peer)
+                evbuffer_add_printf(payload, "redeliver %d %u %u 0\n", inflight->priority, inflight->seq, inflight->count);
+        }
+
+        TAILQ_FOREACH(inflight, &queue->redeliver, entries) {
+            evbuffer_add_printf(payload, "redeliver %d %u %u %llu\n", inflight->priority, inflight->seq, inflight->count,
+                (unsigned long long)(inflight->due > now ? inflight->due - now : 0));
+        }
+
+        if(evbuffer_get_length(payload) == header){
+            evbuffer_drain(payload, header);
+            continue;
+        }
+
+        if(handoff_send(conn, -1, payload) != 0)
+            goto error;
+    }
+
+    evbuffer_free(payload);
+
+    return 0;
+
+error:
+    evbuffer_free(payload);
+
+    return 1;
+}
+
+static void handoff_on_accept(int fd, short ev, void *arg)
+{
+    int conn, flags;
+
+    conn = accept(fd, NULL, NULL);
+    if(conn < 0)
+        return;
+
+    flags = fcntl(conn, F_GETFL);
+    if(flags >= 0)
+        fcntl(conn, F_SETFL, flags & ~O_NONBLOCK);
+
+    if(!handoff_trusted(conn)){
+        logerror("Handoff requested by a process of another user");
+        close(conn);
+        return;
+    }
+
+    if(!TAILQ_EMPTY(&nodes)){
+        logerror("Handoff is not supported in a cluster");
+        close(conn);
+        return;
+    }
+
+#ifdef WITH_URING
+    if(uring_active()){
+        logerror("Handoff is not supported with the uring backend");
+        close(conn);
+        return;
+    }
+#endif
+
+    loginfo("Handing off to a new process");
+
+    if(handoff_send_all(conn) != 0){
+        logerror("Handoff failed, going on");
+        close(conn);
+        return;
+    }
+
+    /* "end" follows once the storage is closed */
+    handoff_conn = conn;
+    event_del(ev_handoff);
+    event_base_loopbreak(base);
+}
+
+/*
+ * Listens on handoffSocket for a new process to take over.
+ */
+int handoff_init(struct event_base *base, int *fds, int count)
+{
+    struct sockaddr_un addr;
+    const char *path = configget("handoffSocket");
+    mode_t mask;
+
+    if(strlen(path) == 0)
+        return 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        logerror("handoffSocket %s is too long", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if(!handoff_private_dir(path)){
+        logerror("handoffSocket %s must be in a directory only writable by its owner", path);
+        return 1;
+    }
+
+    unlink(path);
+
+    /* Created with mode 0600 right away */
+    mask = umask(0077);
+    handoff_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(handoff_listen < 0 || bind(handoff_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       chmod(path, 0600) < 0 || listen(handoff_listen, 1) < 0){
+        logerror("Listening on handoffSocket %s failed: %s", path, strerror(errno));
+        umask(mask);
+        return 1;
+    }
+    umask(mask);
+
+    ev_handoff = event_new(base, handoff_listen, EV_READ|EV_PERSIST, handoff_on_accept, NULL);
+    if(ev_handoff == NULL)
+        return 1;
+
+    event_add(ev_handoff, NULL);
+
+    listeners = fds;
+    listener_count = count;
+
+    return 0;
+}
+
+int handoff_done(void)
+{
+    return handoff_conn >= 0;
+}
+
+/*
+ * Called last on shutdown. After a handoff the new process may open
+ * the storage now.
+ */
+void handoff_free(void)
+{
+    if(ev_handoff != NULL)
+        event_free(ev_handoff);
+
+    if(handoff_listen >= 0){
+        close(handoff_listen);
+
+        /* The new process binds the path itself */
+        if(handoff_conn < 0)
+            unlink(configget("handoffSocket"));
+    }
+
+    if(handoff_conn >= 0){
+        handoff_send_line(handoff_conn, -1, "end");
+        close(handoff_conn);
+        loginfo("Handoff complete");
+    }
+}
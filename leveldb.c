@@ -34,10 +34,18 @@
 
 #include <leveldb/c.h>
 
+#include <event2/event.h>
+
 #include "log.h"
 #include "util.h"
+#include "server.h"
 #include "client.h"
 #include "stomp.h"
+#include "schedule.h"
+#include "replication.h"
+#include "dedup.h"
+#include "durable.h"
+#include "probes.h"
 
 #define CheckNoError(err) \
     if ((err) != NULL) { \
@@ -45,35 +53,119 @@
         abort(); \
     }
 
+#define MAXKEYLEN (MAXQUEUELEN+48)
+
+#define REDELIVERPREFIX "!redelivered."
+#define DEDUPPREFIX "!dedup."
+#define DURABLEPREFIX "!durable."
+#define SHAREDPREFIX "!shared."
+
 
 leveldb_t* db;
 leveldb_cache_t* cache;
+leveldb_filterpolicy_t* filter;
 leveldb_env_t* env;
 leveldb_options_t* options;
 leveldb_readoptions_t* roptions;
 leveldb_writeoptions_t* woptions;
 
+/* Acknowledgements of one loop iteration are written together */
+static leveldb_writebatch_t *ackbatch;
+static int ackcount;
+static struct event *ev_ackflush;
+
+/* Number of writes, for the load estimate of the compaction */
+static u_int64_t writes;
+
+/*
+ * Messages sent to several queues are stored once, see
+ * leveldb_add_shared(). Delivered messages carry the id of their
+ * shared message, dropped ones are only read for it in queues which
+ * may hold references.
+ */
+static u_int64_t sharednext = 1;
+static int sharedused;
+
+/* Reference counts written since the last flush */
+struct sharedref {
+    u_int64_t id;
+    u_int refs;
+};
+
+static struct sharedref *sharedrefs;
+static int sharedcount, sharedsize;
+
+
+/*
+ * Continues the ids of shared messages after the last one stored.
+ */
+static void leveldb_load_shared(void)
+{
+    leveldb_iterator_t *it;
+    char key[MAXKEYLEN];
+    char digits[17];
+    const char *found;
+    size_t prefix_len, key_len;
+
+    prefix_len = strlen(SHAREDPREFIX);
+
+    /* Right behind the last key with the prefix */
+    snprintf(key, sizeof(key), "%.*s/", (int)prefix_len-1, SHAREDPREFIX);
+
+    it = leveldb_create_iterator(db, roptions);
+    leveldb_iter_seek(it, key, strlen(key));
+    if(leveldb_iter_valid(it))
+        leveldb_iter_prev(it);
+    else
+        leveldb_iter_seek_to_last(it);
+
+    if(leveldb_iter_valid(it)){
+        found = leveldb_iter_key(it, &key_len);
+        if(key_len >= prefix_len+16 && memcmp(found, SHAREDPREFIX, prefix_len) == 0){
+            memcpy(digits, found+prefix_len, 16);
+            digits[16] = '\0';
+            sharednext = strtoull(digits, NULL, 16)+1;
+            sharedused = 1;
+        }
+    }
+
+    leveldb_iter_destroy(it);
+}
+
 
 int leveldb_init(void)
 {
     char *error = NULL;
+    int bits;
 
     /* Initialize LevelDB */
     env = leveldb_create_default_env();
-    cache = leveldb_cache_create_lru(100000);
+    cache = leveldb_cache_create_lru(strtoull(configget("dbCacheSize"), NULL, 10));
         
     options = leveldb_options_create();
     leveldb_options_set_cache(options, cache);
     leveldb_options_set_env(options, env);
     leveldb_options_set_create_if_missing(options, 1);
     leveldb_options_set_error_if_exists(options, 0);
+    leveldb_options_set_write_buffer_size(options, strtoull(configget("dbWriteBuffer"), NULL, 10));
+    leveldb_options_set_block_size(options, strtoull(configget("dbBlockSize"), NULL, 10));
+    leveldb_options_set_max_open_files(options, atoi(configget("dbMaxOpenFiles")));
+    leveldb_options_set_compression(options,
+        strcmp(configget("dbCompression"), "snappy") == 0 ? leveldb_snappy_compression : leveldb_no_compression);
+
+    /* Saves disk reads for keys which do not exist */
+    bits = atoi(configget("dbBloomBits"));
+    if(bits > 0){
+        filter = leveldb_filterpolicy_create_bloom(bits);
+        leveldb_options_set_filter_policy(options, filter);
+    }
 
     roptions = leveldb_readoptions_create();
     leveldb_readoptions_set_verify_checksums(roptions, 1);
-    leveldb_readoptions_set_fill_cache(roptions, 0);
+    leveldb_readoptions_set_fill_cache(roptions, strcmp(configget("dbFillCache"), "yes") == 0);
 
     woptions = leveldb_writeoptions_create();
-    leveldb_writeoptions_set_sync(woptions, 1);
+    leveldb_writeoptions_set_sync(woptions, strcmp(configget("dbSync"), "yes") == 0);
 
     db = leveldb_open(options, configget("dbFile"), &error);
     if(error != NULL){
@@ -81,76 +173,436 @@ int leveldb_init(void)
        return 1;
     }
 
+    leveldb_load_shared();
+
     return 0;
 }
 
 
+static void leveldb_write_batch(leveldb_writebatch_t *wb, char **error)
+{
+    leveldb_write(db, woptions, wb, error);
+    writes++;
+
+    if(*error == NULL && replication_active())
+        leveldb_writebatch_iterate(wb, NULL, replication_log_put, replication_log_delete);
+}
+
+/*
+ * Writes the pending acknowledgements. Called at the end of the
+ * loop iteration and before anything else is written or read from
+ * a snapshot, so the order of modifications is kept.
+ */
+void leveldb_flush(void)
+{
+    char *error = NULL;
+
+    /* Written counts are read from the database again */
+    sharedcount = 0;
+
+    if(ackcount == 0)
+        return;
+
+    ackcount = 0;
+    leveldb_write_batch(ackbatch, &error);
+    leveldb_writebatch_clear(ackbatch);
+
+    if(error != NULL)
+        logerror("LevelDB ack_message failed: %s", error);
+}
+
+static void leveldb_on_flush(int fd, short ev, void *arg)
+{
+    leveldb_flush();
+}
+
+/*
+ * All modifications go through here so they can be shipped to
+ * replication followers.
+ */
+void leveldb_commit(leveldb_writebatch_t *wb, char **error)
+{
+    leveldb_flush();
+    leveldb_write_batch(wb, error);
+}
+
+u_int64_t leveldb_writes(void)
+{
+    return writes;
+}
+
+void leveldb_commit_put(const char *key, size_t key_len, const char *value, size_t value_len, char **error)
+{
+    leveldb_writebatch_t *wb;
+
+    wb = leveldb_writebatch_create();
+    leveldb_writebatch_put(wb, key, key_len, value, value_len);
+    leveldb_commit(wb, error);
+    leveldb_writebatch_destroy(wb);
+}
+
+void leveldb_commit_delete(const char *key, size_t key_len, char **error)
+{
+    leveldb_writebatch_t *wb;
+
+    wb = leveldb_writebatch_create();
+    leveldb_writebatch_delete(wb, key, key_len);
+    leveldb_commit(wb, error);
+    leveldb_writebatch_destroy(wb);
+}
+
 int leveldb_free(void)
 {
+    leveldb_flush();
+    if(ackbatch != NULL)
+        leveldb_writebatch_destroy(ackbatch);
+    if(ev_ackflush != NULL)
+        event_free(ev_ackflush);
+    free(sharedrefs);
+
     leveldb_close(db);
     leveldb_options_destroy(options);
     leveldb_readoptions_destroy(roptions);
     leveldb_writeoptions_destroy(woptions);
     leveldb_cache_destroy(cache);
+    if(filter != NULL)
+        leveldb_filterpolicy_destroy(filter);
     leveldb_env_destroy(env);
 
     return 0;
 }
 
 
-int leveldb_add_message(struct queue *queue, char *message)
+/*
+ * Key layout per queue and priority bucket:
+ *
+ *   queuename.priority.sequence   "expires\nmessage" (sequence is zero padded)
+ *   queuename.priority.read       last acknowledged sequence
+ *   queuename.priority.write      last stored sequence
+ *   queuename.priority.dropped    last sequence dropped past an unacked one
+ *   !dedup.queuename.number       fingerprint of a producer id
+ *   !durable.topicname            "acked name\n" per durable subscription
+ *   !shared.id                    message sent to several queues
+ *
+ * The expiration time in milliseconds since the epoch (0 for never)
+ * prefixes the message so it can be checked without parsing it.
+ *
+ * The count messages of a batch SEND share the frame up to the body
+ * (head) and are stored with a single write batch under consecutive
+ * sequences. The id of an idempotent producer (0 for none) is stored
+ * with them, and the one which falls out of the window is deleted.
+ */
+int leveldb_add_messages(struct queue *queue, int priority, u_int64_t expires, const char *head, char **bodies, int count, u_int64_t dedup)
 {
     leveldb_writebatch_t *wb;
-    char key[MAXQUEUELEN+10];
-    char value[16];
+    char key[MAXKEYLEN];
+    char value[24];
+    char prefix[24];
+    char *record = NULL, *tmp;
+    size_t prefix_len, head_len, body_len, record_len, size = 0, bytes = 0;
     char *error = NULL;
-    int seq;
+    u_int seq, number;
+    int i;
 
     if(strlen(queue->queuename) >= MAXQUEUELEN){
         logerror("LevelDB add_message failed: Queuename too long");
         return 1;
     }
 
-    seq = atomic_fetchadd_int(&queue->write, 1);
+    REDQ_PROBE2(store_start, queue->queuename, count);
+
+    prefix_len = snprintf(prefix, sizeof(prefix), "%llu\n", (unsigned long long)expires);
+    head_len = strlen(head);
+
+    seq = atomic_fetchadd_int(&queue->buckets[priority].write, count);
     wb = leveldb_writebatch_create();
 
-    snprintf(key, sizeof(key)-1, "%s.%d", queue->queuename, seq);
-    key[sizeof(key)-1] = '\0';
-    leveldb_writebatch_put(wb, key, strlen(key), message, strlen(message));
+    for(i = 0; i < count; i++){
+        body_len = strlen(bodies[i]);
+        record_len = prefix_len+head_len+body_len;
+
+        if(record_len > size){
+            tmp = realloc(record, record_len);
+            if(tmp == NULL){
+                logerror("LevelDB add_message failed: Out of memory");
+                free(record);
+                leveldb_writebatch_destroy(wb);
+                REDQ_PROBE3(store_done, queue->queuename, count, 1);
+                return 1;
+            }
+            record = tmp;
+            size = record_len;
+        }
+
+        memcpy(record, prefix, prefix_len);
+        memcpy(record+prefix_len, head, head_len);
+        memcpy(record+prefix_len+head_len, bodies[i], body_len);
+
+        snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq+i);
+        key[sizeof(key)-1] = '\0';
+        leveldb_writebatch_put(wb, key, strlen(key), record, record_len);
+
+        bytes += head_len+body_len;
+    }
 
-    snprintf(key, sizeof(key)-1, "%s.write", queue->queuename);
+    free(record);
+
+    snprintf(key, sizeof(key)-1, "%s.%d.write", queue->queuename, priority);
     key[sizeof(key)-1] = '\0';
     
-    sprintf(value, "%d", seq);
+    sprintf(value, "%u", seq+count-1);
     leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
 
-    leveldb_write(db, woptions, wb, &error);
+    if(dedup != 0){
+        number = dedup_next(queue);
+        snprintf(key, sizeof(key), "%s%s.%010u", DEDUPPREFIX, queue->queuename, number);
+        snprintf(value, sizeof(value), "%016llx", (unsigned long long)dedup);
+        leveldb_writebatch_put(wb, key, strlen(key), value, 16);
+
+        if(number >= dedup_window(queue)){
+            snprintf(key, sizeof(key), "%s%s.%010u", DEDUPPREFIX, queue->queuename, number - dedup_window(queue));
+            leveldb_writebatch_delete(wb, key, strlen(key));
+        }
+    }
+
+    leveldb_commit(wb, &error);
     leveldb_writebatch_destroy(wb);
 
+    REDQ_PROBE3(store_done, queue->queuename, count, error != NULL);
+
     if(error != NULL){
         logerror("LevelDB add_message failed: %s", error);
+        /* No gap for a publish which is retried */
+        if(queue->buckets[priority].write == seq+count)
+            queue->buckets[priority].write = seq;
         return 1;
     }
 
-    loginfo("Added message %d to %s: %.20s", queue->write, queue->queuename, message);
+    /* A topic log is only read through durable subscriptions */
+    if(!queue->topic){
+        queue->pending |= (1 << priority);
+        queue->bytes += bytes;
+        if(expires != 0)
+            queue->expiring = 1;
+    }
+
+    if(count == 1)
+        loginfo("Added message %u/%d to %s: %.20s%.*s", seq, priority, queue->queuename, head, head_len < 20 ? (int)(20-head_len) : 0, bodies[0]);
+    else
+        loginfo("Added messages %u-%u/%d to %s", seq, seq+count-1, priority, queue->queuename);
 
     return 0;
 }
 
-int leveldb_load_queue(struct queue *queue)
+int leveldb_add_message(struct queue *queue, int priority, u_int64_t expires, char *message, u_int64_t dedup)
+{
+    return leveldb_add_messages(queue, priority, expires, "", &message, 1, dedup);
+}
+
+/*
+ * Stores a message for count queues at once with a single write
+ * batch. The message is stored once and each queue gets a reference
+ * to it under its next sequence instead of the record:
+ *
+ *   !shared.id                    message (id in 16 hex digits)
+ *   !shared.id.refs               number of references left
+ *   queuename.priority.sequence   "expires>id"
+ *
+ * The message goes away with its last reference.
+ */
+int leveldb_add_shared(struct queue **queues, u_int64_t *expires, int count, int priority, const char *message)
+{
+    leveldb_writebatch_t *wb;
+    char key[MAXKEYLEN];
+    char value[40];
+    char *error = NULL;
+    size_t message_len;
+    u_int64_t id;
+    u_int seq;
+    int i;
+
+    for(i = 0; i < count; i++){
+        if(strlen(queues[i]->queuename) >= MAXQUEUELEN){
+            logerror("LevelDB add_shared failed: Queuename too long");
+            return 1;
+        }
+    }
+
+    REDQ_PROBE2(store_start, queues[0]->queuename, count);
+
+    message_len = strlen(message);
+    id = sharednext++;
+    wb = leveldb_writebatch_create();
+
+    snprintf(key, sizeof(key), "%s%016llx", SHAREDPREFIX, (unsigned long long)id);
+    leveldb_writebatch_put(wb, key, strlen(key), message, message_len);
+
+    snprintf(key, sizeof(key), "%s%016llx.refs", SHAREDPREFIX, (unsigned long long)id);
+    sprintf(value, "%d", count);
+    leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+
+    for(i = 0; i < count; i++){
+        seq = atomic_fetchadd_int(&queues[i]->buckets[priority].write, 1);
+
+        snprintf(key, sizeof(key)-1, "%s.%d.%010u", queues[i]->queuename, priority, seq);
+        key[sizeof(key)-1] = '\0';
+        snprintf(value, sizeof(value), "%llu>%016llx", (unsigned long long)expires[i], (unsigned long long)id);
+        leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+
+        snprintf(key, sizeof(key)-1, "%s.%d.write", queues[i]->queuename, priority);
+        key[sizeof(key)-1] = '\0';
+        sprintf(value, "%u", seq);
+        leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+    }
+
+    leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    REDQ_PROBE3(store_done, queues[0]->queuename, count, error != NULL);
+
+    if(error != NULL){
+        logerror("LevelDB add_shared failed: %s", error);
+        return 1;
+    }
+
+    sharedused = 1;
+
+    for(i = 0; i < count; i++){
+        queues[i]->shared = 1;
+        queues[i]->pending |= (1 << priority);
+        queues[i]->bytes += message_len;
+        if(expires[i] != 0)
+            queues[i]->expiring = 1;
+    }
+
+    loginfo("Added shared message %llx/%d to %d queues", (unsigned long long)id, priority, count);
+
+    return 0;
+}
+
+/*
+ * Returns the id of the shared message a stored record refers to,
+ * or 0 if the record holds the message itself.
+ */
+static u_int64_t leveldb_shared_id(const char *value, size_t value_len)
+{
+    char digits[17];
+
+    while(value_len > 0 && *value >= '0' && *value <= '9'){
+        value++;
+        value_len--;
+    }
+
+    if(value_len != 17 || *value != '>')
+        return 0;
+
+    memcpy(digits, value+1, 16);
+    digits[16] = '\0';
+
+    return strtoull(digits, NULL, 16);
+}
+
+/*
+ * Drops a reference to a shared message with the write batch, the
+ * last one removes the message. Counts which are not written yet
+ * are remembered until the next flush.
+ */
+static void leveldb_release_shared(leveldb_writebatch_t *wb, u_int64_t id)
+{
+    struct sharedref *tmp;
+    char key[MAXKEYLEN];
+    char value[16];
+    char *stored;
+    char *error = NULL;
+    size_t stored_len;
+    int i;
+
+    snprintf(key, sizeof(key), "%s%016llx.refs", SHAREDPREFIX, (unsigned long long)id);
+
+    for(i = sharedcount-1; i >= 0 && sharedrefs[i].id != id; i--)
+        ;
+
+    if(i < 0){
+        if(sharedcount == sharedsize){
+            tmp = realloc(sharedrefs, (sharedsize*2+16) * sizeof(*sharedrefs));
+            if(tmp == NULL){
+                logerror("LevelDB release_shared failed: Out of memory");
+                return;
+            }
+            sharedrefs = tmp;
+            sharedsize = sharedsize*2+16;
+        }
+
+        stored = leveldb_get(db, roptions, key, strlen(key), &stored_len, &error);
+        if(error != NULL){
+            logerror("LevelDB release_shared failed: %s", error);
+            return;
+        }
+
+        i = sharedcount++;
+        sharedrefs[i].id = id;
+        sharedrefs[i].refs = 0;
+
+        if(stored != NULL){
+            stored = realloc(stored, stored_len+1);
+            stored[stored_len] = '\0';
+            sharedrefs[i].refs = strtoul(stored, NULL, 10);
+            free(stored);
+        }
+    }
+
+    if(sharedrefs[i].refs > 1){
+        sharedrefs[i].refs--;
+        sprintf(value, "%u", sharedrefs[i].refs);
+        leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+        return;
+    }
+
+    sharedrefs[i].refs = 0;
+    leveldb_writebatch_delete(wb, key, strlen(key));
+
+    snprintf(key, sizeof(key), "%s%016llx", SHAREDPREFIX, (unsigned long long)id);
+    leveldb_writebatch_delete(wb, key, strlen(key));
+}
+
+/*
+ * Releases the shared message a stored record refers to, if any,
+ * as the record is deleted with the write batch.
+ */
+static void leveldb_release_record(leveldb_writebatch_t *wb, struct queue *queue, const char *key)
 {
-    char key[MAXQUEUELEN+10];
     char *value;
     char *error = NULL;
     size_t value_len;
+    u_int64_t id;
 
-    if(strlen(queue->queuename) >= MAXQUEUELEN){
-        logerror("LevelDB add_message failed: Queuename too long");
-        return 1;
+    if(!queue->shared)
+        return;
+
+    value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
+    if(error != NULL){
+        logerror("LevelDB release_record failed: %s", error);
+        return;
     }
 
-    /* queuename.read */
-    snprintf(key, sizeof(key)-1, "%s.read", queue->queuename);
+    if(value == NULL)
+        return;
+
+    id = leveldb_shared_id(value, value_len);
+    free(value);
+
+    if(id != 0)
+        leveldb_release_shared(wb, id);
+}
+
+static int leveldb_load_counter(struct queue *queue, int priority, char *name, volatile u_int *counter)
+{
+    char key[MAXKEYLEN];
+    char *value;
+    char *error = NULL;
+    size_t value_len;
+
+    snprintf(key, sizeof(key)-1, "%s.%d.%s", queue->queuename, priority, name);
     key[sizeof(key)-1] = '\0';
 
     value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
@@ -160,42 +612,918 @@ int leveldb_load_queue(struct queue *queue)
     }
 
     if(value != NULL){
-       queue->read = atoi(value)+1;
+       value = realloc(value, value_len+1);
+       value[value_len] = '\0';
+       *counter = strtoul(value, NULL, 10)+1;
        free(value);
-       value = NULL;
     }
     else
-       queue->read = 1;
+       *counter = 1;
 
+    return 0;
+}
 
-    /* queuename.write */
-    snprintf(key, sizeof(key)-1, "%s.write", queue->queuename);
-    key[sizeof(key)-1] = '\0';
+/*
+ * Loads the producer ids of a queue in the order they were taken.
+ * Older ones than the window, which shrank since, are deleted.
+ */
+static int leveldb_load_dedup(struct queue *queue)
+{
+    leveldb_writebatch_t *wb;
+    leveldb_iterator_t *it;
+    char prefix[MAXKEYLEN];
+    char value[24], number[12];
+    const char *key, *data;
+    size_t key_len, prefix_len, value_len;
+    char *error = NULL;
+    u_int count = 0, skip = 0;
+
+    prefix_len = snprintf(prefix, sizeof(prefix), "%s%s.", DEDUPPREFIX, queue->queuename);
+
+    wb = leveldb_writebatch_create();
+    it = leveldb_create_iterator(db, roptions);
+
+    /* Keys of other queues whose name continues here are longer */
+    for(leveldb_iter_seek(it, prefix, prefix_len); leveldb_iter_valid(it); leveldb_iter_next(it)){
+       key = leveldb_iter_key(it, &key_len);
+       if(key_len < prefix_len || memcmp(key, prefix, prefix_len) != 0)
+          break;
+       if(key_len == prefix_len+10)
+          count++;
+    }
+
+    if(count > dedup_window(queue))
+       skip = count - dedup_window(queue);
+
+    for(leveldb_iter_seek(it, prefix, prefix_len); leveldb_iter_valid(it); leveldb_iter_next(it)){
+       key = leveldb_iter_key(it, &key_len);
+       if(key_len < prefix_len || memcmp(key, prefix, prefix_len) != 0)
+          break;
+       if(key_len != prefix_len+10)
+          continue;
+
+       if(skip > 0){
+          leveldb_writebatch_delete(wb, key, key_len);
+          skip--;
+          continue;
+       }
+
+       data = leveldb_iter_value(it, &value_len);
+       if(value_len >= sizeof(value))
+          continue;
+
+       memcpy(value, data, value_len);
+       value[value_len] = '\0';
+       memcpy(number, key+prefix_len, 10);
+       number[10] = '\0';
+       dedup_restore(queue, strtoul(number, NULL, 10), strtoull(value, NULL, 16));
+    }
+
+    leveldb_iter_destroy(it);
+
+    if(count > dedup_window(queue))
+       leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    if(error != NULL){
+        logerror("LevelDB load_queue failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Loads the durable subscriptions of a topic with the last message
+ * each of them acknowledged.
+ */
+static int leveldb_load_durables(struct queue *queue)
+{
+    char key[MAXKEYLEN];
+    char *value, *line, *end, *name;
+    char *error = NULL;
+    size_t value_len;
+    u_int acked;
+
+    snprintf(key, sizeof(key), "%s%s", DURABLEPREFIX, queue->queuename);
 
     value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
     if(error != NULL){
-       logerror("LevelDB load_queue failed: %s", error);
+       logerror("LevelDB load_durables failed: %s", error);
        return 1;
     }
 
-    if(value != NULL){
-       queue->write = atoi(value)+1;
-       free(value);
-       value = NULL;
+    if(value == NULL)
+       return 0;
+
+    value = realloc(value, value_len+1);
+    value[value_len] = '\0';
+
+    for(line = value; (end = strchr(line, '\n')) != NULL; line = end+1){
+       *end = '\0';
+       acked = strtoul(line, &name, 10);
+       if(*name == ' ' && durable_restore(queue, name+1, acked) != 0){
+          free(value);
+          return 1;
+       }
     }
-    else
-       queue->write = 1;
+
+    free(value);
 
     return 0;
 }
 
-char* leveldb_get_message(struct queue *queue)
+int leveldb_load_queue(struct queue *queue)
 {
+    char start[MAXKEYLEN], limit[MAXKEYLEN];
+    const char *start_key, *limit_key;
+    size_t start_len, limit_len;
+    uint64_t size;
+    int priority;
+
+    if(strlen(queue->queuename) >= MAXQUEUELEN){
+        logerror("LevelDB load_queue failed: Queuename too long");
+        return 1;
+    }
+
+    queue->pending = 0;
+    leveldb_flush();
+
+    for(priority=0; priority < MAXPRIORITY; priority++){
+       if(leveldb_load_counter(queue, priority, "read", &queue->buckets[priority].read) != 0)
+          return 1;
+
+       if(leveldb_load_counter(queue, priority, "write", &queue->buckets[priority].write) != 0)
+          return 1;
+
+       if(leveldb_load_counter(queue, priority, "dropped", &queue->buckets[priority].dropped) != 0)
+          return 1;
+
+       /* Unacknowledged messages are handed out again */
+       queue->buckets[priority].deliver = queue->buckets[priority].read;
+
+       if(queue->buckets[priority].read != queue->buckets[priority].write)
+          queue->pending |= (1 << priority);
+    }
+
+    /* Stored messages might carry an expiration time */
+    queue->expiring = (queue->pending != 0);
+    queue->shared = (queue->pending != 0 && sharedused);
+
+    if(dedup_window(queue) > 0 && leveldb_load_dedup(queue) != 0)
+       return 1;
+
+    /* A topic log is only read through durable subscriptions */
+    if(queue->topic){
+       queue->pending = 0;
+       queue->expiring = 0;
+       queue->bytes = 0;
+       return leveldb_load_durables(queue);
+    }
+
+    /* Only the size on disk is known for messages of an earlier run */
+    start_len = snprintf(start, sizeof(start), "%s.0.", queue->queuename);
+    limit_len = snprintf(limit, sizeof(limit), "%s.%d/", queue->queuename, MAXPRIORITY-1);
+    start_key = start;
+    limit_key = limit;
+    leveldb_approximate_sizes(db, 1, &start_key, &start_len, &limit_key, &limit_len, &size);
+    queue->bytes = (queue->pending != 0) ? size : 0;
+
     return 0;
 }
 
-int leveldb_ack_message(struct queue *queue)
+/*
+ * Splits the expiration time off a stored record and moves the
+ * message to the start of the buffer. A reference is replaced by
+ * the shared message, which is read with ro, and its id is stored
+ * in shared unless that is NULL.
+ */
+static char* leveldb_parse_record(const leveldb_readoptions_t *ro, char *value, size_t value_len, u_int64_t *expires, u_int64_t *shared)
 {
-    return 0;
+    char key[MAXKEYLEN];
+    char *message;
+    char *error = NULL;
+
+    value = realloc(value, value_len+1);
+    value[value_len] = '\0';
+
+    *expires = strtoull(value, &message, 10);
+    if(*message == '>'){
+        if(shared != NULL)
+            *shared = leveldb_shared_id(value, value_len);
+        snprintf(key, sizeof(key), "%s%.16s", SHAREDPREFIX, message+1);
+        free(value);
+
+        value = leveldb_get(db, ro, key, strlen(key), &value_len, &error);
+        if(error != NULL){
+            logerror("LevelDB get_shared failed: %s", error);
+            return NULL;
+        }
+
+        if(value == NULL)
+            return NULL;
+
+        value = realloc(value, value_len+1);
+        value[value_len] = '\0';
+        return value;
+    }
+
+    if(*message == '\n')
+        message++;
+
+    memmove(value, message, value_len+1-(message-value));
+
+    return value;
 }
 
+/*
+ * Returns a message of the given priority bucket as a NUL
+ * terminated string which has to be freed by the caller. The id
+ * of a shared message (or 0) is stored in shared unless that is
+ * NULL, it has to be passed to leveldb_ack_message().
+ */
+char* leveldb_get_message(struct queue *queue, int priority, u_int seq, u_int64_t *expires, u_int64_t *shared)
+{
+    char key[MAXKEYLEN];
+    char *value;
+    char *error = NULL;
+    size_t value_len;
+
+    if(shared != NULL)
+       *shared = 0;
+
+    snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq);
+    key[sizeof(key)-1] = '\0';
+
+    value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
+    if(error != NULL){
+       logerror("LevelDB get_message failed: %s", error);
+       return NULL;
+    }
+
+    if(value == NULL)
+       return NULL;
+
+    return leveldb_parse_record(roptions, value, value_len, expires, shared);
+}
+
+/*
+ * Removes a message and its redelivery counter and stores the read
+ * pointer of the bucket, which has been advanced by the caller.
+ * shared is the id returned by leveldb_get_message().
+ */
+int leveldb_ack_message(struct queue *queue, int priority, u_int seq, int redelivered, u_int64_t shared)
+{
+    char key[MAXKEYLEN];
+    char value[16];
+
+    if(ackbatch == NULL){
+        ackbatch = leveldb_writebatch_create();
+        ev_ackflush = event_new(base, -1, 0, leveldb_on_flush, NULL);
+    }
+
+    snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq);
+    key[sizeof(key)-1] = '\0';
+    if(shared != 0)
+        leveldb_release_shared(ackbatch, shared);
+    leveldb_writebatch_delete(ackbatch, key, strlen(key));
+
+    if(redelivered){
+       snprintf(key, sizeof(key)-1, "%s%s.%d.%010u", REDELIVERPREFIX, queue->queuename, priority, seq);
+       key[sizeof(key)-1] = '\0';
+       leveldb_writebatch_delete(ackbatch, key, strlen(key));
+    }
+
+    snprintf(key, sizeof(key)-1, "%s.%d.read", queue->queuename, priority);
+    key[sizeof(key)-1] = '\0';
+
+    sprintf(value, "%u", queue->buckets[priority].read-1);
+    leveldb_writebatch_put(ackbatch, key, strlen(key), value, strlen(value));
+
+    if(ackcount++ == 0)
+        event_active(ev_ackflush, EV_WRITE, 0);
+
+    return 0;
+}
+
+/*
+ * Compacts the range of a bucket which was consumed since the last
+ * call so the tombstones of the deleted messages are dropped.
+ */
+void leveldb_compact_queue(struct queue *queue, int priority, u_int from, u_int to)
+{
+    char start[MAXKEYLEN];
+    char limit[MAXKEYLEN];
+
+    leveldb_flush();
+
+    snprintf(start, sizeof(start)-1, "%s.%d.%010u", queue->queuename, priority, from);
+    start[sizeof(start)-1] = '\0';
+    snprintf(limit, sizeof(limit)-1, "%s.%d.%010u", queue->queuename, priority, to);
+    limit[sizeof(limit)-1] = '\0';
+
+    leveldb_compact_range(db, start, strlen(start), limit, strlen(limit));
+}
+
+/*
+ * Delivery counters of messages which could not be delivered are
+ * kept apart from the messages so these are never rewritten:
+ *
+ *   !redelivered.queuename.priority.sequence   count
+ */
+u_int leveldb_get_redelivered(struct queue *queue, int priority, u_int seq)
+{
+    char key[MAXKEYLEN];
+    char *value;
+    char *error = NULL;
+    size_t value_len;
+    u_int count;
+
+    snprintf(key, sizeof(key)-1, "%s%s.%d.%010u", REDELIVERPREFIX, queue->queuename, priority, seq);
+    key[sizeof(key)-1] = '\0';
+
+    value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
+    if(error != NULL){
+       logerror("LevelDB get_redelivered failed: %s", error);
+       return 0;
+    }
+
+    if(value == NULL)
+       return 0;
+
+    value = realloc(value, value_len+1);
+    value[value_len] = '\0';
+    count = strtoul(value, NULL, 10);
+    free(value);
+
+    return count;
+}
+
+int leveldb_set_redelivered(struct queue *queue, int priority, u_int seq, u_int count)
+{
+    char key[MAXKEYLEN];
+    char value[16];
+    char *error = NULL;
+
+    snprintf(key, sizeof(key)-1, "%s%s.%d.%010u", REDELIVERPREFIX, queue->queuename, priority, seq);
+    key[sizeof(key)-1] = '\0';
+
+    sprintf(value, "%u", count);
+    leveldb_commit_put(key, strlen(key), value, strlen(value), &error);
+
+    if(error != NULL){
+        logerror("LevelDB set_redelivered failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Removes the run of expired messages at the head of a priority
+ * bucket with a single write batch. Must only be used when the
+ * bucket has no unacknowledged messages. Returns the number of
+ * removed messages or -1 on error.
+ */
+int leveldb_expire_messages(struct queue *queue, int priority, u_int64_t now, int max)
+{
+    leveldb_writebatch_t *wb;
+    leveldb_iterator_t *it;
+    char key[MAXKEYLEN];
+    char value[16];
+    const char *ikey, *ivalue;
+    size_t ikey_len, ivalue_len;
+    char *error = NULL;
+    u_int64_t expires, id;
+    size_t bytes = 0;
+    u_int seq;
+    int count = 0;
+
+    seq = queue->buckets[priority].read;
+    wb = leveldb_writebatch_create();
+    it = leveldb_create_iterator(db, roptions);
+
+    snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq);
+    key[sizeof(key)-1] = '\0';
+    leveldb_iter_seek(it, key, strlen(key));
+
+    while(count < max && seq != queue->buckets[priority].write && leveldb_iter_valid(it)){
+       ikey = leveldb_iter_key(it, &ikey_len);
+       if(ikey_len != strlen(key) || strncmp(ikey, key, ikey_len) != 0)
+          break;
+
+       ivalue = leveldb_iter_value(it, &ivalue_len);
+       expires = 0;
+       while(ivalue_len > 0 && *ivalue >= '0' && *ivalue <= '9'){
+          expires = expires * 10 + (*ivalue - '0');
+          ivalue++;
+          ivalue_len--;
+       }
+
+       if(expires == 0 || expires > now)
+          break;
+
+       if((id = leveldb_shared_id(ivalue, ivalue_len)) != 0)
+          leveldb_release_shared(wb, id);
+
+       leveldb_writebatch_delete(wb, key, strlen(key));
+       bytes += ivalue_len;
+       count++;
+       seq++;
+
+       snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq);
+       key[sizeof(key)-1] = '\0';
+       leveldb_iter_next(it);
+    }
+
+    leveldb_iter_destroy(it);
+
+    if(count == 0){
+       leveldb_writebatch_destroy(wb);
+       return 0;
+    }
+
+    snprintf(key, sizeof(key)-1, "%s.%d.read", queue->queuename, priority);
+    key[sizeof(key)-1] = '\0';
+
+    sprintf(value, "%u", seq-1);
+    leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+
+    leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    if(error != NULL){
+        logerror("LevelDB expire_messages failed: %s", error);
+        return -1;
+    }
+
+    queue->buckets[priority].read = seq;
+    queue->buckets[priority].deliver = seq;
+    if(queue->buckets[priority].deliver == queue->buckets[priority].write)
+       queue->pending &= ~(1 << priority);
+    queue->bytes -= (bytes < queue->bytes) ? bytes : queue->bytes;
+
+    loginfo("Expired %d messages of %s/%d", count, queue->queuename, priority);
+
+    return count;
+}
+
+/*
+ * Deletes count undelivered messages of a bucket from sequence from
+ * on with a single write batch, the caller already moved the deliver
+ * (and read) pointer past them. Keys are derived from the sequence,
+ * the messages are only read while shared messages exist.
+ */
+int leveldb_drop_messages(struct queue *queue, int priority, u_int from, u_int count)
+{
+    leveldb_writebatch_t *wb;
+    char key[MAXKEYLEN];
+    char value[16];
+    char *error = NULL;
+    u_int seq;
+
+    wb = leveldb_writebatch_create();
+
+    for(seq = from; seq != from+count; seq++){
+       snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, priority, seq);
+       key[sizeof(key)-1] = '\0';
+       leveldb_release_record(wb, queue, key);
+       leveldb_writebatch_delete(wb, key, strlen(key));
+    }
+
+    snprintf(key, sizeof(key)-1, "%s.%d.read", queue->queuename, priority);
+    key[sizeof(key)-1] = '\0';
+
+    sprintf(value, "%u", queue->buckets[priority].read-1);
+    leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+
+    /* The read pointer stays at an unacknowledged message, a reload
+     * has to know the keys after it are gone on purpose */
+    if(queue->buckets[priority].read != queue->buckets[priority].deliver){
+        snprintf(key, sizeof(key)-1, "%s.%d.dropped", queue->queuename, priority);
+        key[sizeof(key)-1] = '\0';
+
+        sprintf(value, "%u", queue->buckets[priority].dropped-1);
+        leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+    }
+
+    leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    if(error != NULL){
+        logerror("LevelDB drop_messages failed: %s", error);
+        return 1;
+    }
+
+    loginfo("Dropped %u messages of %s/%d", count, queue->queuename, priority);
+
+    return 0;
+}
+
+/*
+ * Stores the durable subscriptions of a topic, or deletes them for
+ * an empty record, and drops count messages of its log from sequence
+ * from on, whose read pointer the caller already moved past them.
+ */
+int leveldb_sync_durables(struct queue *queue, const char *record, size_t record_len, u_int from, u_int count)
+{
+    leveldb_writebatch_t *wb;
+    char key[MAXKEYLEN];
+    char value[16];
+    char *error = NULL;
+    u_int seq;
+
+    wb = leveldb_writebatch_create();
+
+    snprintf(key, sizeof(key), "%s%s", DURABLEPREFIX, queue->queuename);
+    if(record_len > 0)
+       leveldb_writebatch_put(wb, key, strlen(key), record, record_len);
+    else
+       leveldb_writebatch_delete(wb, key, strlen(key));
+
+    for(seq = from; seq != from+count; seq++){
+       snprintf(key, sizeof(key)-1, "%s.%d.%010u", queue->queuename, DURABLE_PRIORITY, seq);
+       key[sizeof(key)-1] = '\0';
+       leveldb_writebatch_delete(wb, key, strlen(key));
+    }
+
+    if(count > 0){
+       snprintf(key, sizeof(key)-1, "%s.%d.read", queue->queuename, DURABLE_PRIORITY);
+       key[sizeof(key)-1] = '\0';
+
+       sprintf(value, "%u", queue->buckets[DURABLE_PRIORITY].read-1);
+       leveldb_writebatch_put(wb, key, strlen(key), value, strlen(value));
+    }
+
+    leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    if(error != NULL){
+        logerror("LevelDB sync_durables failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Adds deletes for all keys starting with prefix which are followed
+ * by a sequence number or a read/write pointer name. Shared messages
+ * of deleted references are released.
+ */
+static void leveldb_delete_prefix(leveldb_writebatch_t *wb, leveldb_iterator_t *it, const char *prefix)
+{
+    const char *key, *value;
+    size_t key_len, value_len, prefix_len = strlen(prefix);
+    u_int64_t id;
+
+    for(leveldb_iter_seek(it, prefix, prefix_len); leveldb_iter_valid(it); leveldb_iter_next(it)){
+       key = leveldb_iter_key(it, &key_len);
+       if(key_len < prefix_len || memcmp(key, prefix, prefix_len) != 0)
+          break;
+
+       /* Keys of other queues whose name continues here */
+       if(key_len != prefix_len+10 && !(key_len == prefix_len+4 && memcmp(key+prefix_len, "read", 4) == 0)
+             && !(key_len == prefix_len+5 && memcmp(key+prefix_len, "write", 5) == 0)
+             && !(key_len == prefix_len+7 && memcmp(key+prefix_len, "dropped", 7) == 0))
+          continue;
+
+       if(sharedused){
+          value = leveldb_iter_value(it, &value_len);
+          if((id = leveldb_shared_id(value, value_len)) != 0)
+             leveldb_release_shared(wb, id);
+       }
+
+       leveldb_writebatch_delete(wb, key, key_len);
+    }
+}
+
+/*
+ * Removes everything stored for a queue, its messages, pointers,
+ * delivery counters and producer ids, with a single write batch.
+ */
+int leveldb_purge_queue(struct queue *queue)
+{
+    leveldb_writebatch_t *wb;
+    leveldb_iterator_t *it;
+    char prefix[MAXKEYLEN];
+    char *error = NULL;
+    int priority;
+
+    wb = leveldb_writebatch_create();
+    it = leveldb_create_iterator(db, roptions);
+
+    for(priority=0; priority < MAXPRIORITY; priority++){
+       snprintf(prefix, sizeof(prefix), "%s.%d.", queue->queuename, priority);
+       leveldb_delete_prefix(wb, it, prefix);
+
+       snprintf(prefix, sizeof(prefix), "%s%s.%d.", REDELIVERPREFIX, queue->queuename, priority);
+       leveldb_delete_prefix(wb, it, prefix);
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s%s.", DEDUPPREFIX, queue->queuename);
+    leveldb_delete_prefix(wb, it, prefix);
+
+    leveldb_iter_destroy(it);
+
+    leveldb_commit(wb, &error);
+    leveldb_writebatch_destroy(wb);
+
+    if(error != NULL){
+        logerror("LevelDB purge_queue failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Scheduled messages are kept in a time ordered index which is
+ * separate from the queues:
+ *
+ *   !sched.deliverat.sequence   "priority queuename\nmessage"
+ */
+int leveldb_schedule_message(const char *key, const char *queuename, int priority, char *message)
+{
+    char *value;
+    char *error = NULL;
+    size_t value_len;
+
+    value_len = strlen(queuename)+strlen(message)+16;
+    value = malloc(value_len);
+    if(value == NULL)
+       return 1;
+
+    value_len = snprintf(value, value_len, "%d %s\n%s", priority, queuename, message);
+
+    leveldb_commit_put(key, strlen(key), value, value_len, &error);
+    free(value);
+
+    if(error != NULL){
+        logerror("LevelDB schedule_message failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the stored value of a scheduled message as a NUL
+ * terminated string which has to be freed by the caller.
+ */
+char* leveldb_get_scheduled(const char *key)
+{
+    char *value;
+    char *error = NULL;
+    size_t value_len;
+
+    value = leveldb_get(db, roptions, key, strlen(key), &value_len, &error);
+    if(error != NULL){
+       logerror("LevelDB get_scheduled failed: %s", error);
+       return NULL;
+    }
+
+    if(value == NULL)
+       return NULL;
+
+    value = realloc(value, value_len+1);
+    value[value_len] = '\0';
+
+    return value;
+}
+
+int leveldb_unschedule_message(const char *key)
+{
+    char *error = NULL;
+
+    leveldb_commit_delete(key, strlen(key), &error);
+    if(error != NULL){
+        logerror("LevelDB unschedule_message failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Walks the schedule index from the key after 'after' (or from the
+ * start if NULL) up to but excluding 'until' and passes at most max
+ * keys to the callback. Returns the number of keys passed.
+ */
+int leveldb_load_schedule(const char *after, const char *until, int max, void (*callback)(const char *key, size_t key_len))
+{
+    leveldb_iterator_t *it;
+    const char *key;
+    size_t key_len;
+    int count = 0;
+
+    it = leveldb_create_iterator(db, roptions);
+
+    if(after != NULL)
+       leveldb_iter_seek(it, after, strlen(after));
+    else
+       leveldb_iter_seek(it, SCHEDPREFIX, strlen(SCHEDPREFIX));
+
+    for(; leveldb_iter_valid(it) && count < max; leveldb_iter_next(it)){
+       key = leveldb_iter_key(it, &key_len);
+
+       if(key_len < strlen(SCHEDPREFIX) || strncmp(key, SCHEDPREFIX, strlen(SCHEDPREFIX)) != 0)
+          break;
+
+       if(after != NULL && key_len == strlen(after) && strncmp(key, after, key_len) == 0)
+          continue;
+
+       if(strncmp(key, until, key_len < strlen(until) ? key_len : strlen(until)) >= 0)
+          break;
+
+       callback(key, key_len);
+       count++;
+    }
+
+    leveldb_iter_destroy(it);
+
+    return count;
+}
+
+/*
+ * Consistent view of the whole database which is read in chunks to
+ * bring a new replication follower up to date.
+ */
+struct leveldb_cursor {
+    const leveldb_snapshot_t *snapshot;
+    leveldb_readoptions_t *roptions;
+    leveldb_iterator_t *it;
+};
+
+void* leveldb_cursor_open(void)
+{
+    struct leveldb_cursor *cursor;
+
+    cursor = calloc(1, sizeof(*cursor));
+    if(cursor == NULL)
+        return NULL;
+
+    leveldb_flush();
+    cursor->snapshot = leveldb_create_snapshot(db);
+    cursor->roptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(cursor->roptions, 0);
+    leveldb_readoptions_set_snapshot(cursor->roptions, cursor->snapshot);
+
+    cursor->it = leveldb_create_iterator(db, cursor->roptions);
+    leveldb_iter_seek_to_first(cursor->it);
+
+    return cursor;
+}
+
+/*
+ * Passes up to max entries to the callback. Returns the number of
+ * entries passed, 0 at the end of the database.
+ */
+int leveldb_cursor_read(void *handle, int max, void (*callback)(void *arg, const char *key, size_t key_len, const char *value, size_t value_len), void *arg)
+{
+    struct leveldb_cursor *cursor = (struct leveldb_cursor *)handle;
+    const char *key, *value;
+    size_t key_len, value_len;
+    int count = 0;
+
+    for(; count < max && leveldb_iter_valid(cursor->it); leveldb_iter_next(cursor->it)){
+       key = leveldb_iter_key(cursor->it, &key_len);
+       value = leveldb_iter_value(cursor->it, &value_len);
+       callback(arg, key, key_len, value, value_len);
+       count++;
+    }
+
+    return count;
+}
+
+/*
+ * Passes up to max messages of a queue bucket with a sequence from
+ * *seq up to to to the callback and moves *seq past the last one.
+ * Returns the number passed, less than max when the range is done.
+ */
+int leveldb_cursor_messages(void *handle, struct queue *queue, int priority, u_int *seq, u_int to, int max, void (*callback)(void *arg, int priority, u_int seq, u_int64_t expires, char *message), void *arg)
+{
+    struct leveldb_cursor *cursor = (struct leveldb_cursor *)handle;
+    char key[MAXKEYLEN];
+    char digits[11];
+    const char *found, *value;
+    char *record;
+    size_t prefix_len, key_len, value_len;
+    u_int64_t expires;
+    u_int current;
+    int count = 0;
+
+    prefix_len = snprintf(key, sizeof(key), "%s.%d.", queue->queuename, priority);
+    if(prefix_len+10 >= sizeof(key))
+        return 0;
+
+    snprintf(key+prefix_len, sizeof(key)-prefix_len, "%010u", *seq);
+    leveldb_iter_seek(cursor->it, key, prefix_len+10);
+
+    for(; count < max && leveldb_iter_valid(cursor->it); leveldb_iter_next(cursor->it)){
+        found = leveldb_iter_key(cursor->it, &key_len);
+        if(key_len < prefix_len || memcmp(found, key, prefix_len) != 0)
+            break;
+
+        /* Keys of other queues whose name continues with a digit */
+        if(key_len != prefix_len+10)
+            continue;
+
+        memcpy(digits, found+prefix_len, 10);
+        digits[10] = '\0';
+        current = strtoul(digits, NULL, 10);
+        if(current > to)
+            break;
+
+        value = leveldb_iter_value(cursor->it, &value_len);
+        record = malloc(value_len+1);
+        if(record == NULL)
+            break;
+
+        memcpy(record, value, value_len);
+        record = leveldb_parse_record(cursor->roptions, record, value_len, &expires, NULL);
+        if(record != NULL)
+            callback(arg, priority, current, expires, record);
+        free(record);
+
+        *seq = current+1;
+        count++;
+    }
+
+    return count;
+}
+
+void leveldb_cursor_close(void *handle)
+{
+    struct leveldb_cursor *cursor = (struct leveldb_cursor *)handle;
+
+    leveldb_iter_destroy(cursor->it);
+    leveldb_readoptions_destroy(cursor->roptions);
+    leveldb_release_snapshot(db, cursor->snapshot);
+    free(cursor);
+}
+
+/*
+ * Batches received from a replication primary are applied as a
+ * whole with a single write.
+ */
+leveldb_writebatch_t *applybatch;
+
+void leveldb_apply_put(const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    if(applybatch == NULL)
+        applybatch = leveldb_writebatch_create();
+
+    leveldb_writebatch_put(applybatch, key, key_len, value, value_len);
+}
+
+void leveldb_apply_delete(const char *key, size_t key_len)
+{
+    if(applybatch == NULL)
+        applybatch = leveldb_writebatch_create();
+
+    leveldb_writebatch_delete(applybatch, key, key_len);
+}
+
+int leveldb_apply(void)
+{
+    char *error = NULL;
+
+    if(applybatch == NULL)
+        return 0;
+
+    leveldb_write(db, woptions, applybatch, &error);
+    leveldb_writebatch_clear(applybatch);
+
+    if(error != NULL){
+        logerror("LevelDB apply failed: %s", error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Removes everything, used before a follower receives a snapshot.
+ */
+int leveldb_clear(void)
+{
+    leveldb_iterator_t *it;
+    const char *key;
+    size_t key_len;
+    int count = 0;
+
+    it = leveldb_create_iterator(db, roptions);
+
+    for(leveldb_iter_seek_to_first(it); leveldb_iter_valid(it); leveldb_iter_next(it)){
+       key = leveldb_iter_key(it, &key_len);
+       leveldb_apply_delete(key, key_len);
+
+       if(++count % 1000 == 0 && leveldb_apply() != 0)
+          break;
+    }
+
+    leveldb_iter_destroy(it);
+
+    return leveldb_apply();
+}
@@ -30,9 +30,38 @@
 extern int leveldb_init(void);
 extern int leveldb_free(void);
 
-extern int leveldb_add_message(struct queue *queue, char *message);
-extern char* leveldb_get_message(struct queue *queue);
-extern int leveldb_ack_message(struct queue *queue);
+extern void leveldb_commit_put(const char *key, size_t key_len, const char *value, size_t value_len, char **error);
+extern void leveldb_commit_delete(const char *key, size_t key_len, char **error);
+extern void leveldb_flush(void);
+extern u_int64_t leveldb_writes(void);
+
+extern int leveldb_add_message(struct queue *queue, int priority, u_int64_t expires, char *message, u_int64_t dedup);
+extern int leveldb_add_messages(struct queue *queue, int priority, u_int64_t expires, const char *head, char **bodies, int count, u_int64_t dedup);
+extern int leveldb_add_shared(struct queue **queues, u_int64_t *expires, int count, int priority, const char *message);
+extern char* leveldb_get_message(struct queue *queue, int priority, u_int seq, u_int64_t *expires, u_int64_t *shared);
+extern int leveldb_ack_message(struct queue *queue, int priority, u_int seq, int redelivered, u_int64_t shared);
+extern u_int leveldb_get_redelivered(struct queue *queue, int priority, u_int seq);
+extern int leveldb_set_redelivered(struct queue *queue, int priority, u_int seq, u_int count);
+extern int leveldb_expire_messages(struct queue *queue, int priority, u_int64_t now, int max);
+extern int leveldb_drop_messages(struct queue *queue, int priority, u_int from, u_int count);
 extern int leveldb_load_queue(struct queue *queue);
+extern int leveldb_purge_queue(struct queue *queue);
+extern void leveldb_compact_queue(struct queue *queue, int priority, u_int from, u_int to);
+extern int leveldb_sync_durables(struct queue *queue, const char *record, size_t record_len, u_int from, u_int count);
+
+extern int leveldb_schedule_message(const char *key, const char *queuename, int priority, char *message);
+extern char* leveldb_get_scheduled(const char *key);
+extern int leveldb_unschedule_message(const char *key);
+extern int leveldb_load_schedule(const char *after, const char *until, int max, void (*callback)(const char *key, size_t key_len));
+
+extern void* leveldb_cursor_open(void);
+extern int leveldb_cursor_read(void *handle, int max, void (*callback)(void *arg, const char *key, size_t key_len, const char *value, size_t value_len), void *arg);
+extern int leveldb_cursor_messages(void *handle, struct queue *queue, int priority, u_int *seq, u_int to, int max, void (*callback)(void *arg, int priority, u_int seq, u_int64_t expires, char *message), void *arg);
+extern void leveldb_cursor_close(void *handle);
+
+extern void leveldb_apply_put(const char *key, size_t key_len, const char *value, size_t value_len);
+extern void leveldb_apply_delete(const char *key, size_t key_len);
+extern int leveldb_apply(void);
+extern int leveldb_clear(void);
 
 #endif /* _LEVELDB_H_ */
@@ -0,0 +1,717 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libredq - asynchronous client library for redqd, see libredq.h
+ *
+ * Every SEND carries a receipt header with a number counted per
+ * connection and stays on the pending list of its connection until
+ * the RECEIPT, or an ERROR with that receipt-id, comes back. The frame
+ * is handed to the output buffer by reference, so it is built once
+ * and sent again from the same memory after a reconnect.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "libredq.h"
+
+#define RECONNECT_MIN	100	/* ms */
+#define RECONNECT_MAX	5000
+#define ACK_BATCH	64
+#define ACK_DELAY	10	/* ms */
+
+struct pending {
+	TAILQ_ENTRY(pending) entries;
+	u_int receipt;
+	int count;
+	char *frame;
+	size_t len;
+	redq_receipt_cb cb;
+	void *arg;
+};
+
+struct subscription {
+	TAILQ_ENTRY(subscription) entries;
+	char *destination;
+	char *frame;
+	size_t len;
+	redq_message_cb cb;
+	void *arg;
+};
+
+struct conn {
+	struct redq *redq;
+	int index;
+	struct bufferevent *bev;
+	struct event *ev_reconnect;
+	struct event *ev_ack;
+	struct evbuffer *acks;
+	int nacks;
+	int connected;
+	int backoff;
+	u_int generation;
+	u_int next_receipt;
+	u_int unconfirmed;
+	int subscriptions;
+
+	TAILQ_HEAD(, pending) pending;
+	TAILQ_HEAD(, subscription) subscribed;
+};
+
+struct redq {
+	struct event_base *base;
+	struct sockaddr_storage *addrs;
+	int *addr_lens;
+	int nnodes;
+
+	struct conn *conns;
+	int pool;
+
+	int ack_batch;
+	int ack_delay;
+
+	redq_event_cb cb;
+	void *arg;
+};
+
+static void conn_open(struct conn *conn);
+
+static void conn_notify(struct conn *conn, enum redq_event event, const char *message)
+{
+	if (conn->redq->cb != NULL)
+		conn->redq->cb(conn->redq, conn->index, event, message, conn->redq->arg);
+}
+
+static void conn_flush_acks(struct conn *conn)
+{
+	if (conn->nacks == 0)
+		return;
+
+	bufferevent_write_buffer(conn->bev, conn->acks);
+	conn->nacks = 0;
+	evtimer_del(conn->ev_ack);
+}
+
+static void conn_on_ack(evutil_socket_t fd, short what, void *arg)
+{
+	conn_flush_acks((struct conn *)arg);
+}
+
+static void conn_on_reconnect(evutil_socket_t fd, short what, void *arg)
+{
+	conn_open((struct conn *)arg);
+}
+
+/*
+ * Drops the connection and opens it again after the backoff, which
+ * doubles with every failed attempt. ACKs not yet written are moot,
+ * the server sends those messages again.
+ */
+static void conn_lost(struct conn *conn)
+{
+	struct timeval tv;
+
+	if (conn->bev != NULL) {
+		bufferevent_free(conn->bev);
+		conn->bev = NULL;
+	}
+
+	conn->connected = 0;
+	conn->generation++;
+	evbuffer_drain(conn->acks, evbuffer_get_length(conn->acks));
+	conn->nacks = 0;
+	evtimer_del(conn->ev_ack);
+
+	tv.tv_sec = conn->backoff / 1000;
+	tv.tv_usec = (conn->backoff % 1000) * 1000;
+	evtimer_add(conn->ev_reconnect, &tv);
+
+	if (conn->backoff < RECONNECT_MAX)
+		conn->backoff *= 2;
+
+	conn_notify(conn, REDQ_LOST, NULL);
+}
+
+/*
+ * Splits the header lines of a frame into strings and returns the
+ * body behind them.
+ */
+static char* frame_split(char *headers)
+{
+	char *line;
+
+	for (line = headers; *line != '\0'; ) {
+		if (*line == '\n')
+			return line+1;
+
+		line = strchr(line, '\n');
+		if (line == NULL)
+			return NULL;
+		*line++ = '\0';
+	}
+
+	return line;
+}
+
+static const char* frame_header(const char *headers, const char *body, const char *key)
+{
+	const char *line;
+	size_t len = strlen(key);
+
+	for (line = headers; line < body && *line != '\n'; line += strlen(line)+1) {
+		if (strncmp(line, key, len) == 0 && line[len] == ':')
+			return line+len+1;
+	}
+
+	return NULL;
+}
+
+static void conn_on_receipt(struct conn *conn, const char *receipt, const char *error)
+{
+	struct pending *pending;
+	u_int number;
+
+	number = strtoul(receipt, NULL, 10);
+
+	/* Receipts come back in order, unless held for replication */
+	TAILQ_FOREACH(pending, &conn->pending, entries) {
+		if (pending->receipt == number)
+			break;
+	}
+
+	if (pending == NULL)
+		return;
+
+	TAILQ_REMOVE(&conn->pending, pending, entries);
+	conn->unconfirmed -= pending->count;
+
+	if (pending->cb != NULL)
+		pending->cb(conn->redq, pending->count, error, pending->arg);
+
+	free(pending->frame);
+	free(pending);
+}
+
+static void conn_on_message(struct conn *conn, char *frame, char *headers)
+{
+	struct redq_message *message;
+	struct subscription *subscription;
+	char *body;
+
+	body = frame_split(headers);
+	if (body == NULL) {
+		free(frame);
+		return;
+	}
+
+	message = calloc(1, sizeof(*message));
+	if (message == NULL) {
+		free(frame);
+		return;
+	}
+
+	message->redq = conn->redq;
+	message->frame = frame;
+	message->headers = headers;
+	message->body = body;
+	message->length = strlen(body);
+	message->destination = frame_header(headers, body, "destination");
+	message->id = frame_header(headers, body, "message-id");
+	message->conn = conn->index;
+	message->generation = conn->generation;
+
+	TAILQ_FOREACH(subscription, &conn->subscribed, entries) {
+		if (message->destination != NULL && strcmp(subscription->destination, message->destination) == 0)
+			break;
+	}
+
+	/* A pattern subscription gets messages of other destinations */
+	if (subscription == NULL)
+		subscription = TAILQ_FIRST(&conn->subscribed);
+
+	if (subscription == NULL) {
+		redq_message_free(message);
+		return;
+	}
+
+	subscription->cb(message, subscription->arg);
+}
+
+static void conn_on_read(struct bufferevent *bev, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	const char *receipt;
+	char *frame, *p, *headers, *body;
+	size_t len;
+
+	while ((frame = evbuffer_readln(input, &len, EVBUFFER_EOL_NUL)) != NULL) {
+		for (p = frame; *p == '\n' || *p == '\r'; p++)
+			;
+
+		headers = strchr(p, '\n');
+		headers = (headers != NULL) ? headers+1 : p+strlen(p);
+
+		if (strncmp(p, "MESSAGE\n", 8) == 0) {
+			conn_on_message(conn, frame, headers);
+			continue;
+		}
+
+		body = frame_split(headers);
+		if (body == NULL)
+			body = headers;
+
+		if (strncmp(p, "RECEIPT\n", 8) == 0) {
+			receipt = frame_header(headers, body, "receipt");
+			if (receipt != NULL)
+				conn_on_receipt(conn, receipt, NULL);
+		}
+		else if (strncmp(p, "CONNECTED\n", 10) == 0) {
+			conn->connected = 1;
+			conn->backoff = RECONNECT_MIN;
+			conn_notify(conn, REDQ_CONNECTED, NULL);
+		}
+		else if (strncmp(p, "ERROR\n", 6) == 0) {
+			receipt = frame_header(headers, body, "receipt-id");
+			if (receipt != NULL)
+				conn_on_receipt(conn, receipt, frame_header(headers, body, "message"));
+			else
+				conn_notify(conn, REDQ_ERROR, frame_header(headers, body, "message"));
+
+			/* The server logs the connection out after an error */
+			free(frame);
+			conn_lost(conn);
+			return;
+		}
+
+		free(frame);
+	}
+
+	conn_flush_acks(conn);
+}
+
+static void conn_on_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	if (what & BEV_EVENT_CONNECTED)
+		return;
+
+	conn_lost(conn);
+}
+
+/*
+ * Connects and sends CONNECT, the subscriptions and all unconfirmed
+ * SENDs; the output is written once the connection is up.
+ */
+static void conn_open(struct conn *conn)
+{
+	struct redq *redq = conn->redq;
+	struct subscription *subscription;
+	struct pending *pending;
+	struct evbuffer *output;
+	int node = conn->index % redq->nnodes;
+
+	conn->bev = bufferevent_socket_new(redq->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (conn->bev == NULL) {
+		conn_lost(conn);
+		return;
+	}
+
+	bufferevent_setcb(conn->bev, conn_on_read, NULL, conn_on_event, conn);
+	bufferevent_enable(conn->bev, EV_READ|EV_WRITE);
+
+	if (bufferevent_socket_connect(conn->bev, (struct sockaddr *)&redq->addrs[node], redq->addr_lens[node]) != 0) {
+		conn_lost(conn);
+		return;
+	}
+
+	output = bufferevent_get_output(conn->bev);
+	evbuffer_add(output, "CONNECT\n\n", 10);
+
+	TAILQ_FOREACH(subscription, &conn->subscribed, entries)
+		evbuffer_add_reference(output, subscription->frame, subscription->len, NULL, NULL);
+
+	TAILQ_FOREACH(pending, &conn->pending, entries)
+		evbuffer_add_reference(output, pending->frame, pending->len, NULL, NULL);
+}
+
+/*
+ * Connected connection with the fewest unconfirmed messages, or any
+ * with the fewest while none is connected.
+ */
+static struct conn* redq_pick(struct redq *redq)
+{
+	struct conn *best = NULL;
+	int i;
+
+	for (i = 0; i < redq->pool; i++) {
+		if (best == NULL || redq->conns[i].connected > best->connected ||
+		    (redq->conns[i].connected == best->connected && redq->conns[i].unconfirmed < best->unconfirmed))
+			best = &redq->conns[i];
+	}
+
+	return best;
+}
+
+/*
+ * Takes the frame built in buf off it, keeps it until it is confirmed
+ * and writes it if the connection is open.
+ */
+static int redq_queue(struct conn *conn, struct evbuffer *buf, int count, redq_receipt_cb cb, void *arg)
+{
+	struct pending *pending;
+
+	pending = calloc(1, sizeof(*pending));
+	if (pending == NULL)
+		return 1;
+
+	pending->len = evbuffer_get_length(buf);
+	pending->frame = malloc(pending->len);
+	if (pending->frame == NULL) {
+		free(pending);
+		return 1;
+	}
+
+	evbuffer_remove(buf, pending->frame, pending->len);
+	pending->receipt = conn->next_receipt - 1;
+	pending->count = count;
+	pending->cb = cb;
+	pending->arg = arg;
+
+	TAILQ_INSERT_TAIL(&conn->pending, pending, entries);
+	conn->unconfirmed += count;
+
+	if (conn->bev != NULL)
+		evbuffer_add_reference(bufferevent_get_output(conn->bev), pending->frame, pending->len, NULL, NULL);
+
+	return 0;
+}
+
+static int redq_send_frame(struct redq *redq, const char *destination, const char *headers,
+    const char **bodies, const size_t *lengths, int count, int batch, redq_receipt_cb cb, void *arg)
+{
+	struct conn *conn = redq_pick(redq);
+	struct evbuffer *buf;
+	int i, ret;
+
+	if ((buf = evbuffer_new()) == NULL)
+		return 1;
+
+	evbuffer_add_printf(buf, "SEND\ndestination:%s\nreceipt:%u\n", destination, conn->next_receipt++);
+	if (headers != NULL)
+		evbuffer_add(buf, headers, strlen(headers));
+
+	if (batch) {
+		evbuffer_add_printf(buf, "batch-count:%d\n\n", count);
+		for (i = 0; i < count; i++) {
+			evbuffer_add_printf(buf, "%lu\n", (unsigned long)lengths[i]);
+			evbuffer_add(buf, bodies[i], lengths[i]);
+			evbuffer_add(buf, "\n", 1);
+		}
+	}
+	else {
+		evbuffer_add(buf, "\n", 1);
+		evbuffer_add(buf, bodies[0], lengths[0]);
+	}
+
+	evbuffer_add(buf, "\0", 1);
+
+	ret = redq_queue(conn, buf, count, cb, arg);
+	evbuffer_free(buf);
+
+	return ret;
+}
+
+struct redq* redq_new(struct event_base *base, char **nodes, int nnodes, int pool)
+{
+	struct redq *redq;
+	struct conn *conn;
+	int i;
+
+	if (nnodes <= 0 || pool <= 0)
+		return NULL;
+
+	redq = calloc(1, sizeof(*redq));
+	if (redq == NULL)
+		return NULL;
+
+	redq->base = base;
+	redq->nnodes = nnodes;
+	redq->pool = pool;
+	redq->ack_batch = ACK_BATCH;
+	redq->ack_delay = ACK_DELAY;
+	redq->addrs = calloc(nnodes, sizeof(*redq->addrs));
+	redq->addr_lens = calloc(nnodes, sizeof(*redq->addr_lens));
+	redq->conns = calloc(pool, sizeof(*redq->conns));
+	if (redq->addrs == NULL || redq->addr_lens == NULL || redq->conns == NULL) {
+		redq_free(redq);
+		return NULL;
+	}
+
+	for (i = 0; i < nnodes; i++) {
+		redq->addr_lens[i] = sizeof(redq->addrs[i]);
+		if (evutil_parse_sockaddr_port(nodes[i], (struct sockaddr *)&redq->addrs[i], &redq->addr_lens[i]) != 0) {
+			redq_free(redq);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < pool; i++) {
+		conn = &redq->conns[i];
+		conn->redq = redq;
+		conn->index = i;
+		conn->backoff = RECONNECT_MIN;
+		conn->next_receipt = 1;
+		TAILQ_INIT(&conn->pending);
+		TAILQ_INIT(&conn->subscribed);
+
+		conn->acks = evbuffer_new();
+		conn->ev_ack = evtimer_new(base, conn_on_ack, conn);
+		conn->ev_reconnect = evtimer_new(base, conn_on_reconnect, conn);
+		if (conn->acks == NULL || conn->ev_ack == NULL || conn->ev_reconnect == NULL) {
+			redq_free(redq);
+			return NULL;
+		}
+	}
+
+	return redq;
+}
+
+/*
+ * Closes all connections, unconfirmed SENDs are dropped without
+ * their callbacks.
+ */
+void redq_free(struct redq *redq)
+{
+	struct subscription *subscription;
+	struct pending *pending;
+	struct conn *conn;
+	int i;
+
+	for (i = 0; redq->conns != NULL && i < redq->pool; i++) {
+		conn = &redq->conns[i];
+
+		/* Output refers to the frames */
+		if (conn->bev != NULL)
+			bufferevent_free(conn->bev);
+
+		while ((pending = TAILQ_FIRST(&conn->pending)) != NULL) {
+			TAILQ_REMOVE(&conn->pending, pending, entries);
+			free(pending->frame);
+			free(pending);
+		}
+
+		while ((subscription = TAILQ_FIRST(&conn->subscribed)) != NULL) {
+			TAILQ_REMOVE(&conn->subscribed, subscription, entries);
+			free(subscription->destination);
+			free(subscription->frame);
+			free(subscription);
+		}
+
+		if (conn->acks != NULL)
+			evbuffer_free(conn->acks);
+		if (conn->ev_ack != NULL)
+			event_free(conn->ev_ack);
+		if (conn->ev_reconnect != NULL)
+			event_free(conn->ev_reconnect);
+	}
+
+	free(redq->conns);
+	free(redq->addrs);
+	free(redq->addr_lens);
+	free(redq);
+}
+
+void redq_setcb(struct redq *redq, redq_event_cb cb, void *arg)
+{
+	redq->cb = cb;
+	redq->arg = arg;
+}
+
+/*
+ * ACKs are written once batch of them are collected, at the end of
+ * reading a chunk of frames or delay milliseconds after the first.
+ */
+void redq_set_ack(struct redq *redq, int batch, int delay)
+{
+	redq->ack_batch = (batch > 0) ? batch : 1;
+	redq->ack_delay = (delay >= 0) ? delay : 0;
+}
+
+int redq_connect(struct redq *redq)
+{
+	int i;
+
+	for (i = 0; i < redq->pool; i++) {
+		if (redq->conns[i].bev == NULL && !evtimer_pending(redq->conns[i].ev_reconnect, NULL))
+			conn_open(&redq->conns[i]);
+	}
+
+	return 0;
+}
+
+int redq_send(struct redq *redq, const char *destination, const char *headers,
+    const char *body, size_t length, redq_receipt_cb cb, void *arg)
+{
+	return redq_send_frame(redq, destination, headers, &body, &length, 1, 0, cb, arg);
+}
+
+/*
+ * Sends count messages with the same headers as one batch SEND, they
+ * are stored together and confirmed with a single callback.
+ */
+int redq_send_batch(struct redq *redq, const char *destination, const char *headers,
+    const char **bodies, const size_t *lengths, int count, redq_receipt_cb cb, void *arg)
+{
+	if (count <= 0)
+		return 1;
+
+	return redq_send_frame(redq, destination, headers, bodies, lengths, count, 1, cb, arg);
+}
+
+/*
+ * Messages sent but not yet confirmed.
+ */
+u_int redq_unconfirmed(struct redq *redq)
+{
+	u_int unconfirmed = 0;
+	int i;
+
+	for (i = 0; i < redq->pool; i++)
+		unconfirmed += redq->conns[i].unconfirmed;
+
+	return unconfirmed;
+}
+
+/*
+ * Subscribes on the connection with the fewest subscriptions. headers
+ * may add lines like "ack:client\n" or "prefetch:500\n".
+ */
+int redq_subscribe(struct redq *redq, const char *destination, const char *headers,
+    redq_message_cb cb, void *arg)
+{
+	struct subscription *subscription;
+	struct conn *conn = &redq->conns[0];
+	struct evbuffer *buf;
+	int i;
+
+	for (i = 1; i < redq->pool; i++) {
+		if (redq->conns[i].subscriptions < conn->subscriptions)
+			conn = &redq->conns[i];
+	}
+
+	subscription = calloc(1, sizeof(*subscription));
+	if (subscription == NULL)
+		return 1;
+
+	buf = evbuffer_new();
+	subscription->destination = strdup(destination);
+	if (buf == NULL || subscription->destination == NULL) {
+		if (buf != NULL)
+			evbuffer_free(buf);
+		free(subscription->destination);
+		free(subscription);
+		return 1;
+	}
+
+	evbuffer_add_printf(buf, "SUBSCRIBE\ndestination:%s\n%s\n", destination, (headers != NULL) ? headers : "");
+	evbuffer_add(buf, "\0", 1);
+
+	subscription->len = evbuffer_get_length(buf);
+	subscription->frame = malloc(subscription->len);
+	if (subscription->frame == NULL) {
+		evbuffer_free(buf);
+		free(subscription->destination);
+		free(subscription);
+		return 1;
+	}
+
+	evbuffer_remove(buf, subscription->frame, subscription->len);
+	evbuffer_free(buf);
+
+	subscription->cb = cb;
+	subscription->arg = arg;
+	TAILQ_INSERT_TAIL(&conn->subscribed, subscription, entries);
+	conn->subscriptions++;
+
+	if (conn->bev != NULL)
+		evbuffer_add_reference(bufferevent_get_output(conn->bev), subscription->frame, subscription->len, NULL, NULL);
+
+	return 0;
+}
+
+/*
+ * Acknowledges a message of an ack:client subscription. After a
+ * reconnect the server sends the message again, so it is ignored.
+ */
+int redq_ack(struct redq_message *message)
+{
+	struct redq *redq = message->redq;
+	struct conn *conn = &redq->conns[message->conn];
+	struct timeval tv;
+
+	if (message->id == NULL)
+		return 1;
+
+	if (conn->generation != message->generation || conn->bev == NULL)
+		return 0;
+
+	evbuffer_add_printf(conn->acks, "ACK\nmessage-id:%s\n\n", message->id);
+	evbuffer_add(conn->acks, "\0", 1);
+
+	if (++conn->nacks >= redq->ack_batch)
+		conn_flush_acks(conn);
+	else if (conn->nacks == 1) {
+		tv.tv_sec = redq->ack_delay / 1000;
+		tv.tv_usec = (redq->ack_delay % 1000) * 1000;
+		evtimer_add(conn->ev_ack, &tv);
+	}
+
+	return 0;
+}
+
+const char* redq_header(struct redq_message *message, const char *key)
+{
+	return frame_header(message->headers, message->body, key);
+}
+
+void redq_message_free(struct redq_message *message)
+{
+	free(message->frame);
+	free(message);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIBREDQ_H_
+#define _LIBREDQ_H_
+
+/*
+ * libredq - asynchronous client library for redqd on libevent
+ *
+ * A struct redq is a pool of connections spread round robin over the
+ * given nodes. SENDs are pipelined: redq_send() returns at once and
+ * its callback runs when the RECEIPT or the ERROR for it comes back.
+ * A lost connection is opened again with backoff, its subscriptions
+ * are renewed and its unconfirmed SENDs are sent once more, so they
+ * arrive at least once (a dedup-id header with the dedup= policy
+ * drops the duplicates). ACKs are collected and written together.
+ *
+ * Bodies must not contain NUL bytes. The application should ignore
+ * SIGPIPE, a write to a lost connection raises it.
+ */
+
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+enum redq_event {
+	REDQ_CONNECTED,	/* CONNECTED received */
+	REDQ_LOST,		/* connection lost, it is opened again */
+	REDQ_ERROR		/* ERROR which belongs to no SEND */
+};
+
+struct redq;
+
+/*
+ * A received MESSAGE, it belongs to the application after the
+ * callback and is released with redq_message_free().
+ */
+struct redq_message {
+	struct redq *redq;
+	const char *destination;
+	const char *id;
+	const char *body;
+	size_t length;
+
+	/* for libredq */
+	char *frame;
+	char *headers;
+	int conn;
+	u_int generation;
+};
+
+typedef void (*redq_event_cb)(struct redq *redq, int conn, enum redq_event event, const char *message, void *arg);
+typedef void (*redq_receipt_cb)(struct redq *redq, int count, const char *error, void *arg);
+typedef void (*redq_message_cb)(struct redq_message *message, void *arg);
+
+struct redq* redq_new(struct event_base *base, char **nodes, int nnodes, int pool);
+void redq_free(struct redq *redq);
+void redq_setcb(struct redq *redq, redq_event_cb cb, void *arg);
+void redq_set_ack(struct redq *redq, int batch, int delay);
+int redq_connect(struct redq *redq);
+
+int redq_send(struct redq *redq, const char *destination, const char *headers,
+	 const char *body, size_t length, redq_receipt_cb cb, void *arg);
+int redq_send_batch(struct redq *redq, const char *destination, const char *headers,
+	 const char **bodies, const size_t *lengths, int count, redq_receipt_cb cb, void *arg);
+u_int redq_unconfirmed(struct redq *redq);
+
+int redq_subscribe(struct redq *redq, const char *destination, const char *headers,
+	 redq_message_cb cb, void *arg);
+int redq_ack(struct redq_message *message);
+const char* redq_header(struct redq_message *message, const char *key);
+void redq_message_free(struct redq_message *message);
+
+#endif /* _LIBREDQ_H_ */
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "stomp.h"
+#include "stomputil.h"
+#include "memory.h"
+
+/*
+ * Memory accounting. Everything buffered for a connection, input
+ * as well as corked and unsent output, is charged to the connection
+ * and to the global counter. Output of MESSAGE frames is charged to
+ * its destination as well until it is written to the socket.
+ *
+ * memoryLimit bounds the global counter, the memory= option of a
+ * destination policy the bytes of one destination. What happens
+ * when a limit is reached is up to memoryPolicy (or the onmemory=
+ * option of the policy): flow stops reading from the producer until
+ * memory was released, reject answers SEND with an ERROR and spill
+ * keeps new messages in the storage without delivering them.
+ * Producers blocked by a full queue (overflow=block-producer) wait
+ * on the same list.
+ */
+static struct event *ev_resume;
+static struct event *ev_report;
+
+static u_int64_t memory_limit;
+static int memory_policy;
+
+static size_t memory_used;
+
+/* Time of the last warning, they are logged once a second at most */
+static u_int64_t memory_warned;
+
+/* Paused producers plus spilled destinations */
+static int memory_waiting;
+
+static TAILQ_HEAD(, client) paused = TAILQ_HEAD_INITIALIZER(paused);
+
+static int memory_over(struct queue *queue)
+{
+    if(memory_limit != 0 && memory_used >= memory_limit)
+        return 1;
+
+    return queue != NULL && queue->policy->memory != 0 && queue->memory >= queue->policy->memory;
+}
+
+static void memory_add(struct client *client, size_t bytes)
+{
+    client->memory += bytes;
+    memory_used += bytes;
+}
+
+/*
+ * Releases bytes of a connection. The destinations charged for them
+ * are taken from the head of the charge list when output drained.
+ */
+static void memory_release(struct client *client, size_t bytes, int output)
+{
+    struct charge *charge;
+    struct queue *queue;
+    size_t n;
+    int wakeup = 0;
+
+    if(memory_limit != 0 && memory_used >= memory_limit && memory_used - bytes < memory_limit)
+        wakeup = 1;
+
+    client->memory -= bytes;
+    memory_used -= bytes;
+
+    while(output && bytes > 0 && (charge = TAILQ_FIRST(&client->charges)) != NULL){
+        n = (bytes < charge->bytes) ? bytes : charge->bytes;
+        queue = charge->queue;
+
+        if(queue != NULL){
+            if(queue->policy->memory != 0 && queue->memory >= queue->policy->memory && queue->memory - n < queue->policy->memory)
+                wakeup = 1;
+            queue->memory -= n;
+        }
+
+        charge->bytes -= n;
+        bytes -= n;
+
+        if(charge->bytes == 0){
+            TAILQ_REMOVE(&client->charges, charge, entries);
+            free(charge);
+        }
+    }
+
+    if(wakeup && memory_waiting > 0)
+        event_active(ev_resume, EV_TIMEOUT, 0);
+}
+
+static void memory_on_input(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg)
+{
+    struct client *client = arg;
+
+    if(info->n_added > 0)
+        memory_add(client, info->n_added);
+    if(info->n_deleted > 0)
+        memory_release(client, info->n_deleted, 0);
+}
+
+/*
+ * Output is charged by memory_charge() when it is queued for the
+ * connection, only the drain is seen here.
+ */
+static void memory_on_output(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg)
+{
+    struct client *client = arg;
+
+    if(info->n_deleted > 0)
+        memory_release(client, info->n_deleted, 1);
+}
+
+/*
+ * Continues paused producers and spilled destinations which are
+ * below their limits again.
+ */
+static void memory_on_resume(int fd, short ev, void *arg)
+{
+    struct client *client, *tmp_client;
+    struct queue *queue;
+
+    for(client = TAILQ_FIRST(&paused); client != NULL; client = tmp_client){
+        tmp_client = TAILQ_NEXT(client, paused_entries);
+
+        if(memory_over(client->paused_queue) || (client->paused_queue != NULL && stomp_queue_full(client->paused_queue, 1, 0)))
+            continue;
+
+        TAILQ_REMOVE(&paused, client, paused_entries);
+        client->paused = 0;
+        client->paused_queue = NULL;
+        memory_waiting--;
+
+        /* A rate limit keeps it stopped until the tokens are refilled */
+        if(client->throttled)
+            continue;
+
+        /* Frames already read are handled from the next iteration */
+        bufferevent_enable(client->bev, EV_READ);
+        bufferevent_trigger(client->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+    }
+
+    TAILQ_FOREACH(queue, &queues, entries){
+        if(!queue->spilled || memory_over(queue))
+            continue;
+
+        queue->spilled = 0;
+        memory_waiting--;
+        stomp_dispatch(queue);
+    }
+}
+
+static void memory_on_report(int fd, short ev, void *arg)
+{
+    struct client *client;
+    struct queue *queue;
+
+    loginfo("Memory: %zu bytes in use, limit %llu", memory_used, (unsigned long long)memory_limit);
+
+    TAILQ_FOREACH(queue, &queues, entries){
+        if(queue->memory > 0 || queue->spilled)
+            loginfo("Memory: %s %zu bytes%s", queue->queuename, queue->memory, queue->spilled ? " (spilled)" : "");
+    }
+
+    TAILQ_FOREACH(client, &clients, entries){
+        if(client->memory > 0 || client->paused)
+            loginfo("Memory: client %d %zu bytes%s", client->fd, client->memory, client->paused ? " (paused)" : "");
+    }
+}
+
+int memory_init(struct event_base *base)
+{
+    memory_limit = strtoull(configget("memoryLimit"), NULL, 10);
+
+    memory_policy = memorypolicyparse(configget("memoryPolicy"));
+    if(memory_policy <= MEMORY_DEFAULT){
+        logerror("Invalid memoryPolicy %s", configget("memoryPolicy"));
+        return 1;
+    }
+
+    ev_resume = event_new(base, -1, 0, memory_on_resume, NULL);
+    if(ev_resume == NULL)
+        return 1;
+
+    /* SIGUSR1 logs where the memory went */
+    ev_report = evsignal_new(base, SIGUSR1, memory_on_report, NULL);
+    if(ev_report == NULL || event_add(ev_report, NULL) != 0)
+        return 1;
+
+    return 0;
+}
+
+void memory_free(void)
+{
+    event_free(ev_report);
+    event_free(ev_resume);
+}
+
+void memory_client_init(struct client *client)
+{
+    TAILQ_INIT(&client->charges);
+
+    evbuffer_add_cb(bufferevent_get_input(client->bev), memory_on_input, client);
+    evbuffer_add_cb(bufferevent_get_output(client->bev), memory_on_output, client);
+}
+
+void memory_free_client(struct client *client)
+{
+    struct charge *charge;
+
+    evbuffer_remove_cb(bufferevent_get_input(client->bev), memory_on_input, client);
+    evbuffer_remove_cb(bufferevent_get_output(client->bev), memory_on_output, client);
+
+    memory_release(client, client->memory, 1);
+
+    /* Left over when the accounting missed an allocation */
+    while((charge = TAILQ_FIRST(&client->charges)) != NULL){
+        TAILQ_REMOVE(&client->charges, charge, entries);
+        free(charge);
+    }
+
+    if(client->paused){
+        TAILQ_REMOVE(&paused, client, paused_entries);
+        memory_waiting--;
+    }
+}
+
+/*
+ * Drops all references to a destination which is going away.
+ */
+void memory_forget_queue(struct queue *queue)
+{
+    struct client *client;
+    struct charge *charge;
+
+    TAILQ_FOREACH(client, &clients, entries){
+        TAILQ_FOREACH(charge, &client->charges, entries){
+            if(charge->queue == queue)
+                charge->queue = NULL;
+        }
+
+        if(client->paused_queue == queue)
+            client->paused_queue = NULL;
+    }
+
+    if(queue->spilled)
+        memory_waiting--;
+}
+
+/*
+ * Charges output queued for a connection, to the destination in
+ * client->charging if set.
+ */
+void memory_charge(struct client *client, size_t bytes)
+{
+    struct charge *charge;
+
+    memory_add(client, bytes);
+
+    if(client->charging != NULL)
+        client->charging->memory += bytes;
+
+    charge = TAILQ_LAST(&client->charges, chargeq);
+    if(charge != NULL && charge->queue == client->charging){
+        charge->bytes += bytes;
+        return;
+    }
+
+    charge = calloc(1, sizeof(*charge));
+    if(charge == NULL){
+        if((charge = TAILQ_LAST(&client->charges, chargeq)) != NULL)
+            charge->bytes += bytes;
+        return;
+    }
+
+    charge->queue = client->charging;
+    charge->bytes = bytes;
+    TAILQ_INSERT_TAIL(&client->charges, charge, entries);
+}
+
+/*
+ * Charges memory which a destination holds outside of connection
+ * buffers, like the copies of topic messages waiting for fan-out.
+ */
+void memory_hold(struct queue *queue, size_t bytes)
+{
+    memory_used += bytes;
+    queue->memory += bytes;
+}
+
+void memory_unhold(struct queue *queue, size_t bytes)
+{
+    int wakeup = 0;
+
+    if(memory_limit != 0 && memory_used >= memory_limit && memory_used - bytes < memory_limit)
+        wakeup = 1;
+    if(queue->policy->memory != 0 && queue->memory >= queue->policy->memory && queue->memory - bytes < queue->policy->memory)
+        wakeup = 1;
+
+    memory_used -= bytes;
+    queue->memory -= bytes;
+
+    if(wakeup && memory_waiting > 0)
+        event_active(ev_resume, EV_TIMEOUT, 0);
+}
+
+/*
+ * Returns what to do with a SEND from client to queue: MEMORY_DEFAULT
+ * when within the limits, otherwise the policy. Destinations without
+ * storage cannot spill, peer links are never paused as they carry the
+ * requests of many clients.
+ */
+int memory_check(struct client *client, struct queue *queue)
+{
+    u_int64_t now;
+    int policy;
+
+    if(!memory_over(queue))
+        return MEMORY_DEFAULT;
+
+    now = mstime();
+    if(now - memory_warned >= 1000){
+        logwarn("Memory limit reached for %s: %zu bytes, %zu in total", queue->queuename, queue->memory, memory_used);
+        memory_warned = now;
+    }
+
+    policy = queue->policy->onmemory != MEMORY_DEFAULT ? queue->policy->onmemory : memory_policy;
+
+#ifdef WITH_LEVELDB
+    if(policy == MEMORY_SPILL && queue->topic)
+#else
+    if(policy == MEMORY_SPILL)
+#endif
+        policy = MEMORY_FLOW;
+
+    if(policy == MEMORY_FLOW && client != NULL && client->peer)
+        policy = MEMORY_REJECT;
+
+    return policy;
+}
+
+/*
+ * Looks at paused producers again, used when a queue they wait for
+ * got room.
+ */
+void memory_wakeup(void)
+{
+    if(memory_waiting > 0)
+        event_active(ev_resume, EV_TIMEOUT, 0);
+}
+
+/*
+ * Stops reading from a producer until memory_check() passes again
+ * and queue has room.
+ */
+void memory_pause(struct client *client, struct queue *queue)
+{
+    if(client->paused)
+        return;
+
+    client->paused = 1;
+    client->paused_queue = queue;
+    TAILQ_INSERT_TAIL(&paused, client, paused_entries);
+    memory_waiting++;
+
+    bufferevent_disable(client->bev, EV_READ);
+}
+
+/*
+ * Stops delivering a destination, its messages stay in the storage.
+ */
+void memory_spill(struct queue *queue)
+{
+    if(queue->spilled)
+        return;
+
+    queue->spilled = 1;
+    memory_waiting++;
+}
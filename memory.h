@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+#include <event2/event.h>
+
+struct client;
+struct queue;
+
+/**
+ * Output bytes of a connection charged to a destination, kept in
+ * the order they were written so draining output releases them.
+ */
+struct charge {
+    struct queue *queue;
+    size_t bytes;
+
+    TAILQ_ENTRY(charge) entries;
+};
+
+extern int memory_init(struct event_base *base);
+extern void memory_free(void);
+
+extern void memory_client_init(struct client *client);
+extern void memory_free_client(struct client *client);
+extern void memory_forget_queue(struct queue *queue);
+
+extern void memory_charge(struct client *client, size_t bytes);
+extern void memory_hold(struct queue *queue, size_t bytes);
+extern void memory_unhold(struct queue *queue, size_t bytes);
+extern int memory_check(struct client *client, struct queue *queue);
+extern void memory_pause(struct client *client, struct queue *queue);
+extern void memory_wakeup(void);
+extern void memory_spill(struct queue *queue);
+
+#endif /* _MEMORY_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints (USDT) of the redqd provider on the message
+ * path. Built with WITH_USDT they are a single nop each until a
+ * tracer attaches, otherwise they are left out. redq-stages.bt and
+ * redq-slow.bt turn them into latencies per stage.
+ *
+ *   frame_start(fd, length)      a frame was read from a client
+ *   frame_parsed(fd)             its headers are parsed
+ *   frame_done(fd, cmd)          it is handled, with the response
+ *   request_start(fd, command)   dispatch to the command handler
+ *   request_done(fd, cmd, ret)   the handler returned
+ *   store_start(queue, count)    messages are written to LevelDB
+ *   store_done(queue, count, ret)
+ *   fanout_start(queue)          a topic message is sent out
+ *   fanout_done(queue, lag)      all subscribers got it (ms)
+ *   response_start(fd, cmd)      a frame is built for a client
+ *   response_done(fd, length)
+ *   flush(fd, length)            corked output goes to the socket
+ */
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+
+#define REDQ_PROBE1(name, a) DTRACE_PROBE1(redqd, name, a)
+#define REDQ_PROBE2(name, a, b) DTRACE_PROBE2(redqd, name, a, b)
+#define REDQ_PROBE3(name, a, b, c) DTRACE_PROBE3(redqd, name, a, b, c)
+#else
+/* sizeof keeps the arguments referenced without evaluating them */
+#define REDQ_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define REDQ_PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define REDQ_PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif /* _PROBES_H_ */
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "log.h"
+#include "util.h"
+#include "server.h"
+#include "client.h"
+#include "ratelimit.h"
+
+/*
+ * Producer rate limits. Messages and bytes sent are taken from token
+ * buckets of the connection (clientRate, clientByteRate), of the
+ * login (loginRate, loginByteRate) and of the destination (rate= and
+ * byterate= options of its policy). A bucket holds at most one second
+ * worth of tokens. When one runs empty the message is still taken but
+ * reading from the producer stops until the tokens are refilled, so
+ * the backpressure reaches the producer over TCP. With the io_uring
+ * backend what its receive already took is still processed, up to
+ * URINGRECVMAX bytes and a filled buffer ring, before it stops.
+ */
+struct login {
+    char *name;
+    u_int clients;
+
+    struct tokenbucket messages;
+    struct tokenbucket bytes;
+
+    TAILQ_ENTRY(login) entries;
+};
+
+static TAILQ_HEAD(, login) logins = TAILQ_HEAD_INITIALIZER(logins);
+
+static u_int64_t client_rate;
+static u_int64_t client_byte_rate;
+static u_int64_t login_rate;
+static u_int64_t login_byte_rate;
+
+/*
+ * Takes count tokens from a bucket refilled with rate tokens per
+ * second. Returns the milliseconds until it is not in debt anymore.
+ */
+static u_int64_t ratelimit_take(struct tokenbucket *bucket, u_int64_t rate, double count, u_int64_t now)
+{
+    if(rate == 0)
+        return 0;
+
+    if(bucket->updated == 0)
+        bucket->tokens = rate;
+    else
+        bucket->tokens += (double)rate * (now - bucket->updated) / 1000;
+
+    if(bucket->tokens > rate)
+        bucket->tokens = rate;
+
+    bucket->updated = now;
+    bucket->tokens -= count;
+
+    if(bucket->tokens >= 0)
+        return 0;
+
+    return (u_int64_t)(-bucket->tokens * 1000 / rate) + 1;
+}
+
+static void ratelimit_on_refill(int fd, short ev, void *arg)
+{
+    struct client *client = (struct client *)arg;
+
+    client->throttled = 0;
+
+    /* Producer flow control of memory.c keeps it stopped */
+    if(client->paused)
+        return;
+
+    bufferevent_enable(client->bev, EV_READ);
+    bufferevent_trigger(client->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+/*
+ * Stops reading from a producer for delay milliseconds.
+ */
+static void ratelimit_throttle(struct client *client, u_int64_t delay)
+{
+    struct timeval tv;
+
+    if(client->ev_throttle == NULL){
+        client->ev_throttle = evtimer_new(base, ratelimit_on_refill, client);
+        if(client->ev_throttle == NULL)
+            return;
+    }
+
+    tv.tv_sec = delay / 1000;
+    tv.tv_usec = (delay % 1000) * 1000;
+
+    client->throttled = 1;
+    bufferevent_disable(client->bev, EV_READ);
+    evtimer_add(client->ev_throttle, &tv);
+}
+
+void ratelimit_init(void)
+{
+    client_rate = strtoull(configget("clientRate"), NULL, 10);
+    client_byte_rate = strtoull(configget("clientByteRate"), NULL, 10);
+    login_rate = strtoull(configget("loginRate"), NULL, 10);
+    login_byte_rate = strtoull(configget("loginByteRate"), NULL, 10);
+}
+
+/*
+ * Attaches a connection to the buckets of its login.
+ */
+int ratelimit_login(struct client *client, const char *login)
+{
+    struct login *entry;
+
+    if(client->login != NULL || login == NULL)
+        return 0;
+
+    TAILQ_FOREACH(entry, &logins, entries) {
+        if(strcmp(entry->name, login) == 0)
+            break;
+    }
+
+    if(entry == NULL){
+        entry = calloc(1, sizeof(*entry));
+        if(entry == NULL)
+            return 1;
+
+        entry->name = strdup(login);
+        TAILQ_INSERT_TAIL(&logins, entry, entries);
+    }
+
+    entry->clients++;
+    client->login = entry;
+
+    return 0;
+}
+
+void ratelimit_free_client(struct client *client)
+{
+    if(client->ev_throttle != NULL)
+        event_free(client->ev_throttle);
+
+    if(client->login != NULL && --client->login->clients == 0){
+        TAILQ_REMOVE(&logins, client->login, entries);
+        free(client->login->name);
+        free(client->login);
+    }
+
+    client->login = NULL;
+}
+
+const char* ratelimit_login_name(struct client *client)
+{
+    return client->login != NULL ? client->login->name : NULL;
+}
+
+/*
+ * Charges count messages of together size bytes sent by client to
+ * queue. Returns 1 if the client was throttled, the messages are
+ * taken nevertheless.
+ * Peer links carry other clients as well and are never throttled.
+ */
+int ratelimit_check(struct client *client, struct queue *queue, u_int count, size_t size)
+{
+    u_int64_t now, delay, wait;
+
+    if(client == NULL || client->peer)
+        return 0;
+
+    now = mstime();
+
+    delay = ratelimit_take(&client->rate_messages, client_rate, count, now);
+    wait = ratelimit_take(&client->rate_bytes, client_byte_rate, size, now);
+    if(wait > delay)
+        delay = wait;
+
+    if(client->login != NULL){
+        wait = ratelimit_take(&client->login->messages, login_rate, count, now);
+        if(wait > delay)
+            delay = wait;
+        wait = ratelimit_take(&client->login->bytes, login_byte_rate, size, now);
+        if(wait > delay)
+            delay = wait;
+    }
+
+    if(queue->policy != NULL){
+        wait = ratelimit_take(&queue->rate_messages, queue->policy->rate, count, now);
+        if(wait > delay)
+            delay = wait;
+        wait = ratelimit_take(&queue->rate_bytes, queue->policy->byterate, size, now);
+        if(wait > delay)
+            delay = wait;
+    }
+
+    if(delay == 0)
+        return 0;
+
+    ratelimit_throttle(client, delay);
+
+    return 1;
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * redq-bench - load generator for redqd
+ *
+ * Every connection subscribes to its own queue and sends messages to
+ * it with a receipt, keeping a window of unconfirmed messages in
+ * flight. It talks to the server through libredq, one client with a
+ * single connection each. Connections are spread round robin over the given nodes, so
+ * with a cluster most destinations are owned by another node than the
+ * one the connection talks to.
+ *
+ * With -C all connections are opened at once and only CONNECT, which
+ * measures how fast the server drains a reconnect storm. -P with the
+ * pid of the server reports its memory per idle connection afterwards.
+ * A source port is needed per connection, for a million of them the
+ * server has to listen on several addresses given as nodes.
+ *
+ * -b sends the messages in batch SENDs of the given number of messages
+ * with a single RECEIPT each.
+ *
+ * -D gives every message a dedup-id header. Compared to a run without
+ * it against destinations with the dedup= policy option, this is the
+ * cost of the duplicate lookup per SEND.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <event2/event.h>
+
+#include "libredq.h"
+
+struct conn {
+	int id;
+	struct redq *redq;
+	char destination[32];
+
+	int sent;
+	int receipts;
+	int messages;
+	int finished;
+};
+
+static struct event_base *base;
+static struct conn *conns;
+
+static int nconns = 16;
+static int nmessages = 10000;
+static int window = 128;
+static int size = 64;
+static int batch = 1;
+static int storm;
+static int dedup;
+static pid_t server;
+static char *body;
+static const char **bodies;
+static size_t *lengths;
+
+static int done;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: redq-bench [-CD] [-P pid] [-b batch] [-c connections] [-n messages] [-s size] [-w window] [host:port ...]\n");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Resident size of the server in kilobytes.
+ */
+static long server_rss(void)
+{
+	char cmd[64];
+	FILE *ps;
+	long rss = -1;
+
+	snprintf(cmd, sizeof(cmd), "ps -o rss= -p %d", (int)server);
+	if ((ps = popen(cmd, "r")) == NULL)
+		err(1, "ps failed");
+
+	if (fscanf(ps, "%ld", &rss) != 1)
+		errx(1, "no process %d", (int)server);
+
+	pclose(ps);
+
+	return rss;
+}
+
+static void bench_receipt(struct redq *redq, int count, const char *error, void *arg);
+
+static void bench_send(struct conn *conn)
+{
+	char headers[64];
+	int n;
+
+	while (conn->sent < nmessages && conn->sent - conn->receipts < window) {
+		n = nmessages - conn->sent < batch ? nmessages - conn->sent : batch;
+
+		headers[0] = '\0';
+		if (dedup)
+			snprintf(headers, sizeof(headers), "dedup-id:%d.%d.%d\n", (int)getpid(), conn->id, conn->sent);
+
+		if (batch > 1) {
+			if (redq_send_batch(conn->redq, conn->destination, headers, bodies, lengths, n, bench_receipt, conn) != 0)
+				errx(1, "connection %d: send failed", conn->id);
+		}
+		else if (redq_send(conn->redq, conn->destination, headers, body, size, bench_receipt, conn) != 0)
+			errx(1, "connection %d: send failed", conn->id);
+
+		conn->sent += n;
+	}
+}
+
+static void bench_check_done(struct conn *conn)
+{
+	if (storm)
+		return;
+
+	if (conn->finished == 0 && conn->receipts == nmessages && conn->messages == nmessages) {
+		conn->finished = 1;
+		if (++done == nconns)
+			event_base_loopbreak(base);
+	}
+}
+
+static void bench_receipt(struct redq *redq, int count, const char *error, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	if (error != NULL)
+		errx(1, "connection %d: %s", conn->id, error);
+
+	conn->receipts += count;
+	bench_send(conn);
+	bench_check_done(conn);
+}
+
+static void bench_message(struct redq_message *message, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	conn->messages++;
+	redq_message_free(message);
+	bench_check_done(conn);
+}
+
+/*
+ * A lost connection would be opened again, but that spoils the
+ * numbers.
+ */
+static void bench_event(struct redq *redq, int index, enum redq_event event, const char *message, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	switch (event) {
+	case REDQ_CONNECTED:
+		if (storm && ++done == nconns)
+			event_base_loopbreak(base);
+		break;
+	case REDQ_LOST:
+		errx(1, "connection %d lost", conn->id);
+	case REDQ_ERROR:
+		errx(1, "connection %d: %s", conn->id, message != NULL ? message : "error");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	char *defaultnode = "127.0.0.1:8080";
+	char **nodes;
+	int nnodes;
+	int ch, i;
+	double start, elapsed;
+	long rss = 0;
+
+	while ((ch = getopt(argc, argv, "CDP:b:c:n:s:w:")) != -1) {
+		switch (ch) {
+		case 'C':
+			storm = 1;
+			break;
+		case 'D':
+			dedup = 1;
+			break;
+		case 'P':
+			server = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 'n':
+			nmessages = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (nconns <= 0 || nmessages <= 0 || size < 0 || window <= 0 || batch <= 0)
+		usage();
+
+	if (argc > 0) {
+		nodes = argv;
+		nnodes = argc;
+	}
+	else {
+		nodes = &defaultnode;
+		nnodes = 1;
+	}
+
+	body = malloc(size+1);
+	bodies = calloc(batch, sizeof(*bodies));
+	lengths = calloc(batch, sizeof(*lengths));
+	conns = calloc(nconns, sizeof(*conns));
+	if (body == NULL || bodies == NULL || lengths == NULL || conns == NULL)
+		err(1, "malloc failed");
+
+	memset(body, 'x', size);
+	body[size] = '\0';
+
+	for (i = 0; i < batch; i++) {
+		bodies[i] = body;
+		lengths[i] = size;
+	}
+
+	/* Every connection needs a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	base = event_base_new();
+
+	if (server > 0)
+		rss = server_rss();
+
+	start = now();
+
+	for (i = 0; i < nconns; i++) {
+		conns[i].id = i;
+		conns[i].redq = redq_new(base, &nodes[i % nnodes], 1, 1);
+		if (conns[i].redq == NULL)
+			errx(1, "invalid address %s", nodes[i % nnodes]);
+
+		redq_setcb(conns[i].redq, bench_event, &conns[i]);
+		redq_connect(conns[i].redq);
+
+		if (storm)
+			continue;
+
+		snprintf(conns[i].destination, sizeof(conns[i].destination), "/queue/bench.%d", i);
+		if (redq_subscribe(conns[i].redq, conns[i].destination, NULL, bench_message, &conns[i]) != 0)
+			errx(1, "connection %d: subscribe failed", i);
+		bench_send(&conns[i]);
+	}
+
+	event_base_dispatch(base);
+
+	elapsed = now() - start;
+
+	if (storm)
+		printf("%d connections, %d nodes, connected in %.3f s: %.0f connections/s\n",
+		    nconns, nnodes, elapsed, nconns / elapsed);
+	else
+		printf("%d connections, %d nodes, %d messages of %d bytes in %.3f s: %.0f msgs/s\n",
+		    nconns, nnodes, nconns * nmessages, size, elapsed, nconns * nmessages / elapsed);
+
+	/* Connections are still open and idle */
+	if (server > 0) {
+		rss = server_rss() - rss;
+		printf("server grew by %ld kB: %.0f bytes per connection\n",
+		    rss, rss * 1024.0 / nconns);
+	}
+
+	for (i = 0; i < nconns; i++)
+		redq_free(conns[i].redq);
+
+	event_base_free(base);
+	free(conns);
+	free(lengths);
+	free(bodies);
+	free(body);
+
+	return 0;
+}
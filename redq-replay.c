@@ -0,0 +1,685 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * redq-replay - sends traffic recorded with captureFile to redqd
+ *
+ * Every recorded connection is opened again and gets the same frames
+ * in the recorded order, at the recorded pace divided by -s (-s 0
+ * sends everything as fast as possible). The latency of CONNECT and
+ * of frames with a receipt header is measured per command. -o saves
+ * the results, -b compares them with the saved results of another
+ * run. The capture has no credentials, -u and -p give the login and
+ * passcode for CONNECT and STOMP frames.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "capture.h"
+
+/* Seconds to wait for outstanding answers after the last frame */
+#define DRAINTIME 5
+
+struct record {
+	u_int8_t type;
+	u_int32_t conn;
+	u_int64_t offset;
+	char *frame;
+	size_t len;
+};
+
+struct pending {
+	int command;
+	char *receipt;
+	double sent;
+
+	struct pending *next;
+};
+
+struct conn {
+	u_int32_t id;
+	struct bufferevent *bev;
+	struct pending *pending;
+	int closing;
+};
+
+static const char *commands[] = {
+	"CONNECT", "SEND", "SUBSCRIBE", "UNSUBSCRIBE", "ACK", "NACK",
+	"BEGIN", "COMMIT", "ABORT", "DISCONNECT", "other"
+};
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+#define CMD_CONNECT 0
+
+struct stats {
+	int frames;
+	int samples;
+	int size;
+	double *latency;
+};
+
+static struct event_base *base;
+static struct sockaddr_storage addr;
+static int addr_len;
+
+static struct record *records;
+static int nrecords;
+static int next;
+
+static struct conn **conns;
+static u_int32_t nconns;
+static int opened;
+
+static struct stats stats[NCOMMANDS];
+static int outstanding;
+static int messages;
+static int errors;
+
+static double speed = 1;
+static char *user;
+static char *pass;
+static double start;
+static double finished;
+static double last;
+static struct event *ev_next;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: redq-replay [-s speed] [-u user] [-p pass] [-o results] [-b baseline] file [host:port]\n");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static u_int32_t get32(const unsigned char *p)
+{
+	return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+}
+
+static void load(const char *file)
+{
+	FILE *fp;
+	unsigned char head[17];
+	char magic[sizeof(CAPTURE_MAGIC)-1];
+	struct record *record;
+	int size = 0;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)
+		errx(1, "%s is not a capture file", file);
+
+	while (fread(head, sizeof(head), 1, fp) == 1) {
+		if (nrecords == size) {
+			size = size ? size * 2 : 1024;
+			records = realloc(records, size * sizeof(*records));
+			if (records == NULL)
+				err(1, "malloc failed");
+		}
+
+		record = &records[nrecords++];
+		record->type = head[0];
+		record->conn = get32(head+1);
+		record->offset = ((u_int64_t)get32(head+5) << 32) | get32(head+9);
+		record->len = get32(head+13);
+		record->frame = NULL;
+
+		if (record->len > 0) {
+			if ((record->frame = malloc(record->len+1)) == NULL)
+				err(1, "malloc failed");
+			if (fread(record->frame, record->len, 1, fp) != 1)
+				errx(1, "%s is truncated", file);
+			record->frame[record->len] = '\0';
+		}
+
+		if (record->conn >= nconns)
+			nconns = record->conn + 1;
+	}
+
+	fclose(fp);
+
+	if ((conns = calloc(nconns, sizeof(*conns))) == NULL)
+		err(1, "malloc failed");
+}
+
+/*
+ * Returns the value of a header of frame in a malloc'ed string.
+ */
+static char *header(const char *frame, const char *name)
+{
+	const char *p, *end;
+	size_t len = strlen(name);
+
+	for (p = strchr(frame, '\n'); p != NULL && p[1] != '\n' && p[1] != '\r'; p = strchr(p+1, '\n')) {
+		if (strncmp(p+1, name, len) == 0 && p[len+1] == ':') {
+			p += len+2;
+			end = p + strcspn(p, "\r\n");
+			return strndup(p, end - p);
+		}
+	}
+
+	return NULL;
+}
+
+static int command(const char *frame)
+{
+	size_t len;
+	size_t i;
+
+	while (*frame == '\n' || *frame == '\r')
+		frame++;
+
+	len = strcspn(frame, "\r\n");
+	for (i = 0; i < NCOMMANDS-1; i++) {
+		if (strlen(commands[i]) == len && strncmp(frame, commands[i], len) == 0)
+			return i;
+	}
+
+	return NCOMMANDS-1;
+}
+
+/*
+ * Puts the login and passcode given with -u and -p into a CONNECT or
+ * STOMP frame instead of the redacted ones.
+ */
+static void credentials(struct record *record)
+{
+	char *frame, *out, *p, *line, *next, *end;
+	size_t len;
+
+	p = record->frame + strspn(record->frame, "\r\n");
+	len = strcspn(p, "\r\n");
+	if (command(p) != CMD_CONNECT && (len != 5 || strncmp(p, "STOMP", 5) != 0))
+		return;
+
+	len = record->len + 1;
+	if (user != NULL)
+		len += strlen(user) + 7;
+	if (pass != NULL)
+		len += strlen(pass) + 10;
+	if ((frame = malloc(len)) == NULL)
+		err(1, "malloc failed");
+
+	end = record->frame + record->len;
+	line = p + strcspn(p, "\n");
+	if (line < end)
+		line++;
+
+	memcpy(frame, record->frame, line - record->frame);
+	out = frame + (line - record->frame);
+	if (user != NULL)
+		out += sprintf(out, "login:%s\n", user);
+	if (pass != NULL)
+		out += sprintf(out, "passcode:%s\n", pass);
+
+	/* The other headers, the blank line and the body stay */
+	for (; line < end && *line != '\n' && *line != '\r'; line = next) {
+		next = memchr(line, '\n', end - line);
+		next = next != NULL ? next+1 : end;
+		if ((user != NULL && strncmp(line, "login:", 6) == 0) ||
+		    (pass != NULL && strncmp(line, "passcode:", 9) == 0))
+			continue;
+		memcpy(out, line, next - line);
+		out += next - line;
+	}
+	memcpy(out, line, end - line);
+	out += end - line;
+	*out = '\0';
+
+	free(record->frame);
+	record->frame = frame;
+	record->len = out - frame;
+}
+
+static void sample(int cmd, double latency)
+{
+	struct stats *s = &stats[cmd];
+
+	if (s->samples == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->latency = realloc(s->latency, s->size * sizeof(double));
+		if (s->latency == NULL)
+			err(1, "malloc failed");
+	}
+
+	s->latency[s->samples++] = latency;
+}
+
+/*
+ * Matches an answer with the request waiting for it.
+ */
+static void answered(struct conn *conn, const char *receipt)
+{
+	struct pending **pp, *p;
+
+	for (pp = &conn->pending; (p = *pp) != NULL; pp = &p->next) {
+		if (receipt == NULL ? p->receipt == NULL :
+		    p->receipt != NULL && strcmp(p->receipt, receipt) == 0)
+			break;
+	}
+
+	if (p == NULL)
+		return;
+
+	*pp = p->next;
+	last = now();
+	sample(p->command, last - p->sent);
+	outstanding--;
+	free(p->receipt);
+	free(p);
+}
+
+static void conn_free(struct conn *conn)
+{
+	struct pending *p;
+
+	while ((p = conn->pending) != NULL) {
+		conn->pending = p->next;
+		outstanding--;
+		free(p->receipt);
+		free(p);
+	}
+
+	bufferevent_free(conn->bev);
+	conns[conn->id] = NULL;
+	free(conn);
+}
+
+/*
+ * A recorded close waits for the frames to be sent and answered.
+ */
+static void conn_check_close(struct conn *conn)
+{
+	if (conn->closing && conn->pending == NULL &&
+	    evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0)
+		conn_free(conn);
+}
+
+static void replay_read(struct bufferevent *bev, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char *frame, *p, *receipt;
+	size_t len;
+
+	while ((frame = evbuffer_readln(input, &len, EVBUFFER_EOL_NUL)) != NULL) {
+		for (p = frame; *p == '\n' || *p == '\r'; p++)
+			;
+
+		if (strncmp(p, "CONNECTED", 9) == 0)
+			answered(conn, NULL);
+		else if (strncmp(p, "RECEIPT", 7) == 0) {
+			/* redqd answers with receipt, STOMP 1.1 with receipt-id */
+			if ((receipt = header(p, "receipt")) == NULL)
+				receipt = header(p, "receipt-id");
+			answered(conn, receipt);
+			free(receipt);
+		}
+		else if (strncmp(p, "MESSAGE", 7) == 0)
+			messages++;
+		else if (strncmp(p, "ERROR", 5) == 0)
+			errors++;
+
+		free(frame);
+	}
+
+	conn_check_close(conn);
+}
+
+static void replay_write(struct bufferevent *bev, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	conn_check_close(conn);
+}
+
+static void replay_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct conn *conn = (struct conn *)arg;
+
+	if (what & BEV_EVENT_CONNECTED)
+		return;
+
+	/* The server closes connections after ERROR and DISCONNECT */
+	conn_free(conn);
+}
+
+static void replay_open(struct record *record)
+{
+	struct conn *conn;
+
+	if ((conn = calloc(1, sizeof(*conn))) == NULL)
+		err(1, "malloc failed");
+
+	conn->id = record->conn;
+	conn->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(conn->bev, replay_read, replay_write, replay_event, conn);
+	bufferevent_enable(conn->bev, EV_READ|EV_WRITE);
+
+	if (bufferevent_socket_connect(conn->bev, (struct sockaddr *)&addr, addr_len) != 0)
+		err(1, "connect failed");
+
+	conns[conn->id] = conn;
+	opened++;
+}
+
+static void replay_frame(struct conn *conn, struct record *record)
+{
+	struct pending *p, **pp;
+	char *receipt;
+	int cmd;
+
+	cmd = command(record->frame);
+	stats[cmd].frames++;
+
+	receipt = header(record->frame, "receipt");
+	if (cmd == CMD_CONNECT || receipt != NULL) {
+		if ((p = calloc(1, sizeof(*p))) == NULL)
+			err(1, "malloc failed");
+
+		p->command = cmd;
+		p->receipt = cmd == CMD_CONNECT ? NULL : receipt;
+		p->sent = now();
+
+		/* Kept in the order they were sent */
+		for (pp = &conn->pending; *pp != NULL; pp = &(*pp)->next)
+			;
+		*pp = p;
+		outstanding++;
+	}
+	if (cmd == CMD_CONNECT)
+		free(receipt);
+
+	bufferevent_write(conn->bev, record->frame, record->len);
+	bufferevent_write(conn->bev, "\0", 1);
+}
+
+/*
+ * Sends all records which are due and schedules the next one.
+ */
+static void replay_next(evutil_socket_t fd, short what, void *arg)
+{
+	struct record *record;
+	struct conn *conn;
+	struct timeval tv;
+	double due;
+
+	for (; next < nrecords; next++) {
+		record = &records[next];
+
+		if (speed > 0) {
+			due = start + record->offset / 1e6 / speed - now();
+			if (due > 0) {
+				tv.tv_sec = (long)due;
+				tv.tv_usec = (long)((due - tv.tv_sec) * 1e6);
+				evtimer_add(ev_next, &tv);
+				return;
+			}
+		}
+
+		if (record->type == CAPTURE_OPEN) {
+			replay_open(record);
+			continue;
+		}
+
+		/* Connections closed by the server are gone */
+		if ((conn = conns[record->conn]) == NULL)
+			continue;
+
+		if (record->type == CAPTURE_FRAME)
+			replay_frame(conn, record);
+		else if (record->type == CAPTURE_CLOSE) {
+			conn->closing = 1;
+			conn_check_close(conn);
+		}
+	}
+
+	/* Everything sent, wait for the answers */
+	if (finished == 0)
+		finished = now();
+
+	if (outstanding > 0 && now() - finished < DRAINTIME) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		evtimer_add(ev_next, &tv);
+		return;
+	}
+
+	event_base_loopbreak(base);
+}
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(struct stats *s, double p)
+{
+	if (s->samples == 0)
+		return 0;
+
+	return s->latency[(int)(p * (s->samples - 1))] * 1000;
+}
+
+static double average(struct stats *s)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < s->samples; i++)
+		sum += s->latency[i];
+
+	return s->samples ? sum / s->samples * 1000 : 0;
+}
+
+/*
+ * Prints the change against the baseline in percent.
+ */
+static void delta(double value, double base_value)
+{
+	if (base_value > 0)
+		printf(" (%+.1f%%)", (value - base_value) * 100 / base_value);
+}
+
+static void report(double elapsed, const char *output, const char *baseline)
+{
+	double base_avg[NCOMMANDS], base_p50[NCOMMANDS], base_p99[NCOMMANDS];
+	double base_rate = 0, avg, p50, p99;
+	char name[32];
+	FILE *fp;
+	size_t i;
+	int frames = 0, count;
+
+	memset(base_avg, 0, sizeof(base_avg));
+	memset(base_p50, 0, sizeof(base_p50));
+	memset(base_p99, 0, sizeof(base_p99));
+
+	if (baseline != NULL) {
+		if ((fp = fopen(baseline, "r")) == NULL)
+			err(1, "%s", baseline);
+
+		while (fscanf(fp, "%31s %d %lf %lf %lf", name, &count, &avg, &p50, &p99) == 5) {
+			if (strcmp(name, "total") == 0) {
+				base_rate = avg;
+				continue;
+			}
+			for (i = 0; i < NCOMMANDS; i++) {
+				if (strcmp(name, commands[i]) == 0) {
+					base_avg[i] = avg;
+					base_p50[i] = p50;
+					base_p99[i] = p99;
+				}
+			}
+		}
+		fclose(fp);
+	}
+
+	fp = NULL;
+	if (output != NULL && (fp = fopen(output, "w")) == NULL)
+		err(1, "%s", output);
+
+	for (i = 0; i < NCOMMANDS; i++)
+		frames += stats[i].frames;
+
+	printf("%d frames on %d connections in %.3f s: %.0f frames/s", frames, opened, elapsed, frames / elapsed);
+	delta(frames / elapsed, base_rate);
+	printf(", %d messages, %d errors\n", messages, errors);
+
+	for (i = 0; i < NCOMMANDS; i++) {
+		if (stats[i].frames == 0)
+			continue;
+
+		qsort(stats[i].latency, stats[i].samples, sizeof(double), compare);
+		avg = average(&stats[i]);
+		p50 = percentile(&stats[i], 0.5);
+		p99 = percentile(&stats[i], 0.99);
+
+		printf("%-12s %8d frames", commands[i], stats[i].frames);
+		if (stats[i].samples > 0) {
+			printf(", latency ms avg %.3f", avg);
+			delta(avg, base_avg[i]);
+			printf(" p50 %.3f", p50);
+			delta(p50, base_p50[i]);
+			printf(" p99 %.3f", p99);
+			delta(p99, base_p99[i]);
+		}
+		printf("\n");
+
+		if (fp != NULL)
+			fprintf(fp, "%s %d %f %f %f\n", commands[i], stats[i].frames, avg, p50, p99);
+	}
+
+	if (fp != NULL) {
+		fprintf(fp, "total %d %f 0 0\n", frames, frames / elapsed);
+		fclose(fp);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	char *output = NULL, *baseline = NULL;
+	const char *node = "127.0.0.1:8080";
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "b:o:p:s:u:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			pass = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'u':
+			user = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2 || speed < 0)
+		usage();
+
+	if (argc == 2)
+		node = argv[1];
+
+	addr_len = sizeof(addr);
+	if (evutil_parse_sockaddr_port(node, (struct sockaddr *)&addr, &addr_len) != 0)
+		errx(1, "invalid address %s", node);
+
+	load(argv[0]);
+
+	if (user != NULL || pass != NULL) {
+		for (i = 0; i < nrecords; i++) {
+			if (records[i].type == CAPTURE_FRAME && records[i].frame != NULL)
+				credentials(&records[i]);
+		}
+	}
+
+	/* Every connection needs a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	base = event_base_new();
+	ev_next = evtimer_new(base, replay_next, NULL);
+
+	start = now();
+	replay_next(-1, 0, NULL);
+	event_base_dispatch(base);
+
+	/* Until everything was sent and answered */
+	report((last > finished ? last : finished) - start, output, baseline);
+
+	for (i = 0; i < (int)nconns; i++) {
+		if (conns[i] != NULL)
+			conn_free(conns[i]);
+	}
+
+	event_free(ev_next);
+	event_base_free(base);
+
+	for (i = 0; i < nrecords; i++)
+		free(records[i].frame);
+	free(records);
+	free(conns);
+
+	return 0;
+}
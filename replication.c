@@ -0,0 +1,792 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "stomp.h"
+#include "stomputil.h"
+#include "replication.h"
+#include "leveldb.h"
+
+/*
+ * Log shipping replication. The primary collects all modifications
+ * of its storage during one event loop iteration into a batch and
+ * sends it to every connected follower. Followers apply a batch with
+ * a single write and acknowledge it. With replicationAck quorum the
+ * RECEIPT of a request is held back until replicationQuorum
+ * followers acknowledged everything written so far.
+ *
+ * A follower has to come from one of the replicationFollowers hosts
+ * if that is set and to log in with authUser and authPass if those
+ * are set, nothing is sent before.
+ */
+struct follower {
+    int fd;
+    struct bufferevent *bev;
+
+    /* Set once the credentials were checked */
+    int authenticated;
+
+    /* Sequence of the last acknowledged batch */
+    u_int64_t acked;
+
+    /* Snapshot in progress and batches queued behind it */
+    void *cursor;
+    struct evbuffer *backlog;
+
+    TAILQ_ENTRY(follower) entries;
+};
+
+struct heldreceipt {
+    struct client *client;
+    char *receipt;
+    u_int64_t seq;
+
+    /* Time at which the request fails if the quorum is not reached */
+    u_int64_t deadline;
+
+    TAILQ_ENTRY(heldreceipt) entries;
+};
+
+static TAILQ_HEAD(, follower) followers = TAILQ_HEAD_INITIALIZER(followers);
+static TAILQ_HEAD(, heldreceipt) heldreceipts = TAILQ_HEAD_INITIALIZER(heldreceipts);
+
+static struct event_base *repl_base;
+
+/* Primary side */
+static int listen_fd = -1;
+static struct event *ev_listen;
+static struct event *ev_flush;
+static struct event *ev_timeout;
+static struct evbuffer *batch;
+static u_int32_t batch_count;
+static u_int64_t batch_seq;
+
+/* Follower side */
+static int follower_mode;
+static struct bufferevent *primary_bev;
+static struct event *ev_reconnect;
+
+
+static void repl_put32(struct evbuffer *evb, u_int32_t value)
+{
+    value = htonl(value);
+    evbuffer_add(evb, &value, sizeof(value));
+}
+
+static void repl_put64(struct evbuffer *evb, u_int64_t value)
+{
+    repl_put32(evb, (u_int32_t)(value >> 32));
+    repl_put32(evb, (u_int32_t)value);
+}
+
+static u_int32_t repl_get32(const unsigned char *p)
+{
+    return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+}
+
+static u_int64_t repl_get64(const unsigned char *p)
+{
+    return ((u_int64_t)repl_get32(p) << 32) | repl_get32(p+4);
+}
+
+static void repl_send_seq(struct bufferevent *bev, enum repl_frame type, u_int64_t seq)
+{
+    struct evbuffer *output = bufferevent_get_output(bev);
+    u_int8_t t = type;
+
+    repl_put32(output, 1+8);
+    evbuffer_add(output, &t, 1);
+    repl_put64(output, seq);
+}
+
+int replication_active(void)
+{
+    return !TAILQ_EMPTY(&followers);
+}
+
+int replication_follower(void)
+{
+    return follower_mode;
+}
+
+void replication_log_put(void *arg, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    evbuffer_add(batch, "P", 1);
+    repl_put32(batch, key_len);
+    evbuffer_add(batch, key, key_len);
+    repl_put32(batch, value_len);
+    evbuffer_add(batch, value, value_len);
+
+    if(batch_count++ == 0)
+        event_active(ev_flush, EV_TIMEOUT, 0);
+}
+
+void replication_log_delete(void *arg, const char *key, size_t key_len)
+{
+    evbuffer_add(batch, "D", 1);
+    repl_put32(batch, key_len);
+    evbuffer_add(batch, key, key_len);
+
+    if(batch_count++ == 0)
+        event_active(ev_flush, EV_TIMEOUT, 0);
+}
+
+/*
+ * Returns true if the batch with the given sequence number has been
+ * acknowledged by enough followers.
+ */
+static int repl_acked(u_int64_t seq)
+{
+    struct follower *follower;
+    int count = 0;
+
+    TAILQ_FOREACH(follower, &followers, entries) {
+        if(follower->acked >= seq)
+            count++;
+    }
+
+    return count >= atoi(configget("replicationQuorum"));
+}
+
+/*
+ * Fails held receipts which waited replicationTimeout ms for the
+ * quorum, with an ERROR carrying the receipt-id.
+ */
+static void repl_expire_receipts(evutil_socket_t fd, short what, void *arg)
+{
+    struct heldreceipt *held;
+    struct timeval tv;
+    char frame[MAXHEADERLEN+64];
+    u_int64_t now, wait;
+    int len;
+
+    now = mstime();
+
+    while((held = TAILQ_FIRST(&heldreceipts)) != NULL && held->deadline <= now){
+        TAILQ_REMOVE(&heldreceipts, held, entries);
+
+        logwarn("Replication quorum not reached for receipt %s", held->receipt);
+
+        len = snprintf(frame, sizeof(frame), "ERROR\nmessage:Replication quorum not reached\nreceipt-id:%s\n\n", held->receipt);
+        if(len >= sizeof(frame))
+            len = sizeof(frame)-1;
+        stomp_write(held->client, frame, len+1);
+
+        free(held->receipt);
+        free(held);
+    }
+
+    if(held != NULL){
+        wait = held->deadline - now;
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        evtimer_add(ev_timeout, &tv);
+    }
+}
+
+static void repl_release_receipts(void)
+{
+    struct heldreceipt *held;
+    char frame[MAXHEADERLEN+32];
+    int len;
+
+    while((held = TAILQ_FIRST(&heldreceipts)) != NULL && repl_acked(held->seq)){
+        TAILQ_REMOVE(&heldreceipts, held, entries);
+
+        len = snprintf(frame, sizeof(frame), "RECEIPT\nreceipt:%s\n\n", held->receipt);
+        if(len >= sizeof(frame))
+            len = sizeof(frame)-1;
+        stomp_write(held->client, frame, len+1);
+
+        free(held->receipt);
+        free(held);
+    }
+}
+
+int replication_hold_receipt(struct client *client, const char *receipt)
+{
+    struct heldreceipt *held;
+    u_int64_t seq;
+
+    if(strcmp(configget("replicationAck"), "quorum") != 0)
+        return 0;
+
+    /* Everything written so far has to reach the followers */
+    leveldb_flush();
+    seq = batch_count > 0 ? batch_seq+1 : batch_seq;
+    if(repl_acked(seq))
+        return 0;
+
+    held = calloc(1, sizeof(*held));
+    if(held == NULL)
+        return 0;
+
+    held->client = client;
+    held->receipt = strdup(receipt);
+    held->seq = seq;
+    held->deadline = mstime() + strtoull(configget("replicationTimeout"), NULL, 10);
+    TAILQ_INSERT_TAIL(&heldreceipts, held, entries);
+
+    if(!evtimer_pending(ev_timeout, NULL))
+        repl_expire_receipts(-1, 0, NULL);
+
+    return 1;
+}
+
+void replication_free_client(struct client *client)
+{
+    struct heldreceipt *held, *tmp_held;
+
+    for(held = TAILQ_FIRST(&heldreceipts); held != NULL; held = tmp_held){
+        tmp_held = TAILQ_NEXT(held, entries);
+        if(held->client == client){
+            TAILQ_REMOVE(&heldreceipts, held, entries);
+            free(held->receipt);
+            free(held);
+        }
+    }
+}
+
+static void repl_free_follower(struct follower *follower)
+{
+    TAILQ_REMOVE(&followers, follower, entries);
+
+    if(follower->cursor != NULL)
+        leveldb_cursor_close(follower->cursor);
+
+    evbuffer_free(follower->backlog);
+    bufferevent_free(follower->bev);
+    free(follower);
+
+    /* A follower less might still satisfy the quorum */
+    repl_release_receipts();
+}
+
+/*
+ * Sends the batch collected during this event loop iteration.
+ */
+static void repl_flush(evutil_socket_t fd, short what, void *arg)
+{
+    struct follower *follower, *tmp_follower;
+    struct evbuffer *frame, *output;
+    unsigned char *data;
+    size_t len, limit;
+    u_int8_t t = REPL_BATCH;
+
+    if(batch_count == 0)
+        return;
+
+    batch_seq++;
+
+    frame = evbuffer_new();
+    repl_put32(frame, 1+8+4+evbuffer_get_length(batch));
+    evbuffer_add(frame, &t, 1);
+    repl_put64(frame, batch_seq);
+    repl_put32(frame, batch_count);
+    evbuffer_add_buffer(frame, batch);
+
+    len = evbuffer_get_length(frame);
+    data = evbuffer_pullup(frame, -1);
+
+    limit = strtoull(configget("replicationBuffer"), NULL, 10);
+
+    for(follower = TAILQ_FIRST(&followers); follower != NULL; follower = tmp_follower){
+        tmp_follower = TAILQ_NEXT(follower, entries);
+
+        if(!follower->authenticated)
+            continue;
+
+        output = (follower->cursor != NULL) ? follower->backlog : bufferevent_get_output(follower->bev);
+        evbuffer_add(output, data, len);
+
+        /* A follower which cannot keep up starts over with a snapshot */
+        if(limit != 0 && evbuffer_get_length(output) > limit){
+            logwarn("Replication follower %d is %zu bytes behind, disconnecting", follower->fd, evbuffer_get_length(output));
+            repl_free_follower(follower);
+        }
+    }
+
+    evbuffer_free(frame);
+    batch_count = 0;
+}
+
+static void repl_snapshot_entry(void *arg, const char *key, size_t key_len, const char *value, size_t value_len)
+{
+    struct evbuffer *evb = (struct evbuffer *)arg;
+
+    evbuffer_add(evb, "P", 1);
+    repl_put32(evb, key_len);
+    evbuffer_add(evb, key, key_len);
+    repl_put32(evb, value_len);
+    evbuffer_add(evb, value, value_len);
+}
+
+/*
+ * Called when the output to a follower drained, continues sending
+ * the snapshot.
+ */
+static void repl_follower_write(struct bufferevent *bev, void *arg)
+{
+    struct follower *follower = (struct follower *)arg;
+    struct evbuffer *output = bufferevent_get_output(bev);
+    struct evbuffer *records;
+    u_int8_t t = REPL_SNAPSHOT;
+    int count;
+
+    if(follower->cursor == NULL)
+        return;
+
+    records = evbuffer_new();
+    count = leveldb_cursor_read(follower->cursor, REPLCHUNK, repl_snapshot_entry, records);
+
+    if(count > 0){
+        repl_put32(output, 1+4+evbuffer_get_length(records));
+        evbuffer_add(output, &t, 1);
+        repl_put32(output, count);
+        evbuffer_add_buffer(output, records);
+    }
+    else {
+        leveldb_cursor_close(follower->cursor);
+        follower->cursor = NULL;
+
+        repl_send_seq(bev, REPL_SYNCED, batch_seq);
+        evbuffer_add_buffer(output, follower->backlog);
+
+        loginfo("Replication follower %d received snapshot up to batch %llu", follower->fd, (unsigned long long)batch_seq);
+    }
+
+    evbuffer_free(records);
+}
+
+/*
+ * Starts sending the snapshot to a follower which logged in.
+ */
+static void repl_start_follower(struct follower *follower)
+{
+    u_int8_t t = REPL_RESET;
+
+    bufferevent_set_timeouts(follower->bev, NULL, NULL);
+
+    /* Pending changes are part of the snapshot, ship them first */
+    repl_flush(-1, 0, NULL);
+
+    follower->authenticated = 1;
+    follower->cursor = leveldb_cursor_open();
+
+    repl_put32(bufferevent_get_output(follower->bev), 1);
+    evbuffer_add(bufferevent_get_output(follower->bev), &t, 1);
+    repl_follower_write(follower->bev, follower);
+}
+
+/*
+ * Checks the REPL_AUTH frame a follower sends first. Returns 1 if the
+ * frame is incomplete, -1 if the follower has to be dropped.
+ */
+static int repl_follower_auth(struct evbuffer *input)
+{
+    unsigned char header[4];
+    char *frame, *passcode;
+    u_int32_t len;
+    int ret;
+
+    if(evbuffer_copyout(input, header, sizeof(header)) < (ssize_t)sizeof(header))
+        return 1;
+
+    len = repl_get32(header);
+    if(len < 2 || len > REPLAUTHLEN)
+        return -1;
+
+    if(evbuffer_get_length(input) < sizeof(header)+len)
+        return 1;
+
+    frame = (char *)evbuffer_pullup(input, sizeof(header)+len) + sizeof(header);
+    passcode = memchr(frame+1, '\n', len-1);
+    if(frame[0] != REPL_AUTH || passcode == NULL)
+        return -1;
+
+    ret = 0;
+    if(strlen(configget("authUser")) > 0 && strlen(configget("authPass")) > 0){
+        ret = (size_t)(passcode-(frame+1)) != strlen(configget("authUser"))
+            || memcmp(frame+1, configget("authUser"), passcode-(frame+1)) != 0
+            || (size_t)(frame+len-(passcode+1)) != strlen(configget("authPass"))
+            || memcmp(passcode+1, configget("authPass"), frame+len-(passcode+1)) != 0;
+    }
+
+    evbuffer_drain(input, sizeof(header)+len);
+
+    return ret ? -1 : 0;
+}
+
+static void repl_follower_read(struct bufferevent *bev, void *arg)
+{
+    struct follower *follower = (struct follower *)arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    unsigned char frame[4+1+8];
+
+    if(!follower->authenticated){
+        switch(repl_follower_auth(input)){
+        case 1:
+            return;
+        case 0:
+            loginfo("Replication follower %d logged in", follower->fd);
+            repl_start_follower(follower);
+            break;
+        default:
+            logwarn("Replication follower %d refused: Wrong credentials", follower->fd);
+            repl_free_follower(follower);
+            return;
+        }
+    }
+
+    while(evbuffer_get_length(input) >= sizeof(frame)){
+        evbuffer_remove(input, frame, sizeof(frame));
+
+        if(repl_get32(frame) != 1+8 || frame[4] != REPL_ACK){
+            logwarn("Replication follower %d sent garbage, disconnecting", follower->fd);
+            repl_free_follower(follower);
+            return;
+        }
+
+        follower->acked = repl_get64(frame+5);
+    }
+
+    repl_release_receipts();
+}
+
+static void repl_follower_error(struct bufferevent *bev, short what, void *arg)
+{
+    struct follower *follower = (struct follower *)arg;
+
+    loginfo("Replication follower %d disconnected", follower->fd);
+    repl_free_follower(follower);
+}
+
+/*
+ * Returns 1 if replicationFollowers is set and does not list the
+ * host, a comma separated list of IPv4 addresses.
+ */
+static int repl_refused(struct in_addr host)
+{
+    char *list, *next, *name;
+    int ret = 1;
+
+    if(strlen(configget("replicationFollowers")) == 0)
+        return 0;
+
+    next = list = strdup(configget("replicationFollowers"));
+    if(list == NULL)
+        return 1;
+
+    while(ret && (name = strsep(&next, ", ")) != NULL){
+        if(*name != '\0' && inet_addr(name) == host.s_addr)
+            ret = 0;
+    }
+
+    free(list);
+
+    return ret;
+}
+
+static void repl_on_accept(evutil_socket_t fd, short ev, void *arg)
+{
+    struct follower *follower;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct timeval timeout = { REPLAUTHTIMEOUT, 0 };
+    int client_fd;
+
+    client_fd = accept(fd, (struct sockaddr *)&addr, &addr_len);
+    if(client_fd < 0)
+        return;
+
+    if(repl_refused(addr.sin_addr)){
+        logwarn("Replication follower from %s refused: Not in replicationFollowers", inet_ntoa(addr.sin_addr));
+        close(client_fd);
+        return;
+    }
+
+    evutil_make_socket_nonblocking(client_fd);
+
+    follower = calloc(1, sizeof(*follower));
+    if(follower == NULL){
+        close(client_fd);
+        return;
+    }
+
+    follower->fd = client_fd;
+    follower->backlog = evbuffer_new();
+    follower->bev = bufferevent_socket_new(repl_base, client_fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(follower->bev, repl_follower_read, repl_follower_write, repl_follower_error, follower);
+    bufferevent_set_timeouts(follower->bev, &timeout, NULL);
+    bufferevent_enable(follower->bev, EV_READ|EV_WRITE);
+
+    /* Nothing is sent before the follower logged in */
+    TAILQ_INSERT_TAIL(&followers, follower, entries);
+
+    loginfo("Replication follower %d connected from %s", client_fd, inet_ntoa(addr.sin_addr));
+}
+
+/*
+ * Applies the records of a snapshot or batch frame.
+ */
+static int repl_apply(const unsigned char *p, size_t len, u_int32_t count)
+{
+    u_int32_t key_len, value_len;
+
+    while(count-- > 0){
+        if(len < 5)
+            return 1;
+
+        key_len = repl_get32(p+1);
+        if(len < 5+key_len)
+            return 1;
+
+        if(*p == 'P'){
+            if(len < 9+key_len)
+                return 1;
+
+            value_len = repl_get32(p+5+key_len);
+            if(len < 9+key_len+value_len)
+                return 1;
+
+            leveldb_apply_put((const char *)p+5, key_len, (const char *)p+9+key_len, value_len);
+            p += 9+key_len+value_len;
+            len -= 9+key_len+value_len;
+        }
+        else if(*p == 'D'){
+            leveldb_apply_delete((const char *)p+5, key_len);
+            p += 5+key_len;
+            len -= 5+key_len;
+        }
+        else
+            return 1;
+    }
+
+    return leveldb_apply();
+}
+
+static void repl_schedule_reconnect(void)
+{
+    struct timeval tv = { 1, 0 };
+
+    evtimer_add(ev_reconnect, &tv);
+}
+
+static void repl_primary_read(struct bufferevent *bev, void *arg)
+{
+    struct evbuffer *input = bufferevent_get_input(bev);
+    unsigned char header[4];
+    unsigned char *frame;
+    u_int32_t len;
+    int ret = 0;
+
+    while(evbuffer_get_length(input) >= sizeof(header)){
+        evbuffer_copyout(input, header, sizeof(header));
+        len = repl_get32(header);
+
+        if(evbuffer_get_length(input) < sizeof(header)+len)
+            break;
+
+        frame = evbuffer_pullup(input, sizeof(header)+len) + sizeof(header);
+
+        switch(frame[0]){
+        case REPL_RESET:
+            loginfo("Replication primary sends snapshot");
+            ret = leveldb_clear();
+            break;
+        case REPL_SNAPSHOT:
+            ret = (len < 5) || repl_apply(frame+5, len-5, repl_get32(frame+1));
+            break;
+        case REPL_SYNCED:
+            ret = (len < 9);
+            if(ret == 0){
+                loginfo("Replication in sync at batch %llu", (unsigned long long)repl_get64(frame+1));
+                repl_send_seq(bev, REPL_ACK, repl_get64(frame+1));
+            }
+            break;
+        case REPL_BATCH:
+            ret = (len < 13) || repl_apply(frame+13, len-13, repl_get32(frame+9));
+            if(ret == 0)
+                repl_send_seq(bev, REPL_ACK, repl_get64(frame+1));
+            break;
+        default:
+            ret = 1;
+            break;
+        }
+
+        evbuffer_drain(input, sizeof(header)+len);
+
+        if(ret != 0){
+            logerror("Replication stream broken, reconnecting");
+            bufferevent_free(primary_bev);
+            primary_bev = NULL;
+            repl_schedule_reconnect();
+            return;
+        }
+    }
+}
+
+static void repl_primary_event(struct bufferevent *bev, short what, void *arg)
+{
+    struct evbuffer *output = bufferevent_get_output(bev);
+    u_int8_t t = REPL_AUTH;
+
+    if(what & BEV_EVENT_CONNECTED){
+        repl_put32(output, 1+strlen(configget("authUser"))+1+strlen(configget("authPass")));
+        evbuffer_add(output, &t, 1);
+        evbuffer_add_printf(output, "%s\n%s", configget("authUser"), configget("authPass"));
+
+        loginfo("Replication connected to %s", configget("replicateFrom"));
+        return;
+    }
+
+    logwarn("Replication connection to %s lost", configget("replicateFrom"));
+
+    bufferevent_free(primary_bev);
+    primary_bev = NULL;
+    repl_schedule_reconnect();
+}
+
+static void repl_connect(evutil_socket_t fd, short what, void *arg)
+{
+    struct sockaddr_storage addr;
+    int addr_len = sizeof(addr);
+
+    if(evutil_parse_sockaddr_port(configget("replicateFrom"), (struct sockaddr *)&addr, &addr_len) != 0){
+        logerror("Invalid replicateFrom address %s", configget("replicateFrom"));
+        return;
+    }
+
+    primary_bev = bufferevent_socket_new(repl_base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(primary_bev, repl_primary_read, NULL, repl_primary_event, NULL);
+    bufferevent_enable(primary_bev, EV_READ|EV_WRITE);
+
+    if(bufferevent_socket_connect(primary_bev, (struct sockaddr *)&addr, addr_len) != 0){
+        bufferevent_free(primary_bev);
+        primary_bev = NULL;
+        repl_schedule_reconnect();
+    }
+}
+
+int replication_init(struct event_base *base)
+{
+    struct sockaddr_in listen_addr;
+    int reuseaddr_on = 1;
+
+    repl_base = base;
+
+    if(strlen(configget("replicateFrom")) > 0){
+        follower_mode = 1;
+
+        ev_reconnect = evtimer_new(base, repl_connect, NULL);
+        repl_connect(-1, 0, NULL);
+
+        loginfo("Replicating from %s", configget("replicateFrom"));
+        return 0;
+    }
+
+    batch = evbuffer_new();
+    ev_flush = event_new(base, -1, 0, repl_flush, NULL);
+    ev_timeout = evtimer_new(base, repl_expire_receipts, NULL);
+
+    if(strlen(configget("replicationPort")) == 0)
+        return 0;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+        return 1;
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on));
+
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = inet_addr(configget("listenIP"));
+    listen_addr.sin_port = htons(atoi(configget("replicationPort")));
+
+    if(bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0 || listen(listen_fd, 16) < 0){
+        logerror("Replication listener on port %s failed", configget("replicationPort"));
+        close(listen_fd);
+        return 1;
+    }
+
+    evutil_make_socket_nonblocking(listen_fd);
+
+    ev_listen = event_new(base, listen_fd, EV_READ|EV_PERSIST, repl_on_accept, NULL);
+    event_add(ev_listen, NULL);
+
+    loginfo("Replication primary listening on port %s (%s receipts)", configget("replicationPort"), configget("replicationAck"));
+
+    return 0;
+}
+
+int replication_free(void)
+{
+    struct follower *follower;
+
+    while((follower = TAILQ_FIRST(&followers)) != NULL)
+        repl_free_follower(follower);
+
+    if(ev_listen != NULL){
+        event_free(ev_listen);
+        close(listen_fd);
+    }
+
+    if(ev_flush != NULL)
+        event_free(ev_flush);
+
+    if(ev_timeout != NULL)
+        event_free(ev_timeout);
+
+    if(batch != NULL)
+        evbuffer_free(batch);
+
+    if(primary_bev != NULL)
+        bufferevent_free(primary_bev);
+
+    if(ev_reconnect != NULL)
+        event_free(ev_reconnect);
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _REPLICATION_H_
+#define _REPLICATION_H_
+
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+/* Snapshot entries sent to a new follower per chunk */
+#define REPLCHUNK 1000
+
+/* Seconds a new follower has to send its credentials and their
+ * longest frame */
+#define REPLAUTHTIMEOUT 10
+#define REPLAUTHLEN 1024
+
+/*
+ * Replication stream frames, all integers in network byte order:
+ *
+ *   u32 length, u8 type, payload
+ *
+ * REPL_RESET     follower drops its database
+ * REPL_SNAPSHOT  u32 count, records
+ * REPL_SYNCED    u64 sequence of the last batch in the snapshot
+ * REPL_BATCH     u64 sequence, u32 count, records
+ * REPL_ACK       u64 sequence (follower to primary)
+ * REPL_AUTH      login, '\n', passcode (follower to primary, first)
+ *
+ * Records are 'P', u32 keylen, key, u32 valuelen, value for a put
+ * and 'D', u32 keylen, key for a delete.
+ */
+enum repl_frame {
+   REPL_RESET = 'R',
+   REPL_SNAPSHOT = 'S',
+   REPL_SYNCED = 'E',
+   REPL_BATCH = 'B',
+   REPL_ACK = 'A',
+   REPL_AUTH = 'L'
+};
+
+struct client;
+
+extern int replication_init(struct event_base *base);
+extern int replication_free(void);
+
+extern int replication_active(void);
+extern int replication_follower(void);
+
+extern void replication_log_put(void *arg, const char *key, size_t key_len, const char *value, size_t value_len);
+extern void replication_log_delete(void *arg, const char *key, size_t key_len);
+
+extern int replication_hold_receipt(struct client *client, const char *receipt);
+extern void replication_free_client(struct client *client);
+
+#endif /* _REPLICATION_H_ */
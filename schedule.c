@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "stomp.h"
+#include "schedule.h"
+#include "leveldb.h"
+
+/*
+ * Delayed messages live in a time ordered index in the storage
+ * backend. Only index keys which become due within the next
+ * SCHEDWHEELSIZE milliseconds are loaded into an in-memory timer
+ * wheel, so the number of scheduled messages is bound by disk
+ * and not by memory.
+ */
+struct schedentry {
+    char key[SCHEDKEYLEN];
+    u_int64_t deliver_at;
+
+    TAILQ_ENTRY(schedentry) entries;
+};
+
+TAILQ_HEAD(schedslot, schedentry);
+
+static struct schedslot wheel[SCHEDWHEELSIZE];
+static int wheel_count;
+
+/* Last tick which has been processed */
+static u_int64_t wheel_time;
+
+/* All index keys sorting before loaded_key are in the wheel */
+static char loaded_key[SCHEDKEYLEN];
+static u_int64_t loaded_until;
+static int loaded_partial;
+
+static u_int64_t sched_seq;
+static struct event *ev_schedule;
+
+
+/*
+ * Returns the absolute delivery time in milliseconds from either
+ * the deliver-at or the delay header or 0 if neither is set.
+ */
+u_int64_t schedule_deliver_at(struct evkeyvalq *headers)
+{
+    const char *value;
+
+    value = evhttp_find_header(headers, "deliver-at");
+    if(value != NULL)
+       return strtoull(value, NULL, 10);
+
+    value = evhttp_find_header(headers, "delay");
+    if(value != NULL)
+       return mstime() + strtoull(value, NULL, 10);
+
+    return 0;
+}
+
+static void schedule_insert(const char *key, size_t key_len)
+{
+    struct schedentry *entry;
+    u_int64_t slot;
+
+    if(key_len >= SCHEDKEYLEN)
+       return;
+
+    entry = malloc(sizeof(*entry));
+    if(entry == NULL){
+       logerror("Scheduling %.*s failed: out of memory", (int)key_len, key);
+       return;
+    }
+
+    memcpy(entry->key, key, key_len);
+    entry->key[key_len] = '\0';
+    entry->deliver_at = strtoull(entry->key+strlen(SCHEDPREFIX), NULL, 10);
+
+    /* Overdue entries fire with the next tick */
+    slot = entry->deliver_at;
+    if(slot <= wheel_time)
+       slot = wheel_time+1;
+
+    TAILQ_INSERT_TAIL(&wheel[slot % SCHEDWHEELSIZE], entry, entries);
+    wheel_count++;
+}
+
+static void schedule_loaded(const char *key, size_t key_len)
+{
+    schedule_insert(key, key_len);
+
+    memcpy(loaded_key, key, key_len);
+    loaded_key[key_len] = '\0';
+}
+
+/*
+ * Moves index entries which become due before the end of the
+ * wheel horizon into the wheel.
+ */
+static void schedule_load(u_int64_t now)
+{
+    char until[SCHEDKEYLEN];
+    int count;
+
+    if(loaded_partial == 0 && now + SCHEDWHEELSIZE/2 < loaded_until)
+       return;
+
+    snprintf(until, sizeof(until), "%s%013llu", SCHEDPREFIX, (unsigned long long)(now + SCHEDWHEELSIZE));
+
+    count = leveldb_load_schedule(loaded_key[0] != '\0' ? loaded_key : NULL, until, SCHEDLOADMAX, schedule_loaded);
+    if(count == SCHEDLOADMAX){
+       loaded_partial = 1;
+       return;
+    }
+
+    loaded_partial = 0;
+    loaded_until = now + SCHEDWHEELSIZE;
+    strcpy(loaded_key, until);
+}
+
+/*
+ * Publishes a due message and removes it from the index. Returns 1
+ * if it has to be tried again.
+ */
+static int schedule_fire(struct schedentry *entry)
+{
+    char *value;
+    char *queuename;
+    char *message;
+    int priority;
+
+    value = leveldb_get_scheduled(entry->key);
+    if(value == NULL){
+       logwarn("Scheduled message %s vanished", entry->key);
+       return 0;
+    }
+
+    priority = atoi(value);
+    queuename = strchr(value, ' ');
+    message = strchr(value, '\n');
+
+    if(queuename == NULL || message == NULL || message < queuename){
+       logerror("Scheduled message %s corrupt", entry->key);
+    }
+    else {
+       *message++ = '\0';
+       queuename++;
+
+       if(stomp_publish(queuename, priority, message) != 0){
+          free(value);
+          return 1;
+       }
+    }
+
+    free(value);
+    leveldb_unschedule_message(entry->key);
+
+    return 0;
+}
+
+/*
+ * Returns the time of the earliest entry in the wheel, looking at
+ * the slots in the order they come due.
+ */
+static u_int64_t schedule_next(void)
+{
+    struct schedentry *entry;
+    struct schedslot *slot;
+    u_int64_t t, next = 0;
+
+    for(t = wheel_time+1; t <= wheel_time+SCHEDWHEELSIZE; t++){
+       slot = &wheel[t % SCHEDWHEELSIZE];
+
+       TAILQ_FOREACH(entry, slot, entries) {
+          if(next == 0 || entry->deliver_at < next)
+             next = entry->deliver_at;
+       }
+
+       if(next != 0)
+          break;
+    }
+
+    return next;
+}
+
+static void schedule_arm(void)
+{
+    struct timeval tv;
+    u_int64_t now, next;
+    u_int64_t wait;
+
+    now = mstime();
+
+    /* The loader runs again when half of the horizon has passed */
+    wait = (loaded_until > now + SCHEDWHEELSIZE/2) ? loaded_until - now - SCHEDWHEELSIZE/2 : 1;
+
+    if(loaded_partial)
+       wait = 1;
+
+    if(wheel_count > 0){
+       next = schedule_next();
+       if(next != 0)
+          next = (next > now) ? next - now : 1;
+       if(next != 0 && next < wait)
+          wait = next;
+    }
+
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+
+    evtimer_add(ev_schedule, &tv);
+}
+
+static void schedule_tick(evutil_socket_t fd, short what, void *arg)
+{
+    struct schedentry *entry, *tmp_entry;
+    struct schedslot *slot;
+    u_int64_t now, t, steps;
+
+    now = mstime();
+
+    schedule_load(now);
+
+    steps = now - wheel_time;
+    if(steps > SCHEDWHEELSIZE)
+       steps = SCHEDWHEELSIZE;
+
+    for(t = wheel_time+1; steps > 0; t++, steps--){
+       slot = &wheel[t % SCHEDWHEELSIZE];
+
+       for(entry = TAILQ_FIRST(slot); entry != NULL; entry = tmp_entry){
+          tmp_entry = TAILQ_NEXT(entry, entries);
+          if(entry->deliver_at > now)
+             continue;
+
+          TAILQ_REMOVE(slot, entry, entries);
+          wheel_count--;
+
+          /* The index keeps it, the wheel brings it up again */
+          if(schedule_fire(entry) != 0){
+             entry->deliver_at = now + SCHEDRETRYDELAY;
+             TAILQ_INSERT_TAIL(&wheel[entry->deliver_at % SCHEDWHEELSIZE], entry, entries);
+             wheel_count++;
+             continue;
+          }
+
+          free(entry);
+       }
+    }
+
+    if(now > wheel_time)
+       wheel_time = now;
+
+    schedule_arm();
+}
+
+int schedule_init(struct event_base *base)
+{
+    int i;
+
+    for(i=0; i < SCHEDWHEELSIZE; i++)
+       TAILQ_INIT(&wheel[i]);
+
+    wheel_count = 0;
+    wheel_time = mstime();
+    loaded_key[0] = '\0';
+    loaded_until = 0;
+    loaded_partial = 0;
+
+    /* Sequence numbers only have to be unique per delivery time */
+    sched_seq = wheel_time * 1000;
+
+    ev_schedule = evtimer_new(base, schedule_tick, NULL);
+    if(ev_schedule == NULL)
+       return 1;
+
+    schedule_tick(-1, 0, NULL);
+
+    return 0;
+}
+
+int schedule_free(void)
+{
+    struct schedentry *entry;
+    int i;
+
+    if(ev_schedule != NULL){
+       event_free(ev_schedule);
+       ev_schedule = NULL;
+    }
+
+    for(i=0; i < SCHEDWHEELSIZE; i++){
+       while((entry = TAILQ_FIRST(&wheel[i])) != NULL){
+          TAILQ_REMOVE(&wheel[i], entry, entries);
+          free(entry);
+       }
+    }
+
+    wheel_count = 0;
+
+    return 0;
+}
+
+int schedule_message(const char *queuename, int priority, u_int64_t deliver_at, char *message)
+{
+    char key[SCHEDKEYLEN];
+
+    snprintf(key, sizeof(key), "%s%013llu.%020llu", SCHEDPREFIX,
+        (unsigned long long)deliver_at, (unsigned long long)sched_seq++);
+
+    if(leveldb_schedule_message(key, queuename, priority, message) != 0)
+       return 1;
+
+    /* Already behind the loader, so it has to go into the wheel now */
+    if(strcmp(key, loaded_key) < 0){
+       schedule_insert(key, strlen(key));
+
+       if(evtimer_pending(ev_schedule, NULL))
+          evtimer_del(ev_schedule);
+       schedule_arm();
+    }
+
+    logdebug("Scheduled message for %s at %llu", queuename, (unsigned long long)deliver_at);
+
+    return 0;
+}
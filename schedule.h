@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <sys/types.h>
+
+#include <event2/event.h>
+#include <event2/keyvalq_struct.h>
+
+/* Key prefix of the schedule index in the storage backend */
+#define SCHEDPREFIX "!sched."
+#define SCHEDKEYLEN 48
+
+/* Timer wheel with one slot per millisecond covering the near horizon */
+#define SCHEDWHEELSIZE 1024
+
+/* Maximum number of index entries loaded into the wheel per tick */
+#define SCHEDLOADMAX 4096
+
+/* Milliseconds until a message which could not be published is tried again */
+#define SCHEDRETRYDELAY 1000
+
+extern int schedule_init(struct event_base *base);
+extern int schedule_free(void);
+
+extern u_int64_t schedule_deliver_at(struct evkeyvalq *headers);
+extern int schedule_message(const char *queuename, int priority, u_int64_t deliver_at, char *message);
+
+#endif /* _SCHEDULE_H_ */
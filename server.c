@@ -24,9 +24,15 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* accept4() */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <limits.h>
@@ -58,9 +64,28 @@
 #include "stomp.h"
 #include "stomputil.h"
 #include "leveldb.h"
+#include "schedule.h"
+#include "capture.h"
+#include "handoff.h"
+#include "replication.h"
+#include "cluster.h"
+#include "memory.h"
+#include "fanout.h"
+#include "ratelimit.h"
+#include "durable.h"
+#include "probes.h"
+#ifdef WITH_URING
+#include "uring.h"
+#endif
 
 struct event_base *base;
 
+/* Listening sockets and their accept events */
+static int listen_fds[MAXLISTENERS];
+static struct event *ev_accept[MAXLISTENERS];
+static struct event *ev_accept_resume;
+static int listen_count;
+
 
 void signal_handler(int sig) {
 	switch(sig) {
@@ -77,6 +102,30 @@ void signal_handler(int sig) {
     }
 }
 
+/**
+ * Called periodically to reclaim expired messages.
+ */
+void on_expire(int fd, short ev, void *arg)
+{
+	stomp_expire();
+}
+
+/**
+ * Called every compactInterval to compact consumed messages.
+ */
+void on_compact(int fd, short ev, void *arg)
+{
+	stomp_compact();
+}
+
+/**
+ * Called every second to free idle destinations.
+ */
+void on_evict(int fd, short ev, void *arg)
+{
+	stomp_evict_queues();
+}
+
 /**
  * Set a socket to non-blocking mode.
  */
@@ -95,58 +144,60 @@ int setnonblock(int fd)
 }
 
 /**
- * Called by libevent when there is data to read.
+ * Handles a single frame from the input buffer. Returns 1 if the
+ * client has been disconnected and must not be used anymore. The
+ * state of the request lives on the stack, an idle connection only
+ * keeps its struct client.
  */
-void buffered_on_read(struct bufferevent *bev, void *arg)
+int buffered_on_frame(struct bufferevent *bev, struct client *client)
 {
-	/* Write back the read buffer. It is important to note that
-	 * bufferevent_write_buffer will drain the incoming data so it
-	 * is effectively gone after we call it. */
-	struct client *client = (struct client *)arg;
-        size_t read_len;
-
-	client->rawrequest = evbuffer_readln(bufferevent_get_input(bev), &read_len, EVBUFFER_EOL_NUL);
+	struct request req;
+	struct evkeyvalq request_headers;
+	struct evkeyvalq response_headers;
+	size_t read_len;
+	int response_cmd;
+
+	memset(&req, 0, sizeof(req));
+	TAILQ_INIT(&request_headers);
+	TAILQ_INIT(&response_headers);
+	req.request_headers = &request_headers;
+	req.response_headers = &response_headers;
+	client->req = &req;
+
+	req.rawrequest = evbuffer_readln(bufferevent_get_input(bev), &read_len, EVBUFFER_EOL_NUL);
 	if(read_len >= MAXREQUESTLEN){
-		client->response_cmd = STOMP_CMD_DISCONNECT;
+		req.response_cmd = STOMP_CMD_DISCONNECT;
 		goto response;
 	}
 
-	if (client->rawrequest == NULL)
+	if (req.rawrequest == NULL)
 		goto error;
 
-	client->request_headers = calloc(1, sizeof(struct evkeyvalq));
-	if(client->request_headers == NULL)
-		goto error;
-
-	TAILQ_INIT(client->request_headers);
-
-	client->response_buf = evbuffer_new();
-	if(client->response_buf == NULL)
-		goto error;
+	capture_frame(client, req.rawrequest, read_len);
+	REDQ_PROBE2(frame_start, client->fd, read_len);
 
-	client->response_headers = calloc(1, sizeof(struct evkeyvalq));
-	if(client->response_headers == NULL)
+	req.response_buf = evbuffer_new();
+	if(req.response_buf == NULL)
 		goto error;
 
-	TAILQ_INIT(client->response_headers);
-
-	client->request = client->rawrequest;
+	req.request = req.rawrequest;
 
 	/* skip leading whitespace */
-	while(*client->request == '\r' || *client->request == '\n')
-		*(client->request)++;
+	while(*req.request == '\r' || *req.request == '\n')
+		req.request++;
 
-	if(strstr(client->request, "\r\n\r\n") != NULL){
-		client->request_body = strstr(client->request, "\r\n\r\n")+4;
+	if(strstr(req.request, "\r\n\r\n") != NULL){
+		req.request_body = strstr(req.request, "\r\n\r\n")+4;
 	}
-	else if(strstr(client->request, "\n\n") != NULL){
-		client->request_body = strstr(client->request, "\n\n")+2;
+	else if(strstr(req.request, "\n\n") != NULL){
+		req.request_body = strstr(req.request, "\n\n")+2;
 	}
 
-	if(stomp_parse_headers(client->request_headers, client->request) != 0){
-		client->response_cmd = STOMP_CMD_DISCONNECT;
+	if(stomp_parse_headers(req.request_headers, req.request) != 0){
+		req.response_cmd = STOMP_CMD_DISCONNECT;
 		goto response;
 	}
+	REDQ_PROBE1(frame_parsed, client->fd);
 
         stomp_handle_request(client);
 
@@ -154,38 +205,55 @@ response:
         stomp_handle_response(client);
 
 error:
-	client->request_cmd = STOMP_CMD_NONE;
-	client->response_cmd = STOMP_CMD_NONE;
-	client->request_body = NULL;
-	client->request = NULL;
-
-	if(client->response_headers){
-		free(client->response_headers);
-		client->response_headers = NULL;
-	}
+	response_cmd = req.response_cmd;
+	client->req = NULL;
 
-	if(client->response_buf){
-		evbuffer_free(client->response_buf);
-		client->response_buf = NULL;
-	}
+	if(req.rawrequest != NULL)
+		REDQ_PROBE2(frame_done, client->fd, response_cmd);
+
+	evhttp_clear_headers(&response_headers);
+	evhttp_clear_headers(&request_headers);
 
-	if(client->request_headers){
-		free(client->request_headers);
-		client->request_headers = NULL;
+	if(req.response_buf)
+		evbuffer_free(req.response_buf);
+
+	if(req.rawrequest)
+		free(req.rawrequest);
+
+	if(response_cmd == STOMP_CMD_ERROR || response_cmd == STOMP_CMD_DISCONNECT){
+		stomp_free_client(client, response_cmd);
+		if(response_cmd == STOMP_CMD_DISCONNECT)
+			return 1;
 	}
 
-	if(client->rawrequest){
-		free(client->rawrequest);
-		client->rawrequest = NULL;
+	return 0;
+}
+
+/**
+ * Called by libevent when there is data to read. A single read
+ * may contain several frames.
+ */
+void buffered_on_read(struct bufferevent *bev, void *arg)
+{
+	struct client *client = (struct client *)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	/* A paused or throttled producer leaves further frames in the buffer */
+	while (!client->paused && !client->throttled && evbuffer_search(input, "\0", 1, NULL).pos != -1) {
+		if (buffered_on_frame(bev, client) != 0)
+			break;
 	}
 }
 
 /**
- * Called by libevent when the write buffer reaches 0.  We only
- * provide this because libevent expects it, but we don't use it.
+ * Called by libevent when the write buffer reaches 0. Used to
+ * continue delivering pending messages to subscribers.
  */
 void buffered_on_write(struct bufferevent *bev, void *arg)
 {
+	struct client *client = (struct client *)arg;
+
+	stomp_resume(client);
 }
 
 /**
@@ -203,54 +271,187 @@ void buffered_on_error(struct bufferevent *bev, short what, void *arg)
 		logwarn("Client %d socket error, disconnecting.", client->fd);
 	}
 
-	client->response_cmd = STOMP_CMD_DISCONNECT;
-	stomp_free_client(client);
+	stomp_free_client(client, STOMP_CMD_DISCONNECT);
 }
 
 /**
- * This function will be called by libevent when there is a connection
- * ready to be accepted.
+ * Applies the configured socket options to an accepted connection.
  */
-void on_accept(int fd, short ev, void *arg)
+void setclientopts(int fd)
 {
-	int client_fd;
-	struct sockaddr_in client_addr;
-	socklen_t client_len = sizeof(client_addr);
-	struct client *client;
+	int on = 1;
+	int size;
 
-	client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
-	if (client_fd < 0) {
-		warn("accept failed");
-		return;
-	}
+	if (strcmp(configget("tcpNoDelay"), "yes") == 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if ((size = atoi(configget("socketSendBuffer"))) > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 
-	/* Set the client socket to non-blocking mode. */
-	if (setnonblock(client_fd) < 0)
-		warn("failed to set client socket non-blocking");
+	if ((size = atoi(configget("socketRecvBuffer"))) > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/**
+ * Creates the client object for an accepted connection.
+ */
+struct client* client_new(int client_fd)
+{
+	struct client *client;
 
-	/* We've accepted a new client, create a client object. */
 	client = calloc(1, sizeof(*client));
 	if (client == NULL)
 		err(1, "malloc failed");
 
 	client->fd = client_fd;
+	TAILQ_INIT(&client->subscriptions);
+	TAILQ_INSERT_TAIL(&clients, client, entries);
+
+#ifdef WITH_URING
+	if (uring_active())
+		client->bev = uring_bufferevent(client_fd);
+	else
+#endif
 	client->bev = bufferevent_socket_new(base, client_fd, BEV_OPT_CLOSE_ON_FREE); 
 	bufferevent_setcb(client->bev, buffered_on_read, buffered_on_write,
 		buffered_on_error, client);
+	memory_client_init(client);
+	capture_open(client);
 
 	/* We have to enable it before our callbacks will be
 	 * called. */
 	bufferevent_enable(client->bev, EV_READ);
+
+	return client;
+}
+
+/**
+ * Called after running out of file descriptors to accept again.
+ */
+void on_accept_resume(int fd, short ev, void *arg)
+{
+	int i;
+
+	for (i = 0; i < listen_count; i++)
+		event_add(ev_accept[i], NULL);
+}
+
+/**
+ * This function will be called by libevent when there are connections
+ * ready to be accepted. Accepts up to acceptBatch connections per
+ * wakeup so a reconnect storm drains quickly.
+ */
+void on_accept(int fd, short ev, void *arg)
+{
+	int client_fd;
+	struct sockaddr_in client_addr;
+	socklen_t client_len;
+	struct timeval tv = { 1, 0 };
+	int batch, i;
+
+	batch = atoi(configget("acceptBatch"));
+
+	while (batch-- > 0) {
+		client_len = sizeof(client_addr);
+#ifdef SOCK_NONBLOCK
+		client_fd = accept4(fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+#else
+		client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
+		if (client_fd >= 0 && setnonblock(client_fd) < 0)
+			warn("failed to set client socket non-blocking");
+#endif
+		if (client_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			if (errno == ECONNABORTED)
+				continue;
+
+			/* Stop accepting for a moment instead of spinning */
+			if (errno == EMFILE || errno == ENFILE) {
+				logerror("Out of file descriptors, pausing accept");
+				for (i = 0; i < listen_count; i++)
+					event_del(ev_accept[i]);
+				event_add(ev_accept_resume, &tv);
+				return;
+			}
+
+			warn("accept failed");
+			return;
+		}
+
+		setclientopts(client_fd);
+		client_new(client_fd);
+	}
+}
+
+#ifdef WITH_URING
+/**
+ * Called for every connection accepted by the io_uring backend.
+ */
+void on_uring_accept(int fd)
+{
+	setclientopts(fd);
+	client_new(fd);
+}
+#endif
+
+/**
+ * Creates a listening socket on listenIP:listenPort. With more than
+ * one listener all of them share the port with SO_REUSEPORT.
+ */
+int listen_socket(int reuseport)
+{
+	struct sockaddr_in listen_addr;
+	int reuseaddr_on = 1;
+	int listen_fd;
+
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_port = htons(atoi(configget("listenPort")));
+	if (inet_pton(AF_INET, configget("listenIP"), &listen_addr.sin_addr) != 1)
+		errx(1, "invalid listenIP %s", configget("listenIP"));
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		err(1, "listen failed");
+
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on)) < 0)
+		err(1, "SO_REUSEADDR failed");
+
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr_on, sizeof(reuseaddr_on)) < 0)
+		err(1, "SO_REUSEPORT failed");
+#endif
+
+	if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0)
+		err(1, "bind failed");
+
+	if (listen(listen_fd, atoi(configget("listenBacklog"))) < 0)
+		err(1, "listen failed");
+
+	/* Set the socket to non-blocking, this is essential in event
+	 * based programming with libevent. */
+	if (setnonblock(listen_fd) < 0)
+		err(1, "failed to set server socket to non-blocking");
+
+	return listen_fd;
 }
 
 int main(int argc, char **argv)
 {
 	char config[PATH_MAX] = CONF_FILE;
-	int listen_fd, ch;
+	int i, ch;
 	int daemon = 0;
-	struct sockaddr_in listen_addr;
-	struct event *ev_accept;
-	int reuseaddr_on;
+	int handed;
+#ifdef WITH_LEVELDB
+	struct event *ev_expire;
+	struct timeval expire_interval;
+	struct event *ev_compact = NULL;
+	struct timeval compact_interval;
+#endif
+	struct event *ev_evict;
+	struct timeval evict_interval = { 1, 0 };
 	pid_t pid, sid;
 
 	signal(SIGHUP, signal_handler);
@@ -258,6 +459,9 @@ int main(int argc, char **argv)
 	signal(SIGINT, signal_handler);
 	signal(SIGQUIT, signal_handler);
 
+	/* Vanished clients and cluster nodes are handled as socket errors */
+	signal(SIGPIPE, SIG_IGN);
+
 	while ((ch = getopt(argc, argv, "d:")) != -1) {
 	    switch (ch) {
 	    case 'd':
@@ -296,53 +500,156 @@ int main(int argc, char **argv)
 	TAILQ_INIT(&clients);
 	TAILQ_INIT(&queues);
 
+	/* Take over from a running process, it closes the storage first */
+	if (handoff_receive() != 0)
+		exit(EXIT_FAILURE);
+
 #ifdef WITH_LEVELDB
 	/* Initialize LevelDB */
 	if(leveldb_init() != 0)
             exit(EXIT_FAILURE);
+
+	/* Backoff of redeliveries */
+	stomp_redeliver_init();
 #endif
 	
 	/* Initialize libevent. */
 	base = event_base_new();
 
-	/* Create our listening socket. */
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0)
-		err(1, "listen failed");
+	/* Output is flushed once per loop iteration */
+	if (stomp_cork_init(base) != 0)
+		exit(EXIT_FAILURE);
 
-	memset(&listen_addr, 0, sizeof(listen_addr));
-	listen_addr.sin_family = AF_INET;
-	listen_addr.sin_addr.s_addr = INADDR_ANY;
-	listen_addr.sin_port = htons(atoi(configget("listenPort")));
+	/* Producer rate limits */
+	ratelimit_init();
 
-	if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0)
-		err(1, "bind failed");
+	/* Memory accounting and limits */
+	if (memory_init(base) != 0)
+		exit(EXIT_FAILURE);
 
-	if (listen(listen_fd, 5) < 0)
-		err(1, "listen failed");
+	/* Topic messages to many subscribers are sent out in slices */
+	if (fanout_init(base) != 0)
+		exit(EXIT_FAILURE);
 
-	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on));
+#ifdef WITH_URING
+	/* Optional io_uring backend for client connections */
+	uring_init(base);
+#endif
 
-	/* Set the socket to non-blocking, this is essential in event
-	 * based programming with libevent. */
-	if (setnonblock(listen_fd) < 0)
-		err(1, "failed to set server socket to non-blocking");
+	/* Record client traffic for redq-replay */
+	if (capture_init() != 0)
+		exit(EXIT_FAILURE);
+
+	/* Connect to the other cluster nodes */
+	if(cluster_init(base) != 0)
+		exit(EXIT_FAILURE);
 
-	/* We now have a listening socket, we create a read event to
-	 * be notified when a client connects. */
-	ev_accept = event_new(base, listen_fd, EV_READ|EV_PERSIST, on_accept, NULL);
-	event_add(ev_accept, NULL);
+#ifdef WITH_LEVELDB
+	/* Initialize replication */
+	if(replication_init(base) != 0)
+		exit(EXIT_FAILURE);
+
+	/* Scheduled delivery, expiry and redelivery belong to the primary */
+	if(!replication_follower()) {
+		if(schedule_init(base) != 0)
+			exit(EXIT_FAILURE);
+
+		/* Cursors of durable topic subscriptions are stored periodically */
+		if(durable_init(base) != 0)
+			exit(EXIT_FAILURE);
+
+		/* Background reclamation of expired messages */
+		expire_interval.tv_sec = atoi(configget("expireInterval")) / 1000;
+		expire_interval.tv_usec = (atoi(configget("expireInterval")) % 1000) * 1000;
+		ev_expire = event_new(base, -1, EV_PERSIST, on_expire, NULL);
+		event_add(ev_expire, &expire_interval);
+
+		/* Compaction of consumed messages */
+		if (atoi(configget("compactInterval")) > 0) {
+			compact_interval.tv_sec = atoi(configget("compactInterval")) / 1000;
+			compact_interval.tv_usec = (atoi(configget("compactInterval")) % 1000) * 1000;
+			ev_compact = event_new(base, -1, EV_PERSIST, on_compact, NULL);
+			event_add(ev_compact, &compact_interval);
+		}
+	}
+#endif
+
+	/* Eviction of idle destinations */
+	ev_evict = event_new(base, -1, EV_PERSIST, on_evict, NULL);
+	event_add(ev_evict, &evict_interval);
+
+	/* Create our listening sockets. We create a read event for
+	 * each to be notified when clients connect. */
+	listen_count = atoi(configget("listenSockets"));
+	if (listen_count < 1)
+		listen_count = 1;
+	if (listen_count > MAXLISTENERS)
+		listen_count = MAXLISTENERS;
+
+	/* or take over those of the previous process */
+	handed = handoff_listeners(listen_fds, MAXLISTENERS);
+	if (handed > 0)
+		listen_count = handed;
+
+	for (i = 0; i < listen_count; i++) {
+		if (handed == 0)
+			listen_fds[i] = listen_socket(listen_count > 1);
+		ev_accept[i] = event_new(base, listen_fds[i], EV_READ|EV_PERSIST, on_accept, NULL);
+#ifdef WITH_URING
+		if (uring_active()) {
+			uring_accept(listen_fds[i], on_uring_accept);
+			continue;
+		}
+#endif
+		event_add(ev_accept[i], NULL);
+	}
+
+	ev_accept_resume = evtimer_new(base, on_accept_resume, NULL);
+
+	loginfo("Listening on %s:%s with %d socket(s)", configget("listenIP"), configget("listenPort"), listen_count);
+
+	/* Graceful upgrades */
+	if (handoff_init(base, listen_fds, listen_count) != 0)
+		exit(EXIT_FAILURE);
+	handoff_restore();
 
 	/* Start the event loop. */
 	event_base_dispatch(base);
 
-	shutdown(listen_fd, SHUT_RDWR);
-	close(listen_fd);
+	for (i = 0; i < listen_count; i++) {
+		event_free(ev_accept[i]);
+		/* A handed off socket goes on accepting in the new process */
+		if (!handoff_done())
+			shutdown(listen_fds[i], SHUT_RDWR);
+		close(listen_fds[i]);
+	}
+	event_free(ev_accept_resume);
+	event_free(ev_evict);
+	stomp_cork_free();
+	memory_free();
+	fanout_free();
+
+#ifdef WITH_URING
+	uring_free();
+#endif
+
+	cluster_free();
+	capture_free();
 
 #ifdef WITH_LEVELDB
+	if(!replication_follower()) {
+		event_free(ev_expire);
+		if (ev_compact != NULL)
+			event_free(ev_compact);
+		schedule_free();
+		durable_free();
+	}
+	replication_free();
 	leveldb_free();
 #endif
 
+	handoff_free();
+
 	logclose();
 
 	return EXIT_SUCCESS;
@@ -32,4 +32,11 @@
 #define CONF_FILE "redqd.conf"
 #define PID_FILE "/var/run/redqd.pid"
 
+/* Upper limit for listenSockets */
+#define MAXLISTENERS 16
+
+extern struct event_base *base;
+
+extern struct client* client_new(int client_fd);
+
 #endif /* _SERVER_H_ */
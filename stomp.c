@@ -24,12 +24,17 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <unistd.h>
 
+/* atomic_fetchadd */
+#include <sys/types.h>
+#include <machine/atomic.h>
+
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -43,6 +48,15 @@
 #include "stomp.h"
 #include "stomputil.h"
 #include "leveldb.h"
+#include "schedule.h"
+#include "replication.h"
+#include "cluster.h"
+#include "memory.h"
+#include "ratelimit.h"
+#include "dedup.h"
+#include "fanout.h"
+#include "durable.h"
+#include "probes.h"
 
 /* internal data structs */
 struct CommandHandler
@@ -61,8 +75,9 @@ struct CommandHandler commandreg[] = {
    { STOMP_CMD_SEND, "SEND", STOMP_IN, stomp_send },
    { STOMP_CMD_MESSAGE, "MESSAGE", STOMP_OUT, NULL },
    { STOMP_CMD_SUBSCRIBE, "SUBSCRIBE", STOMP_IN, stomp_subscribe },
-   { STOMP_CMD_UNSUBSCRIBE, "UNSUBSCRIBE", STOMP_IN, NULL },
-   { STOMP_CMD_ACK, "ACK", STOMP_IN, NULL },
+   { STOMP_CMD_UNSUBSCRIBE, "UNSUBSCRIBE", STOMP_IN, stomp_unsubscribe },
+   { STOMP_CMD_ACK, "ACK", STOMP_IN, stomp_ack },
+   { STOMP_CMD_NACK, "NACK", STOMP_IN, stomp_nack },
    { STOMP_CMD_RECEIPT, "RECEIPT", STOMP_OUT, NULL },
    { STOMP_CMD_DISCONNECT, "DISCONNECT", STOMP_IN, stomp_disconnect },
    { STOMP_CMD_ERROR, "ERROR", STOMP_OUT, NULL },
@@ -71,28 +86,45 @@ struct CommandHandler commandreg[] = {
 
 int stomp_handle_request(struct client *client)
 {
-   int i;
+   int i, ret;
 
    for(i=0; i < sizeof(commandreg)/sizeof(struct CommandHandler); i++){
       if(commandreg[i].direction != STOMP_IN || commandreg[i].handler == NULL)
          continue;
 
-      if(strncmp(client->request, commandreg[i].command, strlen(commandreg[i].command)) == 0){
+      if(strncmp(client->req->request, commandreg[i].command, strlen(commandreg[i].command)) == 0){
          if(client->authenticated == 0){
             if(commandreg[i].cmd != STOMP_CMD_CONNECT && commandreg[i].cmd != STOMP_CMD_DISCONNECT){
-               client->response_cmd = STOMP_CMD_ERROR;
-               evhttp_add_header(client->response_headers, "message", "Authentication required");
+               client->req->response_cmd = STOMP_CMD_ERROR;
+               evhttp_add_header(client->req->response_headers, "message", "Authentication required");
                return 1;
             }
          }
 
-         client->request_cmd = commandreg[i].cmd;
-         return commandreg[i].handler(client);
+#ifdef WITH_LEVELDB
+         if(replication_follower() && commandreg[i].cmd != STOMP_CMD_CONNECT && commandreg[i].cmd != STOMP_CMD_DISCONNECT){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Replica is read-only");
+            return 1;
+         }
+#endif
+
+         if(client->peer)
+            cluster_accept_route(client);
+         else if(cluster_forward(client, commandreg[i].cmd) != 0)
+            return client->req->response_cmd == STOMP_CMD_ERROR;
+
+         client->req->request_cmd = commandreg[i].cmd;
+         REDQ_PROBE2(request_start, client->fd, commandreg[i].command);
+         ret = commandreg[i].handler(client);
+         REDQ_PROBE3(request_done, client->fd, commandreg[i].cmd, ret);
+
+         return ret;
       }
    }
 
-   client->response_cmd = STOMP_CMD_ERROR;
-   evhttp_add_header(client->response_headers, "message", "Unknown command");
+   client->req->response_cmd = STOMP_CMD_ERROR;
+   evhttp_add_header(client->req->response_headers, "message", "Unknown command");
 
    return 1;
 }
@@ -102,66 +134,82 @@ int stomp_handle_response(struct client *client)
    int i;
    int found;
    const char *receipt;
+   char route[16];
    struct evkeyval *header;
 
-   if(client->response_buf == NULL)
-      client->response_buf = evbuffer_new();
+   REDQ_PROBE2(response_start, client->fd, client->req->response_cmd);
 
-   if(client->request_headers){
-      receipt = evhttp_find_header(client->request_headers, "receipt");
-      if(receipt != NULL && client->response_cmd != STOMP_CMD_ERROR){
-         evbuffer_add_printf(client->response_buf, "RECEIPT\n");
-         evbuffer_add_printf(client->response_buf, "receipt:%s\n", receipt);
-         evbuffer_add_printf(client->response_buf, "\n");
-         evbuffer_add(client->response_buf, "\0", 1);
+   if(client->req->response_buf == NULL)
+      client->req->response_buf = evbuffer_new();
 
-         evhttp_remove_header(client->request_headers, "receipt");
+   if(client->req->request_headers){
+      receipt = evhttp_find_header(client->req->request_headers, "receipt");
+
+      /* Tells a pipelining client which of its requests failed */
+      if(receipt != NULL && client->req->response_cmd == STOMP_CMD_ERROR)
+         evhttp_add_header(client->req->response_headers, "receipt-id", receipt);
+#ifdef WITH_LEVELDB
+      /* Sent later once enough followers caught up */
+      if(receipt != NULL && client->req->response_cmd != STOMP_CMD_ERROR && replication_hold_receipt(client, receipt))
+         receipt = NULL;
+#endif
+      if(receipt != NULL && client->req->response_cmd != STOMP_CMD_ERROR){
+         evbuffer_add_printf(client->req->response_buf, "RECEIPT\n");
+         evbuffer_add_printf(client->req->response_buf, "receipt:%s\n", receipt);
+         if(client->peer && client->route != 0)
+            evbuffer_add_printf(client->req->response_buf, "route:%u\n", client->route);
+         evbuffer_add_printf(client->req->response_buf, "\n");
+         evbuffer_add(client->req->response_buf, "\0", 1);
+
+         evhttp_remove_header(client->req->request_headers, "receipt");
       }
    }
 
+   /* Errors of forwarded requests go back to the remote client */
+   if(client->peer && client->route != 0 && client->req->response_cmd == STOMP_CMD_ERROR){
+      snprintf(route, sizeof(route), "%u", client->route);
+      evhttp_add_header(client->req->response_headers, "route", route);
+   }
+
    for(i=0,found=0; i < sizeof(commandreg)/sizeof(struct CommandHandler); i++){
       if(commandreg[i].direction != STOMP_OUT)
          continue;
 
-      if(commandreg[i].cmd == client->response_cmd){
+      if(commandreg[i].cmd == client->req->response_cmd){
          found = 1;
 
          if(commandreg[i].command[0] == '\0')
             break;
 
-         evbuffer_add_printf(client->response_buf, "%s\n", commandreg[i].command);
+         evbuffer_add_printf(client->req->response_buf, "%s\n", commandreg[i].command);
 
-         TAILQ_FOREACH(header, client->response_headers, next) {
+         TAILQ_FOREACH(header, client->req->response_headers, next) {
             if(strcmp(header->key, "receipt") == 0)
                continue;
 
-            evbuffer_add_printf(client->response_buf, "%s:%s\n", header->key, header->value);
+            evbuffer_add_printf(client->req->response_buf, "%s:%s\n", header->key, header->value);
          }
 
-         evbuffer_add_printf(client->response_buf, "\n");
+         evbuffer_add_printf(client->req->response_buf, "\n");
 
-         if(client->response != NULL){
-            evbuffer_add(client->response_buf, client->response, strlen(client->response));
+         if(client->req->response != NULL){
+            evbuffer_add(client->req->response_buf, client->req->response, strlen(client->req->response));
          }
 
-         evbuffer_add(client->response_buf, "\0", 1);
+         evbuffer_add(client->req->response_buf, "\0", 1);
 
          break;
       }
    }
 
    if(found == 0){
-      evbuffer_add_printf(client->response_buf, "ERROR\n");
-      evbuffer_add_printf(client->response_buf, "message:Internal error\n\n");
-      evbuffer_add(client->response_buf, "\0", 1);
+      evbuffer_add_printf(client->req->response_buf, "ERROR\n");
+      evbuffer_add_printf(client->req->response_buf, "message:Internal error\n\n");
+      evbuffer_add(client->req->response_buf, "\0", 1);
    }
 
-   bufferevent_write_buffer(client->bev, client->response_buf);
-   bufferevent_flush(client->bev, EV_WRITE, BEV_FINISHED);
-
-   if(client->response_cmd == STOMP_CMD_ERROR || client->response_cmd == STOMP_CMD_DISCONNECT){
-      stomp_free_client(client);
-   }
+   REDQ_PROBE2(response_done, client->fd, evbuffer_get_length(client->req->response_buf));
+   stomp_write_buffer(client, client->req->response_buf);
 
    return !found;
 }
@@ -171,46 +219,82 @@ int stomp_connect(struct client *client)
 {
    const char *login;
    const char *passcode;
+   const char *peer;
 
    if(strlen(configget("authUser")) > 0 && strlen(configget("authPass")) > 0){
-      login = evhttp_find_header(client->request_headers, "login");
+      login = evhttp_find_header(client->req->request_headers, "login");
       if(login == NULL){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Authentication failed");
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Authentication failed");
          return 1;
       }
 
-      passcode = evhttp_find_header(client->request_headers, "passcode");
+      passcode = evhttp_find_header(client->req->request_headers, "passcode");
       if(passcode == NULL){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Authentication failed");
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Authentication failed");
          return 1;
       }
 
       if(strcmp(login, configget("authUser")) != 0 || strcmp(passcode, configget("authPass")) != 0){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Authentication failed");
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Authentication failed");
          return 1;
       }
    }
 
-   if(evhttp_find_header(client->request_headers, "receipt") != NULL){
-      client->response_cmd = STOMP_CMD_ERROR;
-      evhttp_add_header(client->response_headers, "message", "Receipt for connect not supported");
+   if(evhttp_find_header(client->req->request_headers, "receipt") != NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Receipt for connect not supported");
+      return 1;
+   }
+
+   peer = evhttp_find_header(client->req->request_headers, "peer");
+   if(peer != NULL && cluster_accept_peer(client, peer) != 0){
+      logwarn("Client %d claims to be cluster node %s", client->fd, peer);
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Unknown cluster node");
       return 1;
    }
 
    client->authenticated = 1;
 
-   client->response_cmd = STOMP_CMD_CONNECTED;
-   evhttp_add_header(client->response_headers, "session", "0");
+   if(ratelimit_login(client, evhttp_find_header(client->req->request_headers, "login")) != 0){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Out of memory");
+      return 1;
+   }
+
+   if(peer != NULL){
+      client->peer = 1;
+      loginfo("Client %d is the cluster link of %s", client->fd, peer);
+   }
+
+   client->req->response_cmd = STOMP_CMD_CONNECTED;
+   evhttp_add_header(client->req->response_headers, "session", "0");
 
    return 0;
 }
 
 int stomp_disconnect(struct client *client)
 {
-   client->response_cmd = STOMP_CMD_DISCONNECT;
+   struct subscription *subscription, *tmp_subscription;
+
+   /* A client of another cluster node went away */
+   if(client->peer && client->route != 0){
+      for (subscription = TAILQ_FIRST(&client->subscriptions); subscription != NULL; subscription = tmp_subscription) {
+         tmp_subscription = TAILQ_NEXT(subscription, client_entries);
+         if(subscription->route == client->route)
+            stomp_free_subscription(subscription);
+      }
+
+      stomp_free_temporary(client, client->route);
+
+      client->req->response_cmd = STOMP_CMD_NONE;
+      return 0;
+   }
+
+   client->req->response_cmd = STOMP_CMD_DISCONNECT;
 
    return 0;
 }
@@ -218,15 +302,18 @@ int stomp_disconnect(struct client *client)
 
 int stomp_subscribe(struct client *client)
 {
+   struct subscription *subscription;
    struct queue *entry;
    const char *queuename;
+   const char *value;
+   const char *durable;
 
-   client->response_cmd = STOMP_CMD_NONE;
+   client->req->response_cmd = STOMP_CMD_NONE;
 
-   queuename = evhttp_find_header(client->request_headers, "destination");
+   queuename = evhttp_find_header(client->req->request_headers, "destination");
    if(queuename == NULL){
-      client->response_cmd = STOMP_CMD_ERROR;
-      evhttp_add_header(client->response_headers, "message", "Destination header missing");
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Destination header missing");
       return 1;
    }
          
@@ -234,66 +321,1493 @@ int stomp_subscribe(struct client *client)
    if (entry == NULL){
       entry = stomp_add_queue(queuename);
       if(entry == NULL){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Could not create destination");
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Could not create destination");
+         return 1;
+      }
+
+      if(stomp_is_temporary(queuename)){
+         entry->owner = client;
+         entry->owner_route = client->route;
+      }
+   }
+
+   value = evhttp_find_header(client->req->request_headers, "browser");
+   if(value != NULL && strcmp(value, "true") == 0)
+      return stomp_browse(client, entry);
+
+   durable = evhttp_find_header(client->req->request_headers, DURABLE_HEADER);
+   if(durable != NULL){
+#ifdef WITH_LEVELDB
+      if(!entry->topic || stomp_is_temporary(queuename)){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Only topics have durable subscriptions");
+         return 1;
+      }
+
+      if(*durable == '\0' || stomp_find_subscription(client, entry) != NULL ||
+            (durable_find(entry, durable) != NULL && durable_find(entry, durable)->subscription != NULL)){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Durable subscription in use");
          return 1;
       }
+#else
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Durable subscriptions need storage");
+      return 1;
+#endif
+   }
+
+   subscription = stomp_add_subscription(client, entry);
+   if(subscription == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Could not create subscription");
+      return 1;
+   }
+
+   value = evhttp_find_header(client->req->request_headers, "ack");
+   if(value != NULL && strncmp(value, "client", 6) == 0)
+      subscription->ack = ACK_CLIENT;
+   else
+      subscription->ack = ACK_AUTO;
+
+   value = evhttp_find_header(client->req->request_headers, "prefetch");
+   subscription->prefetch = (value != NULL && atoi(value) > 0) ? atoi(value) : DEFAULTPREFETCH;
+
+#ifdef WITH_LEVELDB
+   /* It reads what it missed from the topic log */
+   if(durable != NULL && durable_subscribe(subscription, durable) != 0){
+      stomp_free_subscription(subscription);
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Could not create subscription");
+      return 1;
    }
+#endif
 
-   TAILQ_INSERT_TAIL(&entry->subscribers, client, entries);
+   /* Deliver the backlog */
+   stomp_dispatch(entry);
 
    return 0;
 }
 
-int stomp_send(struct client *client)
+int stomp_unsubscribe(struct client *client)
 {
-   struct client *subscriber;
+   struct subscription *subscription;
    struct queue *queue;
    const char *queuename;
+#ifdef WITH_LEVELDB
+   const char *durable;
+#endif
 
-   queuename = evhttp_find_header(client->request_headers, "destination");
+   client->req->response_cmd = STOMP_CMD_NONE;
+
+   queuename = evhttp_find_header(client->req->request_headers, "destination");
    if(queuename == NULL){
-      client->response_cmd = STOMP_CMD_ERROR;
-      evhttp_add_header(client->response_headers, "message", "Destination header missing");
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Destination header missing");
       return 1;
    }
 
    queue = stomp_find_queue(queuename);
-   if (queue == NULL){
+
+#ifdef WITH_LEVELDB
+   /* With the durable header a durable subscription is removed, its
+    * topic may have been evicted while it was offline */
+   durable = evhttp_find_header(client->req->request_headers, DURABLE_HEADER);
+   if(durable != NULL && queue == NULL && strncmp(queuename, "/topic/", 7) == 0)
       queue = stomp_add_queue(queuename);
-      if(queue == NULL){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Creating destination failed");
+
+   if(durable != NULL && queue != NULL && durable_find(queue, durable) != NULL){
+      subscription = durable_find(queue, durable)->subscription;
+      if(subscription != NULL && (subscription->client != client || subscription->route != client->route)){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Durable subscription in use");
          return 1;
       }
+
+      if(subscription != NULL)
+         stomp_free_subscription(subscription);
+
+      return durable_remove(queue, durable);
+   }
+#endif
+
+   subscription = (queue != NULL) ? stomp_find_subscription(client, queue) : NULL;
+   if(subscription == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Not subscribed to destination");
+      return 1;
+   }
+
+   stomp_free_subscription(subscription);
+
+   return 0;
+}
+
+/*
+ * Sends a message to a single subscriber without touching the
+ * request/response state of the subscriber's own connection.
+ */
+int stomp_deliver(struct subscription *subscription, struct evkeyvalq *headers, char *body)
+{
+   struct client *subscriber = subscription->client;
+   struct request req, *current;
+   char route[16];
+
+   /* Subscriptions over a peer link are told apart by route */
+   if(subscription->route != 0){
+      snprintf(route, sizeof(route), "%u", subscription->route);
+      evhttp_add_header(headers, "route", route);
+   }
+
+   memset(&req, 0, sizeof(req));
+   req.response_cmd = STOMP_CMD_MESSAGE;
+   req.response_headers = headers;
+   req.response = body;
+
+   current = subscriber->req;
+   subscriber->req = &req;
+   subscriber->charging = subscription->queue;
+
+   stomp_handle_response(subscriber);
+
+   subscriber->charging = NULL;
+   subscriber->req = current;
+
+   if(req.response_buf != NULL)
+      evbuffer_free(req.response_buf);
+
+   if(subscription->route != 0)
+      evhttp_remove_header(headers, "route");
+
+   return 0;
+}
+
+#ifdef WITH_LEVELDB
+/*
+ * Returns the lowest sequence of a bucket which has not been
+ * acknowledged yet, which is where the read pointer belongs.
+ */
+static u_int stomp_lowest_unacked(struct queue *queue, int priority)
+{
+   struct bucket *bucket = &queue->buckets[priority];
+   struct inflight *inflight;
+
+   inflight = TAILQ_FIRST(&bucket->unacked);
+
+   return inflight != NULL ? inflight->seq : bucket->deliver;
+}
+
+/*
+ * Removes a delivered message from storage. The message must not
+ * be tracked as unacknowledged anymore.
+ */
+int stomp_acknowledge(struct queue *queue, int priority, u_int seq, int redelivered, u_int64_t shared)
+{
+   queue->buckets[priority].read = stomp_lowest_unacked(queue, priority);
+
+   return leveldb_ack_message(queue, priority, seq, redelivered, shared);
+}
+
+static void stomp_on_redeliver(int fd, short ev, void *arg)
+{
+   stomp_dispatch((struct queue *)arg);
+}
+
+/*
+ * Arms the redelivery timer of a queue for the first message which
+ * waits for its redelivery.
+ */
+static void stomp_arm_redeliver(struct queue *queue)
+{
+   struct inflight *inflight;
+   struct timeval tv;
+   u_int64_t now;
+   u_int64_t wait = 0;
+
+   inflight = TAILQ_FIRST(&queue->redeliver);
+   if(inflight == NULL)
+      return;
+
+   if(queue->ev_redeliver == NULL){
+      queue->ev_redeliver = evtimer_new(base, stomp_on_redeliver, queue);
+      if(queue->ev_redeliver == NULL)
+         return;
+   }
+
+   now = mstime();
+   if(inflight->due > now)
+      wait = inflight->due - now;
+
+   tv.tv_sec = wait / 1000;
+   tv.tv_usec = (wait % 1000) * 1000;
+   evtimer_add(queue->ev_redeliver, &tv);
+}
+
+/* maxRedeliveries, redeliveryDelay and redeliveryDelayMax */
+static u_int max_redeliveries;
+static u_int64_t redelivery_delay;
+static u_int64_t redelivery_delay_max;
+
+void stomp_redeliver_init(void)
+{
+   max_redeliveries = strtoul(configget("maxRedeliveries"), NULL, 10);
+   redelivery_delay = strtoull(configget("redeliveryDelay"), NULL, 10);
+   redelivery_delay_max = strtoull(configget("redeliveryDelayMax"), NULL, 10);
+}
+
+/*
+ * Moves a message which exceeded the maximum number of deliveries
+ * to the dead letter queue DLQ.<destination>. The inflight record
+ * stays tracked if that fails.
+ */
+static int stomp_dead_letter(struct queue *queue, struct inflight *inflight)
+{
+   char dlqname[MAXQUEUELEN];
+   char *message;
+   u_int64_t expires;
+   int ret = 0;
+
+   if(strncmp(queue->queuename, "/queue/DLQ.", 11) == 0){
+      logwarn("Dropping message %u/%d of dead letter queue %s", inflight->seq, inflight->priority, queue->queuename);
+   }
+   else {
+      snprintf(dlqname, sizeof(dlqname), "/queue/DLQ.%s",
+         strncmp(queue->queuename, "/queue/", 7) == 0 ? queue->queuename+7 : queue->queuename+1);
+
+      message = leveldb_get_message(queue, inflight->priority, inflight->seq, &expires, &inflight->shared);
+      if(message != NULL){
+         ret = stomp_publish(dlqname, inflight->priority, message);
+         free(message);
+      }
+
+      if(ret != 0){
+         logerror("Moving message %u/%d of %s to %s failed", inflight->seq, inflight->priority, queue->queuename, dlqname);
+         return ret;
+      }
+
+      loginfo("Moved message %u/%d of %s to %s", inflight->seq, inflight->priority, queue->queuename, dlqname);
+   }
+
+   stomp_untrack_inflight(queue, inflight);
+   stomp_acknowledge(queue, inflight->priority, inflight->seq, 1, inflight->shared);
+
+   return 0;
+}
+#endif
+
+/*
+ * Takes back an unacknowledged message after a NACK or when its
+ * subscriber went away and schedules it for redelivery with an
+ * exponential backoff or moves it to the dead letter queue.
+ */
+int stomp_redeliver(struct inflight *inflight)
+{
+#ifdef WITH_LEVELDB
+   struct queue *queue = inflight->subscription->queue;
+   struct inflight *entry;
+   u_int64_t delay;
+
+   TAILQ_REMOVE(&queue->inflight, inflight, entries);
+   inflight->subscription->inflight--;
+   inflight->subscription = NULL;
+
+   /* Failures of an earlier run are only known to the storage */
+   if(inflight->count == 0)
+      inflight->count = leveldb_get_redelivered(queue, inflight->priority, inflight->seq);
+
+   inflight->count++;
+
+   /* A message which could not be moved is delivered again after
+    * the backoff, its next failure retries the move */
+   if(inflight->count > max_redeliveries && stomp_dead_letter(queue, inflight) == 0){
+      free(inflight);
+      return 0;
+   }
+
+   leveldb_set_redelivered(queue, inflight->priority, inflight->seq, inflight->count);
+
+   if(inflight->count-1 >= 32 || (redelivery_delay << (inflight->count-1)) > redelivery_delay_max)
+      delay = redelivery_delay_max;
+   else
+      delay = redelivery_delay << (inflight->count-1);
+
+   inflight->due = mstime() + delay;
+
+   /* Keep the redeliver list ordered by due time */
+   TAILQ_FOREACH_REVERSE(entry, &queue->redeliver, inflightq, entries) {
+      if(entry->due <= inflight->due)
+         break;
+   }
+
+   if(entry == NULL)
+      TAILQ_INSERT_HEAD(&queue->redeliver, inflight, entries);
+   else
+      TAILQ_INSERT_AFTER(&queue->redeliver, entry, inflight, entries);
+
+   stomp_arm_redeliver(queue);
+
+   return 0;
+#else
+   free(inflight);
+   return 0;
+#endif
+}
+
+#ifdef WITH_LEVELDB
+/*
+ * Sets message-id, destination and expires of a stored message.
+ */
+static void stomp_message_headers(struct queue *queue, struct evkeyvalq *headers, int priority, u_int seq, u_int64_t expires)
+{
+   char messageid[MAXQUEUELEN+32];
+   char buf[24];
+   const char *destination;
+
+   snprintf(messageid, sizeof(messageid), "%s.%d.%u", queue->queuename, priority, seq);
+   evhttp_remove_header(headers, "message-id");
+   evhttp_add_header(headers, "message-id", messageid);
+
+   destination = evhttp_find_header(headers, "destination");
+   if(destination == NULL || strcmp(destination, queue->queuename) != 0){
+      if(destination != NULL && evhttp_find_header(headers, "original-destination") == NULL)
+         evhttp_add_header(headers, "original-destination", destination);
+      evhttp_remove_header(headers, "destination");
+      evhttp_add_header(headers, "destination", queue->queuename);
+   }
+
+   if(expires != 0 && evhttp_find_header(headers, "expires") == NULL){
+      snprintf(buf, sizeof(buf), "%llu", (unsigned long long)expires);
+      evhttp_add_header(headers, "expires", buf);
    }
+}
+#endif
+
+#ifdef WITH_LEVELDB
+/*
+ * Whether a missing message was dropped by the overflow policy. The
+ * dropped pointer is stale once the read pointer passed it.
+ */
+static int stomp_was_dropped(struct bucket *bucket, u_int seq)
+{
+   if(bucket->dropped - bucket->read > bucket->write - bucket->read)
+      return 0;
+
+   return seq - bucket->read < bucket->dropped - bucket->read;
+}
+#endif
 
+/*
+ * Delivers a stored message to a subscriber. With automatic
+ * acknowledgement it is removed right away, otherwise it is kept
+ * on the inflight list until the client acknowledges it.
+ */
+int stomp_dispatch_message(struct queue *queue, struct subscription *subscription, int priority, u_int seq, struct inflight *inflight, u_int64_t now)
+{
 #ifdef WITH_LEVELDB
-   if(strncmp(queuename, "/topic/", 7) != 0){
-      if(leveldb_add_message(queue, client->request) != 0){
-         client->response_cmd = STOMP_CMD_ERROR;
-         evhttp_add_header(client->response_headers, "message", "Storing message failed");
+   struct evkeyvalq headers;
+   char buf[24];
+   char *message;
+   char *body;
+   u_int64_t expires;
+   u_int64_t shared;
+   u_int count = (inflight != NULL) ? inflight->count : 0;
+
+   message = leveldb_get_message(queue, priority, seq, &expires, &shared);
+   if(message == NULL && !stomp_was_dropped(&queue->buckets[priority], seq))
+      logerror("Message %u/%d of %s missing", seq, priority, queue->queuename);
+
+   /* New messages leave the backlog */
+   if(inflight == NULL && message != NULL)
+      queue->bytes -= (strlen(message) < queue->bytes) ? strlen(message) : queue->bytes;
+
+   /* Expired messages are dropped without parsing them */
+   if(message == NULL || (expires != 0 && expires <= now)){
+      free(message);
+      stomp_untrack_inflight(queue, inflight);
+      free(inflight);
+      return stomp_acknowledge(queue, priority, seq, count > 0, shared);
+   }
+
+   TAILQ_INIT(&headers);
+
+   body = stomp_parse_frame(&headers, message);
+   if(body == NULL){
+      logerror("Message %u/%d of %s unparsable", seq, priority, queue->queuename);
+      evhttp_clear_headers(&headers);
+      free(message);
+      stomp_untrack_inflight(queue, inflight);
+      free(inflight);
+      return stomp_acknowledge(queue, priority, seq, count > 0, shared);
+   }
+
+   stomp_message_headers(queue, &headers, priority, seq, expires);
+
+   if(count > 0){
+      snprintf(buf, sizeof(buf), "%u", count);
+      evhttp_add_header(&headers, "redelivered", "true");
+      evhttp_add_header(&headers, "redelivery-count", buf);
+   }
+
+   stomp_deliver(subscription, &headers, body);
+
+   evhttp_clear_headers(&headers);
+   free(message);
+
+   if(subscription->ack == ACK_AUTO){
+      stomp_untrack_inflight(queue, inflight);
+      free(inflight);
+      return stomp_acknowledge(queue, priority, seq, count > 0, shared);
+   }
+
+   if(inflight == NULL){
+      inflight = calloc(1, sizeof(*inflight));
+      if(inflight == NULL)
          return 1;
+
+      inflight->priority = priority;
+      inflight->seq = seq;
+      stomp_track_inflight(queue, inflight);
+   }
+
+   inflight->shared = shared;
+   inflight->subscription = subscription;
+   subscription->inflight++;
+   TAILQ_INSERT_TAIL(&queue->inflight, inflight, entries);
+#endif
+
+   return 0;
+}
+
+/*
+ * Delivers pending messages of a queue as long as there is a
+ * subscriber with room. Due redeliveries go first, then new
+ * messages with the highest priority.
+ */
+int stomp_dispatch(struct queue *queue)
+{
+#ifdef WITH_LEVELDB
+   struct subscription *subscription;
+   struct inflight *inflight;
+   int priority;
+   u_int seq;
+   u_int64_t now;
+
+   now = mstime();
+
+   for(;;){
+      /* Messages stay in the storage until memory is released */
+      if(memory_check(NULL, queue) == MEMORY_SPILL){
+         memory_spill(queue);
+         break;
+      }
+
+      inflight = TAILQ_FIRST(&queue->redeliver);
+      if(inflight != NULL && inflight->due > now)
+         inflight = NULL;
+
+      priority = stomp_queue_priority(queue);
+      if(inflight == NULL && priority < 0)
+         break;
+
+      subscription = stomp_next_subscriber(queue);
+      if(subscription == NULL)
+         break;
+
+      if(inflight != NULL){
+         TAILQ_REMOVE(&queue->redeliver, inflight, entries);
+         priority = inflight->priority;
+         seq = inflight->seq;
       }
+      else {
+         seq = atomic_fetchadd_int(&queue->buckets[priority].deliver, 1);
+         if(queue->buckets[priority].deliver == queue->buckets[priority].write)
+            queue->pending &= ~(1 << priority);
+      }
+
+      if(stomp_dispatch_message(queue, subscription, priority, seq, inflight, now) != 0)
+         return 1;
    }
+
+   stomp_arm_redeliver(queue);
+
+   /* Blocked producers may go on */
+   if((queue->policy->maxlength != 0 || queue->policy->maxbytes != 0) && !stomp_queue_full(queue, 1, 0))
+      memory_wakeup();
 #endif
 
-   /* Send it out to the subscribers */
-   TAILQ_FOREACH(subscriber, &queue->subscribers, entries){
-      subscriber->response_cmd = STOMP_CMD_MESSAGE;
-      subscriber->response_headers = client->request_headers;
-      subscriber->response = client->request_body;
+   return 0;
+}
+
+#ifdef WITH_LEVELDB
+static void stomp_browse_message(void *arg, int priority, u_int seq, u_int64_t expires, char *message)
+{
+   struct subscription *subscription = (struct subscription *)arg;
+   struct evkeyvalq headers;
+   char *body;
+
+   if(expires != 0 && expires <= mstime())
+      return;
+
+   TAILQ_INIT(&headers);
+
+   body = stomp_parse_frame(&headers, message);
+   if(body != NULL){
+      stomp_message_headers(subscription->queue, &headers, priority, seq, expires);
+      stomp_deliver(subscription, &headers, body);
+   }
+
+   evhttp_clear_headers(&headers);
+}
 
-      stomp_handle_response(subscriber);
+/*
+ * Sends a stored message to a subscriber without consuming it, for
+ * durable subscriptions which read a topic log.
+ */
+int stomp_deliver_stored(struct subscription *subscription, int priority, u_int seq)
+{
+   char *message;
+   u_int64_t expires;
 
-      subscriber->response_cmd = STOMP_CMD_NONE;
-      subscriber->response_headers = NULL;
-      subscriber->response = NULL;
+   message = leveldb_get_message(subscription->queue, priority, seq, &expires, NULL);
+   if(message == NULL){
+      logerror("Message %u/%d of %s missing", seq, priority, subscription->queue->queuename);
+      return 1;
    }
 
-   client->response_cmd = STOMP_CMD_NONE;
-   client->response = NULL;
+   stomp_browse_message(subscription, priority, seq, expires, message);
+   free(message);
 
    return 0;
 }
 
+/*
+ * Sends the next batches of a browser subscription, one per loop
+ * iteration, until the output of the subscriber is full. The end is
+ * marked with an empty MESSAGE carrying browser:end, after which
+ * the subscription is removed.
+ */
+static void stomp_on_browse(int fd, short ev, void *arg)
+{
+   struct subscription *subscription = (struct subscription *)arg;
+   struct browse *browse = subscription->browse;
+   struct evkeyvalq headers;
+   int batch, count;
+
+   if(stomp_output_length(subscription->client) >= MAXOUTPUTBUF)
+      return;
+
+   batch = atoi(configget("browseBatch"));
+   if(batch < 1)
+      batch = 1;
+   if(batch > browse->left)
+      batch = browse->left;
+
+   count = leveldb_cursor_messages(browse->cursor, subscription->queue, browse->priority, &browse->seq, browse->to, batch, stomp_browse_message, subscription);
+   browse->left -= count;
+
+   if(count < batch){
+      browse->priority--;
+      browse->seq = browse->from;
+   }
+
+   if(browse->priority >= 0 && browse->left > 0){
+      event_active(browse->ev, EV_TIMEOUT, 0);
+      return;
+   }
+
+   TAILQ_INIT(&headers);
+   evhttp_add_header(&headers, "destination", subscription->queue->queuename);
+   evhttp_add_header(&headers, "browser", "end");
+   stomp_deliver(subscription, &headers, NULL);
+   evhttp_clear_headers(&headers);
+
+   stomp_free_subscription(subscription);
+}
+#endif
+
+/*
+ * Starts a browser subscription (browser:true). browse-from and
+ * browse-to limit the sequence range per priority, browse-limit the
+ * number of messages.
+ */
+int stomp_browse(struct client *client, struct queue *queue)
+{
+#ifdef WITH_LEVELDB
+   struct subscription *subscription;
+   struct browse *browse;
+   const char *value;
+
+   if(queue->topic){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Only queues can be browsed");
+      return 1;
+   }
+
+   if(stomp_find_subscription(client, queue) != NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Already subscribed to destination");
+      return 1;
+   }
+
+   browse = calloc(1, sizeof(*browse));
+   if(browse == NULL)
+      goto error;
+
+   browse->cursor = leveldb_cursor_open();
+   if(browse->cursor == NULL){
+      free(browse);
+      goto error;
+   }
+
+   subscription = stomp_add_subscription(client, queue);
+   if(subscription == NULL){
+      leveldb_cursor_close(browse->cursor);
+      free(browse);
+      goto error;
+   }
+
+   subscription->browse = browse;
+
+   browse->ev = event_new(base, -1, 0, stomp_on_browse, subscription);
+   if(browse->ev == NULL){
+      stomp_free_subscription(subscription);
+      goto error;
+   }
+
+   value = evhttp_find_header(client->req->request_headers, "browse-from");
+   browse->from = (value != NULL) ? strtoul(value, NULL, 10) : 0;
+
+   value = evhttp_find_header(client->req->request_headers, "browse-to");
+   browse->to = (value != NULL) ? strtoul(value, NULL, 10) : UINT_MAX;
+
+   value = evhttp_find_header(client->req->request_headers, "browse-limit");
+   browse->left = (value != NULL && atoi(value) > 0) ? atoi(value) : UINT_MAX;
+
+   browse->priority = MAXPRIORITY-1;
+   browse->seq = browse->from;
+
+   /* Answers to the SUBSCRIBE go out first */
+   event_active(browse->ev, EV_TIMEOUT, 0);
+
+   return 0;
+
+error:
+   client->req->response_cmd = STOMP_CMD_ERROR;
+   evhttp_add_header(client->req->response_headers, "message", "Could not create subscription");
+   return 1;
+#else
+   client->req->response_cmd = STOMP_CMD_ERROR;
+   evhttp_add_header(client->req->response_headers, "message", "Browsing needs storage");
+   return 1;
+#endif
+}
+
+/*
+ * Background reclamation of expired messages. Removes expired runs
+ * at the head of each queue, at most expireBatch messages per call.
+ */
+int stomp_expire(void)
+{
+#ifdef WITH_LEVELDB
+   struct queue *queue;
+   int priority;
+   int budget;
+   int count;
+   u_int64_t now;
+
+   budget = atoi(configget("expireBatch"));
+   now = mstime();
+
+   TAILQ_FOREACH(queue, &queues, entries) {
+      if(queue->expiring == 0)
+         continue;
+
+      if(queue->pending == 0){
+         queue->expiring = 0;
+         continue;
+      }
+
+      for(priority=MAXPRIORITY-1; priority >= 0 && budget > 0; priority--){
+         if((queue->pending & (1 << priority)) == 0)
+            continue;
+
+         /* Buckets with unacknowledged messages are left to dispatch */
+         if(queue->buckets[priority].read != queue->buckets[priority].deliver)
+            continue;
+
+         count = leveldb_expire_messages(queue, priority, now, budget);
+         if(count < 0)
+            return 1;
+
+         budget -= count;
+      }
+
+      if(budget <= 0)
+         break;
+   }
+#endif
+
+   return 0;
+}
+
+#ifdef WITH_LEVELDB
+/*
+ * Compaction blocks the event loop, at most compactBatch messages
+ * of a bucket are compacted at once and the rest of the bucket
+ * follows in the next loop iterations.
+ */
+static struct event *ev_compact_step;
+static char compact_queuename[MAXQUEUELEN];
+static int compact_priority;
+
+static void stomp_on_compact_step(int fd, short ev, void *arg);
+
+static void stomp_compact_bucket(struct queue *queue, int priority)
+{
+   struct bucket *bucket = &queue->buckets[priority];
+   u_int batch, from, to;
+
+   from = bucket->compacted;
+   to = bucket->read;
+
+   batch = strtoul(configget("compactBatch"), NULL, 10);
+   if(batch > 0 && to - from > batch)
+      to = from + batch;
+
+   loginfo("Compacting %u of %u messages of %s priority %d", to - from, bucket->read - from, queue->queuename, priority);
+
+   leveldb_compact_queue(queue, priority, from, to);
+   bucket->compacted = to;
+
+   if(to == bucket->read)
+      return;
+
+   if(ev_compact_step == NULL && (ev_compact_step = evtimer_new(base, stomp_on_compact_step, NULL)) == NULL)
+      return;
+
+   snprintf(compact_queuename, sizeof(compact_queuename), "%s", queue->queuename);
+   compact_priority = priority;
+   event_active(ev_compact_step, EV_TIMEOUT, 0);
+}
+
+static void stomp_on_compact_step(int fd, short ev, void *arg)
+{
+   struct queue *queue;
+
+   /* The queue might have been evicted in the meantime */
+   queue = stomp_find_queue(compact_queuename);
+   if(queue != NULL)
+      stomp_compact_bucket(queue, compact_priority);
+}
+#endif
+
+/*
+ * Compacts the consumed range of the bucket with the most deleted
+ * messages, at most one per call. Skipped while the storage gets
+ * more than compactMaxLoad writes per second.
+ */
+int stomp_compact(void)
+{
+#ifdef WITH_LEVELDB
+   static u_int64_t last_writes, last_time;
+   struct queue *queue, *found = NULL;
+   u_int threshold, maxload;
+   u_int64_t now, writes;
+   int priority, found_priority = 0;
+   u_int consumed, most = 0;
+
+   /* The previous compaction is still going on */
+   if(ev_compact_step != NULL && event_pending(ev_compact_step, EV_TIMEOUT, NULL))
+      return 0;
+
+   now = mstime();
+   writes = leveldb_writes();
+   maxload = strtoul(configget("compactMaxLoad"), NULL, 10);
+
+   if(last_time > 0 && now > last_time && maxload > 0 &&
+      (writes - last_writes) * 1000 / (now - last_time) > maxload){
+      last_writes = writes;
+      last_time = now;
+      return 0;
+   }
+
+   last_writes = writes;
+   last_time = now;
+
+   threshold = strtoul(configget("compactThreshold"), NULL, 10);
+
+   TAILQ_FOREACH(queue, &queues, entries) {
+      for(priority=0; priority < MAXPRIORITY; priority++){
+         consumed = queue->buckets[priority].read - queue->buckets[priority].compacted;
+         if(consumed >= threshold && consumed > most){
+            found = queue;
+            found_priority = priority;
+            most = consumed;
+         }
+      }
+   }
+
+   if(found != NULL)
+      stomp_compact_bucket(found, found_priority);
+#endif
+
+   return 0;
+}
+
+/*
+ * Called when the output buffer of a client drained, continues
+ * dispatching the queues it is subscribed to.
+ */
+int stomp_resume(struct client *client)
+{
+   struct subscription *subscription, *tmp_subscription;
+
+   for (subscription = TAILQ_FIRST(&client->subscriptions); subscription != NULL; subscription = tmp_subscription) {
+      tmp_subscription = TAILQ_NEXT(subscription, client_entries);
+      if(subscription->browse != NULL)
+         event_active(subscription->browse->ev, EV_TIMEOUT, 0);
+#ifdef WITH_LEVELDB
+      else if(subscription->durable != NULL)
+         durable_resume(subscription);
+#endif
+      else
+         stomp_dispatch(subscription->queue);
+   }
+
+   return 0;
+}
+
+#ifdef WITH_LEVELDB
+/*
+ * Makes room in a full queue by dropping its oldest undelivered
+ * messages, lowest priority first. Only the deliver pointer moves
+ * (and the read pointer if nothing is unacknowledged) and the keys
+ * go away in one write batch per bucket.
+ */
+static void stomp_drop_head(struct queue *queue, u_int incoming, size_t size)
+{
+   struct bucket *bucket;
+   u_int before, length, drop, average, count, from;
+   int priority;
+
+   before = length = stomp_queue_length(queue);
+   if(length == 0)
+      return;
+
+   drop = 0;
+   if(queue->policy->maxlength != 0 && (u_int64_t)length + incoming > queue->policy->maxlength)
+      drop = length + incoming - queue->policy->maxlength;
+
+   /* Sizes of stored messages are not known, the average has to do */
+   if(queue->policy->maxbytes != 0 && queue->bytes + size > queue->policy->maxbytes){
+      average = queue->bytes / length;
+      if(average == 0)
+         average = 1;
+      count = (queue->bytes + size - queue->policy->maxbytes + average - 1) / average;
+      if(count > drop)
+         drop = count;
+   }
+
+   for(priority=0; priority < MAXPRIORITY && drop > 0; priority++){
+      bucket = &queue->buckets[priority];
+
+      count = bucket->write - bucket->deliver;
+      if(count == 0)
+         continue;
+      if(count > drop)
+         count = drop;
+
+      from = bucket->deliver;
+      bucket->deliver += count;
+      bucket->dropped = bucket->deliver;
+      if(bucket->read == from)
+         bucket->read = bucket->deliver;
+      if(bucket->deliver == bucket->write)
+         queue->pending &= ~(1 << priority);
+
+      if(leveldb_drop_messages(queue, priority, from, count) != 0)
+         break;
+
+      drop -= count;
+      length -= count;
+   }
+
+   /* The average of what is left stays the same */
+   queue->bytes = (u_int64_t)queue->bytes * length / before;
+}
+
+/*
+ * Returns 1 if the overflow policy of a full queue refuses count
+ * messages of size bytes in total. Messages released by the
+ * scheduler (client is NULL) are never refused.
+ */
+static int stomp_overflow_refused(struct client *client, struct queue *queue, u_int count, size_t size)
+{
+   if(client == NULL || !stomp_queue_full(queue, count, size))
+      return 0;
+
+   /* Peer links carry other clients as well and are never paused */
+   return queue->policy->overflow == OVERFLOW_REJECT ||
+      (queue->policy->overflow == OVERFLOW_BLOCK && client->peer);
+}
+
+/*
+ * Applies the overflow policy of a queue which reached maxlength or
+ * maxbytes. Returns 1 if the messages must not be stored, see
+ * stomp_overflow_refused().
+ */
+static int stomp_overflow(struct client *client, struct queue *queue, u_int count, size_t size)
+{
+   if(stomp_overflow_refused(client, queue, count, size))
+      return 1;
+
+   if(!stomp_queue_full(queue, count, size))
+      return 0;
+
+   switch(queue->policy->overflow){
+   case OVERFLOW_REJECT:
+      return 0;
+   case OVERFLOW_BLOCK:
+      if(client != NULL)
+         memory_pause(client, queue);
+      return 0;
+   default:
+      stomp_drop_head(queue, count, size);
+      return 0;
+   }
+}
+#endif
+
+/*
+ * Publishes a stored frame to a destination, used for messages
+ * which are released by the scheduler.
+ */
+int stomp_publish(const char *queuename, int priority, char *message)
+{
+   struct evkeyvalq headers;
+   struct queue *queue;
+   char *body;
+   int ret = 0;
+   u_int seq = 0;
+#ifdef WITH_LEVELDB
+   u_int64_t expires;
+#endif
+
+   queue = stomp_find_queue(queuename);
+   if (queue == NULL){
+      if(stomp_is_temporary(queuename))
+         return 1;
+
+      queue = stomp_add_queue(queuename);
+      if(queue == NULL)
+         return 1;
+   }
+
+   TAILQ_INIT(&headers);
+
+   body = stomp_parse_frame(&headers, message);
+   if(body == NULL){
+      evhttp_clear_headers(&headers);
+      return 1;
+   }
+
+   if(queue->topic){
+#ifdef WITH_LEVELDB
+      if(durable_active(queue)){
+         seq = queue->buckets[DURABLE_PRIORITY].write;
+         expires = stomp_message_expires(queue, &headers);
+         if(leveldb_add_message(queue, DURABLE_PRIORITY, expires, message, 0) != 0){
+            evhttp_clear_headers(&headers);
+            return 1;
+         }
+         stomp_message_headers(queue, &headers, DURABLE_PRIORITY, seq, expires);
+      }
+#endif
+      ret = fanout_send(queue, &headers, body, seq);
+   }
+#ifdef WITH_LEVELDB
+   else {
+      stomp_overflow(NULL, queue, 1, strlen(message));
+      ret = leveldb_add_message(queue, priority, stomp_message_expires(queue, &headers), message, 0);
+      if(ret == 0)
+         stomp_dispatch(queue);
+   }
+#endif
+
+   evhttp_clear_headers(&headers);
+
+   return ret;
+}
+
+/*
+ * Looks up an unacknowledged message of the client by message-id.
+ */
+struct inflight* stomp_find_inflight(struct client *client, const char *messageid)
+{
+   struct subscription *subscription;
+   struct inflight *inflight;
+   char queuename[MAXQUEUELEN];
+   int priority;
+   u_int seq;
+
+   if(stomp_parse_messageid(messageid, queuename, sizeof(queuename), &priority, &seq) != 0)
+      return NULL;
+
+   TAILQ_FOREACH(subscription, &client->subscriptions, client_entries) {
+      if(strcmp(subscription->queue->queuename, queuename) != 0 || subscription->route != client->route)
+         continue;
+
+      inflight = stomp_lookup_inflight(subscription->queue, priority, seq);
+      if(inflight != NULL && inflight->subscription == subscription)
+         return inflight;
+   }
+
+   return NULL;
+}
+
+int stomp_ack(struct client *client)
+{
+   struct inflight *inflight;
+   struct queue *queue;
+   const char *messageid;
+   int ret = 0;
+
+   client->req->response_cmd = STOMP_CMD_NONE;
+
+   messageid = evhttp_find_header(client->req->request_headers, "message-id");
+   if(messageid == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Message-id header missing");
+      return 1;
+   }
+
+#ifdef WITH_LEVELDB
+   /* Durable topic subscriptions only move their cursor */
+   if(durable_ack(client, messageid))
+      return 0;
+#endif
+
+   /* Messages of auto acknowledged subscriptions are already gone */
+   inflight = stomp_find_inflight(client, messageid);
+   if(inflight == NULL)
+      return 0;
+
+   queue = inflight->subscription->queue;
+
+   TAILQ_REMOVE(&queue->inflight, inflight, entries);
+   inflight->subscription->inflight--;
+   stomp_untrack_inflight(queue, inflight);
+
+#ifdef WITH_LEVELDB
+   ret = stomp_acknowledge(queue, inflight->priority, inflight->seq, inflight->count > 0, inflight->shared);
+#endif
+   free(inflight);
+
+   /* The subscriber has room for more */
+   stomp_dispatch(queue);
+
+   return ret;
+}
+
+int stomp_nack(struct client *client)
+{
+   struct inflight *inflight;
+   struct queue *queue;
+   const char *messageid;
+
+   client->req->response_cmd = STOMP_CMD_NONE;
+
+   messageid = evhttp_find_header(client->req->request_headers, "message-id");
+   if(messageid == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Message-id header missing");
+      return 1;
+   }
+
+   inflight = stomp_find_inflight(client, messageid);
+   if(inflight == NULL)
+      return 0;
+
+   queue = inflight->subscription->queue;
+
+   if(stomp_redeliver(inflight) != 0)
+      return 1;
+
+   stomp_dispatch(queue);
+
+   return 0;
+}
+
+/*
+ * SEND to a comma separated list of queues or to a composite
+ * destination from the config. The frame is stored once for all
+ * queues with a single write batch, the limits apply per queue.
+ */
+static int stomp_send_composite(struct client *client, const char *members)
+{
+   struct evkeyvalq *headers = client->req->request_headers;
+   struct queue *queues[MAXCOMPOSITE];
+   int memory[MAXCOMPOSITE];
+   char *names, *next, *name;
+   int count = 0, i, ret = 1;
+#ifdef WITH_LEVELDB
+   u_int64_t expires[MAXCOMPOSITE];
+#else
+   struct subscription *subscription;
+#endif
+
+   if(evhttp_find_header(headers, "batch-count") != NULL || evhttp_find_header(headers, DEDUP_HEADER) != NULL
+         || evhttp_find_header(headers, "deliver-at") != NULL || evhttp_find_header(headers, "delay") != NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Not supported on composite destinations");
+      return 1;
+   }
+
+   next = names = strdup(members);
+   if(names == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Out of memory");
+      return 1;
+   }
+
+   while((name = strsep(&next, ",")) != NULL){
+      if(*name == '\0')
+         continue;
+
+      if(count == MAXCOMPOSITE){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Too many destinations");
+         goto out;
+      }
+
+      if(!cluster_local(name)){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Destinations on different nodes");
+         goto out;
+      }
+
+      queues[count] = stomp_find_queue(name);
+      if(queues[count] == NULL){
+         if(stomp_is_temporary(name)){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Temporary destination does not exist");
+            goto out;
+         }
+
+         queues[count] = stomp_add_queue(name);
+         if(queues[count] == NULL){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Creating destination failed");
+            goto out;
+         }
+      }
+
+      if(queues[count]->topic){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Composite destinations take queues only");
+         goto out;
+      }
+
+      count++;
+   }
+
+   if(count == 0){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Destination header missing");
+      goto out;
+   }
+
+   for(i = 0; i < count; i++){
+      memory[i] = memory_check(client, queues[i]);
+      if(memory[i] == MEMORY_REJECT){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Memory limit exceeded");
+         goto out;
+      }
+   }
+
+#ifdef WITH_LEVELDB
+   /* Taken by all queues or refused, nothing is dropped or paused
+    * before every queue accepted */
+   for(i = 0; i < count; i++){
+      if(stomp_overflow_refused(client, queues[i], 1, strlen(client->req->request))){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Queue is full");
+         goto out;
+      }
+   }
+
+   for(i = 0; i < count; i++)
+      stomp_overflow(client, queues[i], 1, strlen(client->req->request));
+#endif
+
+   for(i = 0; i < count; i++){
+      if(memory[i] == MEMORY_FLOW)
+         memory_pause(client, queues[i]);
+      ratelimit_check(client, queues[i], 1, strlen(client->req->request));
+   }
+
+   client->req->response_cmd = STOMP_CMD_NONE;
+   client->req->response = NULL;
+   ret = 0;
+
+#ifdef WITH_LEVELDB
+   for(i = 0; i < count; i++)
+      expires[i] = stomp_message_expires(queues[i], headers);
+
+   if(leveldb_add_shared(queues, expires, count, stomp_message_priority(headers), client->req->request) != 0){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Storing message failed");
+      ret = 1;
+      goto out;
+   }
+
+   for(i = 0; i < count; i++)
+      stomp_dispatch(queues[i]);
+#else
+   evhttp_add_header(headers, "original-destination", evhttp_find_header(headers, "destination"));
+
+   for(i = 0; i < count; i++){
+      evhttp_remove_header(headers, "destination");
+      evhttp_add_header(headers, "destination", queues[i]->queuename);
+
+      subscription = stomp_next_subscriber(queues[i]);
+      if(subscription != NULL)
+         stomp_deliver(subscription, headers, client->req->request_body);
+   }
+#endif
+
+out:
+   free(names);
+
+   return ret;
+}
+
+/*
+ * SEND with a batch-count header is a batch of that many messages
+ * with the same headers. Its body holds them one after the other as
+ * "<length>\n<body>\n". A batch is stored with one write batch and
+ * confirmed with one RECEIPT, dedup-id and the limits apply to it as
+ * a whole.
+ */
+int stomp_send(struct client *client)
+{
+   struct queue *queue;
+   const char *queuename, *members, *batch;
+   char *head = NULL, **bodies;
+   int count = 1, i, ret = 0;
+   u_int64_t dedup;
+   size_t size;
+#ifdef WITH_LEVELDB
+   u_int64_t deliver_at, expires;
+   char *message, **messages;
+   u_int seq;
+#else
+   struct subscription *subscription;
+   u_int seq = 0;
+#endif
+
+   queuename = evhttp_find_header(client->req->request_headers, "destination");
+   if(queuename == NULL){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Destination header missing");
+      return 1;
+   }
+
+   members = stomp_composite(queuename);
+   if(members != NULL)
+      return stomp_send_composite(client, members);
+
+   queue = stomp_find_queue(queuename);
+   if (queue == NULL){
+      /* Temporary destinations are created by their subscriber */
+      if(stomp_is_temporary(queuename)){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Temporary destination does not exist");
+         return 1;
+      }
+
+      queue = stomp_add_queue(queuename);
+      if(queue == NULL){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Creating destination failed");
+         return 1;
+      }
+   }
+
+   bodies = &client->req->request_body;
+
+   /* A batch SEND carries count messages with the same headers */
+   batch = evhttp_find_header(client->req->request_headers, "batch-count");
+   if(batch != NULL){
+      count = atoi(batch);
+      if(count < 1 || client->req->request_body == NULL || count > strlen(client->req->request_body) / 3 ||
+            (bodies = calloc(count, sizeof(*bodies))) == NULL){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Invalid batch-count");
+         return 1;
+      }
+
+      if(stomp_parse_batch(client->req->request_body, count, bodies) != 0){
+         free(bodies);
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Malformed batch");
+         return 1;
+      }
+
+      evhttp_remove_header(client->req->request_headers, "batch-count");
+      evhttp_remove_header(client->req->request_headers, "content-length");
+
+      /* Stored messages are the head plus their body */
+      head = stomp_frame_head(client->req->request_headers);
+      if(head == NULL){
+         client->req->response_cmd = STOMP_CMD_ERROR;
+         evhttp_add_header(client->req->response_headers, "message", "Out of memory");
+         ret = 1;
+         goto out;
+      }
+   }
+
+   /* The bodies of a batch are split up in place, its size counts all */
+   if(head != NULL){
+      size = 0;
+      for(i = 0; i < count; i++)
+         size += strlen(head) + strlen(bodies[i]);
+   }
+   else
+      size = strlen(client->req->request);
+
+   /* A retry of a message which was taken is confirmed once more */
+   dedup = dedup_id(queue, client->req->request_headers);
+   if(dedup != 0 && dedup_find(queue, dedup)){
+      loginfo("Dropped duplicate %s on %s", evhttp_find_header(client->req->request_headers, DEDUP_HEADER), queuename);
+      client->req->response_cmd = STOMP_CMD_NONE;
+      client->req->response = NULL;
+      goto out;
+   }
+
+   switch(memory_check(client, queue)){
+   case MEMORY_REJECT:
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Memory limit exceeded");
+      ret = 1;
+      goto out;
+   case MEMORY_FLOW:
+      /* This message is taken, the next ones wait */
+      memory_pause(client, queue);
+      break;
+   }
+
+   /* Taken as well, a throttled producer is read again later */
+   ratelimit_check(client, queue, count, size);
+
+   client->req->response_cmd = STOMP_CMD_NONE;
+   client->req->response = NULL;
+
+#ifdef WITH_LEVELDB
+   /* A single message is stored as the whole frame */
+   messages = (head != NULL) ? bodies : &client->req->request;
+
+   deliver_at = schedule_deliver_at(client->req->request_headers);
+   if(deliver_at > mstime()){
+      for(i = 0; i < count && ret == 0; i++){
+         message = messages[i];
+         if(head != NULL && (message = malloc(strlen(head)+strlen(bodies[i])+1)) != NULL)
+            strcat(strcpy(message, head), bodies[i]);
+
+         if(message == NULL || schedule_message(queuename, stomp_message_priority(client->req->request_headers), deliver_at, message) != 0){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Scheduling message failed");
+            ret = 1;
+         }
+
+         if(message != messages[i])
+            free(message);
+      }
+
+      /* Only kept in memory, the scheduled message is stored without its id */
+      if(ret == 0 && dedup != 0)
+         dedup_add(queue, dedup, 0);
+
+      goto out;
+   }
+#endif
+
+   if(queue->topic){
+#ifdef WITH_LEVELDB
+      /* Kept once in the topic log for durable subscriptions */
+      seq = 0;
+      if(durable_active(queue)){
+         seq = queue->buckets[DURABLE_PRIORITY].write;
+         expires = stomp_message_expires(queue, client->req->request_headers);
+         if(leveldb_add_messages(queue, DURABLE_PRIORITY, expires, head != NULL ? head : "", messages, count, dedup) != 0){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Storing message failed");
+            ret = 1;
+            goto out;
+         }
+      }
+#endif
+
+      /* Send it out to all subscribers, to many of them in slices */
+      for(i = 0; i < count && ret == 0; i++){
+#ifdef WITH_LEVELDB
+         if(seq != 0)
+            stomp_message_headers(queue, client->req->request_headers, DURABLE_PRIORITY, seq+i, expires);
+#endif
+         if(fanout_send(queue, client->req->request_headers, bodies[i], seq != 0 ? seq+i : 0) != 0){
+            client->req->response_cmd = STOMP_CMD_ERROR;
+            evhttp_add_header(client->req->response_headers, "message", "Sending message failed");
+            ret = 1;
+         }
+      }
+
+      /* Stored with the message if the topic keeps a log */
+      if(ret == 0 && dedup != 0)
+         dedup_add(queue, dedup, seq != 0);
+
+      goto out;
+   }
+
+#ifdef WITH_LEVELDB
+   /* A batch is taken or refused as a whole */
+   if(stomp_overflow(client, queue, count, size)){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Queue is full");
+      ret = 1;
+      goto out;
+   }
+
+   if(leveldb_add_messages(queue, stomp_message_priority(client->req->request_headers),
+         stomp_message_expires(queue, client->req->request_headers), head != NULL ? head : "", messages, count, dedup) != 0){
+      client->req->response_cmd = STOMP_CMD_ERROR;
+      evhttp_add_header(client->req->response_headers, "message", "Storing message failed");
+      ret = 1;
+      goto out;
+   }
+
+   if(dedup != 0)
+      dedup_add(queue, dedup, 1);
+
+   stomp_dispatch(queue);
+#else
+   /* Without storage a queue message goes to one subscriber or is lost */
+   for(i = 0; i < count; i++){
+      subscription = stomp_next_subscriber(queue);
+      if(subscription != NULL)
+         stomp_deliver(subscription, client->req->request_headers, bodies[i]);
+   }
+
+   if(dedup != 0)
+      dedup_add(queue, dedup, 0);
+#endif
+
+out:
+   if(batch != NULL){
+      free(bodies);
+      free(head);
+   }
+
+   return ret;
+}
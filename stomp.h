@@ -33,6 +33,11 @@
 #define MAXQUEUELEN	128
 #define MAXHEADERLEN	512
 #define MAXREQUESTLEN	10240
+#define MAXOUTPUTBUF	65536
+#define MAXCOMPOSITE	16
+
+#define DEFAULTPRIORITY	4
+#define DEFAULTPREFETCH	100
 
 enum stomp_direction {
    STOMP_IN = 1,
@@ -48,6 +53,7 @@ enum stomp_cmd {
    STOMP_CMD_SUBSCRIBE,
    STOMP_CMD_UNSUBSCRIBE,
    STOMP_CMD_ACK,
+   STOMP_CMD_NACK,
    STOMP_CMD_RECEIPT,
    STOMP_CMD_DISCONNECT,
    STOMP_CMD_ERROR
@@ -56,7 +62,24 @@ enum stomp_cmd {
 extern int stomp_connect(struct client *client);
 extern int stomp_disconnect(struct client *client);
 extern int stomp_subscribe(struct client *client);
+extern int stomp_unsubscribe(struct client *client);
+extern int stomp_browse(struct client *client, struct queue *queue);
 extern int stomp_send(struct client *client);
+extern int stomp_ack(struct client *client);
+extern int stomp_nack(struct client *client);
+
+extern int stomp_deliver(struct subscription *subscription, struct evkeyvalq *headers, char *body);
+extern int stomp_dispatch(struct queue *queue);
+extern int stomp_deliver_stored(struct subscription *subscription, int priority, u_int seq);
+extern int stomp_dispatch_message(struct queue *queue, struct subscription *subscription, int priority, u_int seq, struct inflight *inflight, u_int64_t now);
+extern int stomp_acknowledge(struct queue *queue, int priority, u_int seq, int redelivered, u_int64_t shared);
+extern void stomp_redeliver_init(void);
+extern int stomp_redeliver(struct inflight *inflight);
+extern struct inflight* stomp_find_inflight(struct client *client, const char *messageid);
+extern int stomp_expire(void);
+extern int stomp_compact(void);
+extern int stomp_publish(const char *queuename, int priority, char *message);
+extern int stomp_resume(struct client *client);
 
 extern int stomp_handle_request(struct client *client);
 extern int stomp_handle_response(struct client *client);
@@ -26,7 +26,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <event2/event.h>
@@ -37,23 +39,51 @@
 
 #include "client.h"
 #include "log.h"
+#include "util.h"
 #include "stomp.h"
 #include "stomputil.h"
 #include "leveldb.h"
+#include "replication.h"
+#include "cluster.h"
+#include "memory.h"
+#include "ratelimit.h"
+#include "capture.h"
+#include "dedup.h"
+#include "fanout.h"
+#include "durable.h"
+#include "probes.h"
+#ifdef WITH_URING
+#include "uring.h"
+#endif
 
 
 struct queue* stomp_add_queue(const char *queuename)
 {
    struct queue *entry;
+   int priority;
    
    if(queuename == NULL || strlen(queuename) >= MAXQUEUELEN)
       return NULL;
+
+   /* Other key prefixes are reserved for internal use by the storage */
+   if(queuename[0] != '/')
+      return NULL;
          
-   entry = malloc(sizeof(*entry));
+   entry = calloc(1, sizeof(*entry));
    entry->queuename = malloc(strlen(queuename)+1);
    strcpy(entry->queuename, queuename);
  
+   entry->policy = policyfind(queuename);
+   entry->topic = strncmp(queuename, "/topic/", 7) == 0 || strncmp(queuename, "/temp-topic/", 12) == 0;
+   entry->used = mstime();
+
    TAILQ_INIT(&entry->subscribers);
+   TAILQ_INIT(&entry->inflight);
+   TAILQ_INIT(&entry->redeliver);
+   for(priority=0; priority < MAXPRIORITY; priority++)
+      TAILQ_INIT(&entry->buckets[priority].unacked);
+   TAILQ_INIT(&entry->fanouts);
+   TAILQ_INIT(&entry->durables);
    TAILQ_INSERT_TAIL(&queues, entry, entries);
 
 #ifdef WITH_LEVELDB
@@ -61,9 +91,6 @@ struct queue* stomp_add_queue(const char *queuename)
       stomp_free_queue(entry);
       return NULL;
    }
-#else
-   entry->read = 1;
-   entry->write = 1;
 #endif
        
    return entry;
@@ -75,6 +102,7 @@ struct queue* stomp_find_queue(const char *queuename)
 
    TAILQ_FOREACH(queue, &queues, entries) {
       if(strcmp(queue->queuename, queuename) == 0){
+         stomp_touch_queue(queue, mstime());
          return queue;
       }
    }
@@ -82,33 +110,637 @@ struct queue* stomp_find_queue(const char *queuename)
    return NULL;
 }
 
+/*
+ * Moves a queue to the end of the queue list, which is thereby
+ * ordered by last use.
+ */
+void stomp_touch_queue(struct queue *queue, u_int64_t now)
+{
+   queue->used = now;
+
+   TAILQ_REMOVE(&queues, queue, entries);
+   TAILQ_INSERT_TAIL(&queues, queue, entries);
+}
+
+int stomp_is_temporary(const char *queuename)
+{
+   return strncmp(queuename, "/temp-queue/", 12) == 0 || strncmp(queuename, "/temp-topic/", 12) == 0;
+}
+
+/*
+ * Returns the comma separated queues a destination stands for, or
+ * NULL if it is a single destination.
+ */
+const char* stomp_composite(const char *destination)
+{
+   if(strchr(destination, ',') != NULL)
+      return destination;
+
+   return compositefind(destination);
+}
+
+/*
+ * Whether a queue holds nothing but what can be loaded again from
+ * the storage.
+ */
+static int stomp_queue_idle(struct queue *queue)
+{
+   return TAILQ_EMPTY(&queue->subscribers) && TAILQ_EMPTY(&queue->inflight) && TAILQ_EMPTY(&queue->redeliver)
+      && queue->pending == 0 && queue->memory == 0 && !queue->spilled && queue->owner == NULL;
+}
+
+/*
+ * Frees queues which were not used for idleTimeout milliseconds and
+ * are idle. Busy ones are moved to the end of the list, so only the
+ * head of the list has to be looked at.
+ */
+int stomp_evict_queues(void)
+{
+   struct queue *queue;
+   u_int64_t now, timeout;
+   int count = 0;
+
+   timeout = strtoull(configget("idleTimeout"), NULL, 10);
+   if(timeout == 0)
+      return 0;
+
+   now = mstime();
+
+   while((queue = TAILQ_FIRST(&queues)) != NULL && queue->used + timeout <= now){
+      if(stomp_queue_idle(queue)){
+         stomp_free_queue(queue);
+         count++;
+      }
+      else
+         stomp_touch_queue(queue, now);
+   }
+
+   if(count > 0)
+      loginfo("Evicted %d idle destinations", count);
+
+   return count;
+}
+
+/*
+ * Removes a destination together with everything stored for it.
+ */
+void stomp_delete_queue(struct queue *queue)
+{
+   struct subscription *subscription;
+
+   /* Before the storage is cleared, this may record redeliveries */
+   while((subscription = TAILQ_FIRST(&queue->subscribers)) != NULL)
+      stomp_free_subscription(subscription);
+
+#ifdef WITH_LEVELDB
+   if(!queue->topic)
+      leveldb_purge_queue(queue);
+#endif
+
+   stomp_free_queue(queue);
+}
+
+/*
+ * Deletes the temporary destinations of a client, of one of its
+ * routes or with route 0 of all routes of a peer link.
+ */
+void stomp_free_temporary(struct client *client, u_int route)
+{
+   struct queue *queue, *tmp_queue;
+
+   for(queue = TAILQ_FIRST(&queues); queue != NULL; queue = tmp_queue){
+      tmp_queue = TAILQ_NEXT(queue, entries);
+      if(queue->owner == client && (route == 0 || queue->owner_route == route))
+         stomp_delete_queue(queue);
+   }
+}
+
 void stomp_free_queue(struct queue *queue)
 {
-   /* TODO: Remove subscriptions */
+   struct subscription *subscription;
+   struct inflight *inflight;
+
+   while((subscription = TAILQ_FIRST(&queue->subscribers)) != NULL)
+      stomp_free_subscription(subscription);
+
+   /* Unacknowledged messages stay in storage for the next load */
+   while((inflight = TAILQ_FIRST(&queue->redeliver)) != NULL){
+      TAILQ_REMOVE(&queue->redeliver, inflight, entries);
+      free(inflight);
+   }
+
+   if(queue->ev_redeliver != NULL)
+      event_free(queue->ev_redeliver);
+   free(queue->index);
+
+   memory_forget_queue(queue);
+   dedup_free(queue);
+   fanout_forget_queue(queue);
+#ifdef WITH_LEVELDB
+   durable_forget_queue(queue);
+#endif
 
    TAILQ_REMOVE(&queues, queue, entries);
+   free(queue->queuename);
    free(queue);
 }
 
-void stomp_free_client(struct client *client)
-{        
+/*
+ * Unacknowledged messages are kept in a chained hash table by
+ * priority and sequence for ACK and NACK, and per bucket in sequence
+ * order, so the lowest one is the first.
+ */
+static u_int stomp_inflight_slot(u_int size, int priority, u_int seq)
+{
+   return ((seq * 2654435761U) ^ priority) & (size - 1);
+}
+
+static int stomp_grow_index(struct queue *queue)
+{
+   struct inflight **index, *inflight, *next;
+   u_int size, i, slot;
+
+   size = queue->index_size ? queue->index_size * 2 : 64;
+   index = calloc(size, sizeof(*index));
+   if(index == NULL)
+      return 1;
+
+   for(i = 0; i < queue->index_size; i++){
+      for(inflight = queue->index[i]; inflight != NULL; inflight = next){
+         next = inflight->index_next;
+         slot = stomp_inflight_slot(size, inflight->priority, inflight->seq);
+         inflight->index_next = index[slot];
+         index[slot] = inflight;
+      }
+   }
+
+   free(queue->index);
+   queue->index = index;
+   queue->index_size = size;
+
+   return 0;
+}
+
+/*
+ * Starts tracking a delivered message until it is acknowledged.
+ */
+void stomp_track_inflight(struct queue *queue, struct inflight *inflight)
+{
+   struct bucket *bucket = &queue->buckets[inflight->priority];
+   struct inflight *entry;
+   u_int slot;
+
+   if(queue->index_count >= queue->index_size && stomp_grow_index(queue) != 0)
+      logerror("Growing the inflight index of %s failed", queue->queuename);
+
+   if(queue->index_size > 0){
+      slot = stomp_inflight_slot(queue->index_size, inflight->priority, inflight->seq);
+      inflight->index_next = queue->index[slot];
+      queue->index[slot] = inflight;
+      queue->index_count++;
+   }
+
+   /* New messages come in order, only restored ones are sorted in */
+   TAILQ_FOREACH_REVERSE(entry, &bucket->unacked, inflightq, bucket_entries) {
+      if(entry->seq - bucket->read < inflight->seq - bucket->read)
+         break;
+   }
+
+   if(entry == NULL)
+      TAILQ_INSERT_HEAD(&bucket->unacked, inflight, bucket_entries);
+   else
+      TAILQ_INSERT_AFTER(&bucket->unacked, entry, inflight, bucket_entries);
+}
+
+void stomp_untrack_inflight(struct queue *queue, struct inflight *inflight)
+{
+   struct inflight **link;
+
+   if(inflight == NULL)
+      return;
+
+   if(queue->index_size > 0){
+      link = &queue->index[stomp_inflight_slot(queue->index_size, inflight->priority, inflight->seq)];
+      while(*link != NULL && *link != inflight)
+         link = &(*link)->index_next;
+
+      if(*link != NULL){
+         *link = inflight->index_next;
+         queue->index_count--;
+      }
+   }
+
+   TAILQ_REMOVE(&queue->buckets[inflight->priority].unacked, inflight, bucket_entries);
+}
+
+struct inflight* stomp_lookup_inflight(struct queue *queue, int priority, u_int seq)
+{
+   struct inflight *inflight;
+
+   if(queue->index_size == 0)
+      return NULL;
+
+   inflight = queue->index[stomp_inflight_slot(queue->index_size, priority, seq)];
+   while(inflight != NULL && (inflight->priority != priority || inflight->seq != seq))
+      inflight = inflight->index_next;
+
+   return inflight;
+}
+
+/*
+ * Number of undelivered messages of a queue.
+ */
+u_int stomp_queue_length(struct queue *queue)
+{
+   u_int length = 0;
+   int priority;
+
+   for(priority=0; priority < MAXPRIORITY; priority++)
+      length += queue->buckets[priority].write - queue->buckets[priority].deliver;
+
+   return length;
+}
+
+/*
+ * Whether a queue has no room for count more messages of the given
+ * total size under the maxlength and maxbytes limits of its policy.
+ */
+int stomp_queue_full(struct queue *queue, u_int count, size_t size)
+{
+   if(queue->policy->maxlength != 0 && (u_int64_t)stomp_queue_length(queue) + count > queue->policy->maxlength)
+      return 1;
+
+   if(queue->policy->maxbytes != 0 && queue->bytes + size > queue->policy->maxbytes)
+      return 1;
+
+   return 0;
+}
+
+/*
+ * Returns the highest priority with pending messages or -1 if the
+ * queue is empty.
+ */
+int stomp_queue_priority(struct queue *queue)
+{
+   int priority;
+
+   if(queue->pending == 0)
+      return -1;
+
+   for(priority=MAXPRIORITY-1; priority >= 0; priority--){
+      if(queue->pending & (1 << priority))
+         return priority;
+   }
+
+   return -1;
+}
+
+/*
+ * Returns the priority of a message from its priority header,
+ * clamped to the available priority buckets.
+ */
+int stomp_message_priority(struct evkeyvalq *headers)
+{
+   const char *value;
+   int priority;
+
+   value = evhttp_find_header(headers, "priority");
+   if(value == NULL)
+      return DEFAULTPRIORITY;
+
+   priority = atoi(value);
+   if(priority < 0)
+      return 0;
+
+   if(priority >= MAXPRIORITY)
+      return MAXPRIORITY-1;
+
+   return priority;
+}
+
+/*
+ * Returns the expiration time of a message from its expires header
+ * or the time to live of the destination, whichever is earlier.
+ */
+u_int64_t stomp_message_expires(struct queue *queue, struct evkeyvalq *headers)
+{
+   const char *value;
+   u_int64_t expires = 0;
+
+   value = evhttp_find_header(headers, "expires");
+   if(value != NULL)
+      expires = strtoull(value, NULL, 10);
+
+   if(queue->policy->ttl != 0){
+      if(expires == 0 || mstime() + queue->policy->ttl < expires)
+         expires = mstime() + queue->policy->ttl;
+   }
+
+   return expires;
+}
+
+/*
+ * Splits a message-id of the form queuename.priority.sequence.
+ */
+int stomp_parse_messageid(const char *messageid, char *queuename, size_t queuename_len, int *priority, u_int *seq)
+{
+   const char *dot_seq, *dot_priority;
+
+   dot_seq = strrchr(messageid, '.');
+   if(dot_seq == NULL || dot_seq == messageid)
+      return 1;
+
+   for(dot_priority = dot_seq-1; dot_priority > messageid && *dot_priority != '.'; dot_priority--);
+   if(*dot_priority != '.' || (size_t)(dot_priority-messageid) >= queuename_len)
+      return 1;
+
+   memcpy(queuename, messageid, dot_priority-messageid);
+   queuename[dot_priority-messageid] = '\0';
+
+   *priority = atoi(dot_priority+1);
+   *seq = strtoul(dot_seq+1, NULL, 10);
+
+   if(*priority < 0 || *priority >= MAXPRIORITY)
+      return 1;
+
+   return 0;
+}
+
+struct subscription* stomp_add_subscription(struct client *client, struct queue *queue)
+{
+   struct subscription *subscription;
+
+   subscription = stomp_find_subscription(client, queue);
+   if(subscription != NULL)
+      return subscription;
+
+   subscription = calloc(1, sizeof(*subscription));
+   if(subscription == NULL)
+      return NULL;
+
+   subscription->client = client;
+   subscription->queue = queue;
+   subscription->route = client->route;
+   fanout_subscribe(subscription);
+
+   TAILQ_INSERT_TAIL(&queue->subscribers, subscription, entries);
+   TAILQ_INSERT_TAIL(&client->subscriptions, subscription, client_entries);
+
+   return subscription;
+}
+
+struct subscription* stomp_find_subscription(struct client *client, struct queue *queue)
+{
+   struct subscription *subscription;
+
+   TAILQ_FOREACH(subscription, &client->subscriptions, client_entries) {
+      if(subscription->queue == queue && subscription->route == client->route)
+         return subscription;
+   }
+
+   return NULL;
+}
+
+void stomp_free_subscription(struct subscription *subscription)
+{
+   struct inflight *inflight, *tmp_inflight;
+
+   /* Unacknowledged messages go back to the queue */
+   for (inflight = TAILQ_FIRST(&subscription->queue->inflight); inflight != NULL; inflight = tmp_inflight) {
+      tmp_inflight = TAILQ_NEXT(inflight, entries);
+      if(inflight->subscription == subscription)
+         stomp_redeliver(inflight);
+   }
+
+   if(subscription->browse != NULL){
+      if(subscription->browse->ev != NULL)
+         event_free(subscription->browse->ev);
+#ifdef WITH_LEVELDB
+      leveldb_cursor_close(subscription->browse->cursor);
+#endif
+      free(subscription->browse);
+   }
+
+   fanout_unsubscribe(subscription);
+#ifdef WITH_LEVELDB
+   durable_unsubscribe(subscription);
+#endif
+
+   TAILQ_REMOVE(&subscription->queue->subscribers, subscription, entries);
+   TAILQ_REMOVE(&subscription->client->subscriptions, subscription, client_entries);
+   free(subscription);
+}
+
+/*
+ * Picks the next subscriber of a queue in round robin order which
+ * still has room in its output buffer.
+ */
+struct subscription* stomp_next_subscriber(struct queue *queue)
+{
+   struct subscription *subscription;
+
+   TAILQ_FOREACH(subscription, &queue->subscribers, entries) {
+      if(subscription->browse != NULL)
+         continue;
+
+      if(subscription->ack == ACK_CLIENT && subscription->inflight >= subscription->prefetch)
+         continue;
+
+      if(stomp_output_length(subscription->client) >= MAXOUTPUTBUF)
+         continue;
+
+      TAILQ_REMOVE(&queue->subscribers, subscription, entries);
+      TAILQ_INSERT_TAIL(&queue->subscribers, subscription, entries);
+      return subscription;
+   }
+
+   return NULL;
+}
+
+/*
+ * Logs a client out after cmd (STOMP_CMD_ERROR or _DISCONNECT) was
+ * sent, with STOMP_CMD_DISCONNECT the client is freed as well.
+ */
+void stomp_free_client(struct client *client, int cmd)
+{
+   struct subscription *subscription;
+
+   /* Errors for clients of other nodes keep the peer link */
+   if(client->peer && cmd != STOMP_CMD_DISCONNECT)
+      return;
+
    /* Error/Logout */
    logwarn("Logout Client %d", client->fd);
 
    client->authenticated = 0;
-   /* TODO: remove all subscriptions */
          
    /* Disconnect/Free */
-   if(client->response_cmd == STOMP_CMD_DISCONNECT){
+   if(cmd == STOMP_CMD_DISCONNECT){
+#ifdef WITH_LEVELDB
+      replication_free_client(client);
+#endif
+      cluster_free_client(client);
+
+      while((subscription = TAILQ_FIRST(&client->subscriptions)) != NULL)
+         stomp_free_subscription(subscription);
+
+      stomp_free_temporary(client, 0);
+
       /* TODO: free all allocated memory */
       TAILQ_REMOVE(&clients, client, entries);
 
+      stomp_uncork(client);
+      if(client->cork != NULL)
+         evbuffer_free(client->cork);
+      memory_free_client(client);
+      ratelimit_free_client(client);
+      capture_close(client);
+
       bufferevent_free(client->bev);
+#ifdef WITH_URING
+      uring_close(client->fd);
+#endif
       close(client->fd);
       free(client);
    }
 }
 
+/*
+ * Output of all clients is corked: frames are collected per client
+ * and handed to the bufferevent once at the end of the event loop
+ * iteration, after corkDelay milliseconds at the latest or as soon as
+ * corkBytes are pending. The socket then sees one gathered write
+ * instead of one per frame.
+ */
+static TAILQ_HEAD(, client) corked = TAILQ_HEAD_INITIALIZER(corked);
+static struct event *ev_uncork;
+static struct event *ev_cork_idle;
+static size_t cork_bytes;
+static struct timeval cork_delay;
+
+static void stomp_on_uncork(int fd, short ev, void *arg)
+{
+   struct client *client;
+
+   while((client = TAILQ_FIRST(&corked)) != NULL)
+      stomp_uncork(client);
+}
+
+/*
+ * Releases the cork buffers of connections which wrote nothing since
+ * the last run.
+ */
+static void stomp_on_cork_idle(int fd, short ev, void *arg)
+{
+   struct client *client;
+
+   TAILQ_FOREACH(client, &clients, entries) {
+      if(client->cork == NULL || client->corked)
+         continue;
+
+      if(client->cork_used)
+         client->cork_used = 0;
+      else {
+         evbuffer_free(client->cork);
+         client->cork = NULL;
+      }
+   }
+}
+
+int stomp_cork_init(struct event_base *base)
+{
+   struct timeval idle = { 1, 0 };
+   u_int delay;
+
+   cork_bytes = strtoul(configget("corkBytes"), NULL, 10);
+
+   delay = strtoul(configget("corkDelay"), NULL, 10);
+   cork_delay.tv_sec = delay / 1000;
+   cork_delay.tv_usec = (delay % 1000) * 1000;
+
+   ev_uncork = evtimer_new(base, stomp_on_uncork, NULL);
+   ev_cork_idle = event_new(base, -1, EV_PERSIST, stomp_on_cork_idle, NULL);
+   if(ev_uncork == NULL || ev_cork_idle == NULL || event_add(ev_cork_idle, &idle) != 0)
+      return 1;
+
+   return 0;
+}
+
+void stomp_cork_free(void)
+{
+   stomp_on_uncork(-1, 0, NULL);
+   event_free(ev_uncork);
+   event_free(ev_cork_idle);
+}
+
+void stomp_uncork(struct client *client)
+{
+   if(client->corked == 0)
+      return;
+
+   TAILQ_REMOVE(&corked, client, cork_entries);
+   client->corked = 0;
+
+   REDQ_PROBE2(flush, client->fd, evbuffer_get_length(client->cork));
+   bufferevent_write_buffer(client->bev, client->cork);
+}
+
+void stomp_write_buffer(struct client *client, struct evbuffer *buffer)
+{
+   /* Nothing can be sent anymore, the read side sees the close */
+   if(client->cork == NULL && (client->cork = evbuffer_new()) == NULL){
+      logerror("Client %d output buffer could not be allocated, disconnecting", client->fd);
+      shutdown(client->fd, SHUT_RDWR);
+      return;
+   }
+
+   client->cork_used = 1;
+
+   memory_charge(client, evbuffer_get_length(buffer));
+   evbuffer_add_buffer(client->cork, buffer);
+
+   if(client->corked == 0){
+      TAILQ_INSERT_TAIL(&corked, client, cork_entries);
+      client->corked = 1;
+   }
+
+   if(evbuffer_get_length(client->cork) >= cork_bytes){
+      stomp_uncork(client);
+      return;
+   }
+
+   if(!evutil_timerisset(&cork_delay))
+      event_active(ev_uncork, EV_TIMEOUT, 0);
+   else if(!event_pending(ev_uncork, EV_TIMEOUT, NULL))
+      evtimer_add(ev_uncork, &cork_delay);
+}
+
+void stomp_write(struct client *client, const void *data, size_t len)
+{
+   struct evbuffer *buffer;
+
+   buffer = evbuffer_new();
+   if(buffer == NULL)
+      return;
+
+   evbuffer_add(buffer, data, len);
+   stomp_write_buffer(client, buffer);
+   evbuffer_free(buffer);
+}
+
+/*
+ * Pending output of a client, corked or not.
+ */
+size_t stomp_output_length(struct client *client)
+{
+   size_t len = evbuffer_get_length(bufferevent_get_output(client->bev));
+
+   if(client->cork != NULL)
+      len += evbuffer_get_length(client->cork);
+
+   return len;
+}
+
 int stomp_parse_headers(struct evkeyvalq *headers, char *request)
 {
    char *line;
@@ -124,6 +756,12 @@ int stomp_parse_headers(struct evkeyvalq *headers, char *request)
       skey = NULL;
       svalue = NULL;
 
+      /* Headers end with the first empty line */
+      if(line_length == 0){
+         free(line);
+         break;
+      }
+
       if(line_length > MAXHEADERLEN){
          free(line);
          evbuffer_free(buffer);
@@ -163,3 +801,92 @@ int stomp_parse_headers(struct evkeyvalq *headers, char *request)
    return 0;
 }
 
+/*
+ * Parses a stored STOMP frame into headers and returns a pointer
+ * to the body within the frame.
+ */
+char* stomp_parse_frame(struct evkeyvalq *headers, char *frame)
+{
+   char *body;
+
+   while(*frame == '\r' || *frame == '\n')
+      frame++;
+
+   if(stomp_parse_headers(headers, frame) != 0)
+      return NULL;
+
+   if((body = strstr(frame, "\r\n\r\n")) != NULL)
+      return body+4;
+
+   if((body = strstr(frame, "\n\n")) != NULL)
+      return body+2;
+
+   return frame+strlen(frame);
+}
+
+/*
+ * Splits the body of a batch SEND into its count messages, each of
+ * them given as "<length>\n<body>\n". The newline after a body is
+ * replaced by its terminating NUL.
+ */
+int stomp_parse_batch(char *body, int count, char **bodies)
+{
+   char *end, *body_end = body+strlen(body);
+   u_long length;
+   int i;
+
+   for(i = 0; i < count; i++){
+      if(*body < '0' || *body > '9')
+         return 1;
+
+      errno = 0;
+      length = strtoul(body, &end, 10);
+      if(errno == ERANGE || *end != '\n')
+         return 1;
+
+      /* The body and the newline after it have to be there */
+      if(length >= (u_long)(body_end - (end+1)) || end[length+1] != '\n')
+         return 1;
+
+      bodies[i] = end+1;
+      bodies[i][length] = '\0';
+      body = end+length+2;
+   }
+
+   return *body != '\0';
+}
+
+/*
+ * A SEND frame with the given headers up to the body.
+ */
+char* stomp_frame_head(struct evkeyvalq *headers)
+{
+   struct evkeyval *header;
+   struct evbuffer *buffer;
+   char *head;
+   size_t length;
+
+   buffer = evbuffer_new();
+   if(buffer == NULL)
+      return NULL;
+
+   evbuffer_add_printf(buffer, "SEND\n");
+
+   TAILQ_FOREACH(header, headers, next) {
+      evbuffer_add_printf(buffer, "%s:%s\n", header->key, header->value);
+   }
+
+   evbuffer_add(buffer, "\n", 1);
+
+   length = evbuffer_get_length(buffer);
+   head = malloc(length+1);
+   if(head != NULL){
+      evbuffer_remove(buffer, head, length);
+      head[length] = '\0';
+   }
+
+   evbuffer_free(buffer);
+
+   return head;
+}
+
@@ -30,8 +30,39 @@
 extern struct queue* stomp_add_queue(const char *queuename);
 extern struct queue* stomp_find_queue(const char *queuename);
 extern void stomp_free_queue(struct queue *queue);
+extern void stomp_touch_queue(struct queue *queue, u_int64_t now);
+extern int stomp_is_temporary(const char *queuename);
+extern const char* stomp_composite(const char *destination);
+extern void stomp_track_inflight(struct queue *queue, struct inflight *inflight);
+extern void stomp_untrack_inflight(struct queue *queue, struct inflight *inflight);
+extern struct inflight* stomp_lookup_inflight(struct queue *queue, int priority, u_int seq);
+extern int stomp_evict_queues(void);
+extern void stomp_delete_queue(struct queue *queue);
+extern void stomp_free_temporary(struct client *client, u_int route);
+extern int stomp_queue_priority(struct queue *queue);
+extern u_int stomp_queue_length(struct queue *queue);
+extern int stomp_queue_full(struct queue *queue, u_int count, size_t size);
+extern int stomp_message_priority(struct evkeyvalq *headers);
+extern u_int64_t stomp_message_expires(struct queue *queue, struct evkeyvalq *headers);
+
+extern int stomp_parse_messageid(const char *messageid, char *queuename, size_t queuename_len, int *priority, u_int *seq);
+
+extern struct subscription* stomp_add_subscription(struct client *client, struct queue *queue);
+extern struct subscription* stomp_find_subscription(struct client *client, struct queue *queue);
+extern void stomp_free_subscription(struct subscription *subscription);
+extern struct subscription* stomp_next_subscriber(struct queue *queue);
+
+extern int stomp_cork_init(struct event_base *base);
+extern void stomp_cork_free(void);
+extern void stomp_uncork(struct client *client);
+extern void stomp_write_buffer(struct client *client, struct evbuffer *buffer);
+extern void stomp_write(struct client *client, const void *data, size_t len);
+extern size_t stomp_output_length(struct client *client);
 
 extern int stomp_parse_headers(struct evkeyvalq *headers, char *request);
-extern void stomp_free_client(struct client *client);
+extern char* stomp_parse_frame(struct evkeyvalq *headers, char *frame);
+extern int stomp_parse_batch(char *body, int count, char **bodies);
+extern char* stomp_frame_head(struct evkeyvalq *headers);
+extern void stomp_free_client(struct client *client, int cmd);
 
 #endif /* _STOMPUTIL_H_ */
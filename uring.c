@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "log.h"
+#include "util.h"
+#include "client.h"
+#include "stomp.h"
+#include "uring.h"
+
+/*
+ * Client connections over io_uring. Connections are accepted with a
+ * multishot accept and read with a multishot recv into a ring of
+ * provided buffers. The STOMP code keeps working on a bufferevent:
+ * every connection is a bufferevent pair, the client end is handed
+ * out, the other end is fed from received data and its input is
+ * sent with one sendmsg per batch of responses. Completions arrive
+ * through an eventfd in the libevent loop, submissions are batched
+ * once per loop iteration.
+ *
+ * While the client end does not read (flow control, rate limits)
+ * received data stays in the output of our end, past URINGRECVMAX
+ * bytes the recv is cancelled and armed again once that drained.
+ */
+#define URINGBGID 1
+
+enum uring_optype {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+struct uring_op {
+    enum uring_optype type;
+    void *owner;
+};
+
+struct uring_listener {
+    struct uring_op op;
+    int fd;
+    void (*callback)(int fd);
+    struct event *ev_rearm;
+};
+
+struct uring_conn {
+    int fd;
+
+    /* Our end of the bufferevent pair */
+    struct bufferevent *bev;
+
+    /* Data of the send in flight */
+    struct evbuffer *sending;
+    struct msghdr msg;
+    struct iovec iov[URINGIOVMAX];
+
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    int recving;
+    int sendinflight;
+
+    /* The client end stopped reading */
+    int paused;
+
+    /* The client is gone, waiting for operations in flight */
+    int closed;
+};
+
+static struct event_base *uring_base;
+static struct io_uring ring;
+static int active;
+
+static int uring_eventfd = -1;
+static struct event *ev_complete;
+static struct event *ev_submit;
+
+static struct io_uring_buf_ring *buffers;
+static char *buffer_mem;
+
+/* Completions of cancellations are ignored */
+static struct uring_op cancel_op = { URING_CANCEL, NULL };
+
+/* Connections indexed by file descriptor */
+static struct uring_conn **conns;
+static int conns_size;
+
+
+int uring_active(void)
+{
+    return active;
+}
+
+static struct io_uring_sqe* uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe(&ring);
+    if(sqe == NULL){
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+
+    /* Submitted once at the end of this loop iteration */
+    event_active(ev_submit, EV_TIMEOUT, 0);
+
+    return sqe;
+}
+
+static void uring_on_submit(evutil_socket_t fd, short what, void *arg)
+{
+    io_uring_submit(&ring);
+}
+
+static void uring_recycle_buffer(int bid)
+{
+    io_uring_buf_ring_add(buffers, buffer_mem + bid * URINGBUFSIZE, URINGBUFSIZE, bid,
+        io_uring_buf_ring_mask(URINGBUFFERS), 0);
+    io_uring_buf_ring_advance(buffers, 1);
+}
+
+static void uring_arm_recv(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe();
+    if(sqe == NULL)
+        return;
+
+    io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URINGBGID;
+    io_uring_sqe_set_data(sqe, &conn->recv_op);
+
+    conn->recving = 1;
+}
+
+/*
+ * Stops receiving for a client which does not read what it got.
+ */
+static void uring_pause_recv(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    conn->paused = 1;
+
+    if(!conn->recving)
+        return;
+
+    sqe = uring_get_sqe();
+    if(sqe == NULL)
+        return;
+
+    io_uring_prep_cancel(sqe, &conn->recv_op, 0);
+    io_uring_sqe_set_data(sqe, &cancel_op);
+}
+
+/*
+ * Called when the client end took everything received so far.
+ */
+static void uring_on_drained(struct bufferevent *bev, void *arg)
+{
+    struct uring_conn *conn = (struct uring_conn *)arg;
+
+    if(!conn->paused)
+        return;
+
+    conn->paused = 0;
+    if(!conn->recving && !conn->closed)
+        uring_arm_recv(conn);
+}
+
+/*
+ * Sends what the client end of the pair wrote, all of it in one
+ * sendmsg as long as it fits into URINGIOVMAX chunks.
+ */
+static void uring_send(struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    int n;
+
+    if(conn->sendinflight || conn->closed)
+        return;
+
+    if(evbuffer_get_length(conn->sending) == 0)
+        evbuffer_add_buffer(conn->sending, bufferevent_get_input(conn->bev));
+
+    if(evbuffer_get_length(conn->sending) == 0)
+        return;
+
+    n = evbuffer_peek(conn->sending, -1, NULL, conn->iov, URINGIOVMAX);
+    if(n > URINGIOVMAX)
+        n = URINGIOVMAX;
+
+    sqe = uring_get_sqe();
+    if(sqe == NULL)
+        return;
+
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = n;
+
+    io_uring_prep_sendmsg(sqe, conn->fd, &conn->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, &conn->send_op);
+
+    conn->sendinflight = 1;
+}
+
+static void uring_on_output(struct bufferevent *bev, void *arg)
+{
+    uring_send((struct uring_conn *)arg);
+}
+
+static void uring_release(struct uring_conn *conn)
+{
+    if(conn->closed == 0 || conn->recving || conn->sendinflight)
+        return;
+
+    bufferevent_free(conn->bev);
+    evbuffer_free(conn->sending);
+    free(conn);
+}
+
+/*
+ * Reports the end of a connection to the client end of the pair
+ * like a socket bufferevent would.
+ */
+static void uring_conn_event(struct uring_conn *conn, short what)
+{
+    struct bufferevent *partner;
+
+    if(conn->closed)
+        return;
+
+    partner = bufferevent_pair_get_partner(conn->bev);
+    if(partner != NULL)
+        bufferevent_trigger_event(partner, what, 0);
+}
+
+static void uring_complete_recv(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    if(cqe->res > 0){
+        if(conn->closed == 0)
+            bufferevent_write(conn->bev, buffer_mem + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URINGBUFSIZE, cqe->res);
+
+        uring_recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    if(conn->closed == 0 && !conn->paused && evbuffer_get_length(bufferevent_get_output(conn->bev)) > URINGRECVMAX)
+        uring_pause_recv(conn);
+
+    if(cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    conn->recving = 0;
+
+    /* Multishot ends on full buffer rings and cancellation as well */
+    if(conn->closed == 0 && (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)){
+        if(!conn->paused)
+            uring_arm_recv(conn);
+    }
+    else if(cqe->res == 0)
+        uring_conn_event(conn, BEV_EVENT_READING|BEV_EVENT_EOF);
+    else
+        uring_conn_event(conn, BEV_EVENT_READING|BEV_EVENT_ERROR);
+
+    uring_release(conn);
+}
+
+static void uring_complete_send(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->sendinflight = 0;
+
+    if(cqe->res < 0){
+        uring_conn_event(conn, BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+        evbuffer_drain(conn->sending, evbuffer_get_length(conn->sending));
+    }
+    else {
+        evbuffer_drain(conn->sending, cqe->res);
+        uring_send(conn);
+    }
+
+    uring_release(conn);
+}
+
+static void uring_complete_accept(struct uring_listener *listener, struct io_uring_cqe *cqe)
+{
+    struct timeval tv = { 1, 0 };
+
+    if(cqe->res >= 0)
+        listener->callback(cqe->res);
+    else if(cqe->res != -EAGAIN && cqe->res != -ECONNABORTED)
+        logwarn("accept failed: %s", strerror(-cqe->res));
+
+    if(cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    /* Out of descriptors, try again later */
+    evtimer_add(listener->ev_rearm, cqe->res == -EMFILE || cqe->res == -ENFILE ? &tv : NULL);
+}
+
+static void uring_on_complete(evutil_socket_t fd, short what, void *arg)
+{
+    struct io_uring_cqe *cqe;
+    struct uring_op *op;
+    eventfd_t value;
+
+    eventfd_read(fd, &value);
+
+    while(io_uring_peek_cqe(&ring, &cqe) == 0){
+        op = (struct uring_op *)io_uring_cqe_get_data(cqe);
+
+        switch(op->type){
+        case URING_ACCEPT:
+            uring_complete_accept(op->owner, cqe);
+            break;
+        case URING_RECV:
+            uring_complete_recv(op->owner, cqe);
+            break;
+        case URING_SEND:
+            uring_complete_send(op->owner, cqe);
+            break;
+        case URING_CANCEL:
+            break;
+        }
+
+        io_uring_cqe_seen(&ring, cqe);
+    }
+}
+
+static void uring_arm_accept(evutil_socket_t fd, short what, void *arg)
+{
+    struct uring_listener *listener = (struct uring_listener *)arg;
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe();
+    if(sqe == NULL)
+        return;
+
+    io_uring_prep_multishot_accept(sqe, listener->fd, NULL, NULL, SOCK_NONBLOCK);
+    io_uring_sqe_set_data(sqe, &listener->op);
+}
+
+int uring_accept(int listen_fd, void (*callback)(int fd))
+{
+    struct uring_listener *listener;
+
+    listener = calloc(1, sizeof(*listener));
+    if(listener == NULL)
+        return 1;
+
+    listener->op.type = URING_ACCEPT;
+    listener->op.owner = listener;
+    listener->fd = listen_fd;
+    listener->callback = callback;
+    listener->ev_rearm = evtimer_new(uring_base, uring_arm_accept, listener);
+
+    uring_arm_accept(-1, 0, listener);
+
+    return 0;
+}
+
+/*
+ * Returns the client end of a bufferevent pair for an accepted
+ * connection.
+ */
+struct bufferevent* uring_bufferevent(int fd)
+{
+    struct bufferevent *pair[2];
+    struct uring_conn *conn;
+    struct uring_conn **tmp;
+    int size;
+
+    if(fd >= conns_size){
+        size = conns_size ? conns_size : 1024;
+        while(size <= fd)
+            size *= 2;
+
+        tmp = realloc(conns, size * sizeof(*conns));
+        if(tmp == NULL)
+            return NULL;
+
+        memset(tmp + conns_size, 0, (size - conns_size) * sizeof(*conns));
+        conns = tmp;
+        conns_size = size;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if(conn == NULL)
+        return NULL;
+
+    if(bufferevent_pair_new(uring_base, BEV_OPT_DEFER_CALLBACKS, pair) != 0){
+        free(conn);
+        return NULL;
+    }
+
+    conn->fd = fd;
+    conn->bev = pair[1];
+    conn->sending = evbuffer_new();
+    conn->recv_op.type = URING_RECV;
+    conn->recv_op.owner = conn;
+    conn->send_op.type = URING_SEND;
+    conn->send_op.owner = conn;
+
+    /* Keeps the output of the client end filled while a send is in
+     * flight, so the dispatcher sees a busy connection */
+    bufferevent_setwatermark(conn->bev, EV_READ, 0, MAXOUTPUTBUF);
+    bufferevent_setcb(conn->bev, uring_on_output, uring_on_drained, NULL, conn);
+    bufferevent_enable(conn->bev, EV_READ|EV_WRITE);
+
+    conns[fd] = conn;
+    uring_arm_recv(conn);
+
+    return pair[0];
+}
+
+/*
+ * Called before the descriptor of a client is closed, ends the
+ * operations in flight.
+ */
+void uring_close(int fd)
+{
+    struct uring_conn *conn;
+
+    if(active == 0 || fd < 0 || fd >= conns_size || conns[fd] == NULL)
+        return;
+
+    conn = conns[fd];
+    conns[fd] = NULL;
+
+    conn->closed = 1;
+    shutdown(fd, SHUT_RDWR);
+
+    uring_release(conn);
+}
+
+int uring_init(struct event_base *base)
+{
+    struct io_uring_probe *probe;
+    int ret;
+    int i;
+
+    if(strcmp(configget("ioBackend"), "uring") != 0)
+        return 0;
+
+    /* Up to the whole buffer ring reaches a producer before it is
+     * paused, kept unread that can hold memoryLimit for good */
+    if(strtoull(configget("memoryLimit"), NULL, 10) != 0 && memorypolicyparse(configget("memoryPolicy")) == MEMORY_FLOW){
+        logwarn("io_uring cannot pause producers for memoryLimit, using sockets");
+        return 0;
+    }
+
+    uring_base = base;
+
+    ret = io_uring_queue_init(URINGENTRIES, &ring, 0);
+    if(ret < 0){
+        logwarn("io_uring unavailable (%s), using sockets", strerror(-ret));
+        return 0;
+    }
+
+    /* Multishot recv needs Linux 6.0, which also brought SEND_ZC */
+    probe = io_uring_get_probe_ring(&ring);
+    if(probe == NULL || !io_uring_opcode_supported(probe, IORING_OP_SEND_ZC)){
+        logwarn("io_uring too old for multishot recv, using sockets");
+        if(probe != NULL)
+            io_uring_free_probe(probe);
+        io_uring_queue_exit(&ring);
+        return 0;
+    }
+    io_uring_free_probe(probe);
+
+    buffers = io_uring_setup_buf_ring(&ring, URINGBUFFERS, URINGBGID, 0, &ret);
+    buffer_mem = malloc(URINGBUFFERS * URINGBUFSIZE);
+    uring_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+    if(buffers == NULL || buffer_mem == NULL || uring_eventfd < 0 || io_uring_register_eventfd(&ring, uring_eventfd) != 0){
+        logwarn("io_uring setup failed, using sockets");
+        if(buffers != NULL)
+            io_uring_free_buf_ring(&ring, buffers, URINGBUFFERS, URINGBGID);
+        if(uring_eventfd >= 0)
+            close(uring_eventfd);
+        free(buffer_mem);
+        io_uring_queue_exit(&ring);
+        return 0;
+    }
+
+    for(i=0; i < URINGBUFFERS; i++)
+        io_uring_buf_ring_add(buffers, buffer_mem + i * URINGBUFSIZE, URINGBUFSIZE, i, io_uring_buf_ring_mask(URINGBUFFERS), i);
+    io_uring_buf_ring_advance(buffers, URINGBUFFERS);
+
+    ev_complete = event_new(base, uring_eventfd, EV_READ|EV_PERSIST, uring_on_complete, NULL);
+    event_add(ev_complete, NULL);
+    ev_submit = event_new(base, -1, 0, uring_on_submit, NULL);
+
+    active = 1;
+    loginfo("Using io_uring for client connections");
+
+    return 0;
+}
+
+int uring_free(void)
+{
+    if(active == 0)
+        return 0;
+
+    event_free(ev_complete);
+    event_free(ev_submit);
+
+    io_uring_free_buf_ring(&ring, buffers, URINGBUFFERS, URINGBGID);
+    io_uring_queue_exit(&ring);
+
+    close(uring_eventfd);
+    free(buffer_mem);
+    free(conns);
+
+    active = 0;
+
+    return 0;
+}
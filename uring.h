@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2011 Bernhard Froehlich <decke@bluelife.at>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Author's name may not be used endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+/* Submission queue size */
+#define URINGENTRIES 4096
+
+/* Provided receive buffers, shared by all connections */
+#define URINGBUFFERS 1024
+#define URINGBUFSIZE 4096
+
+/* Iovecs per send */
+#define URINGIOVMAX 64
+
+/* Received bytes held for a client which stopped reading, beyond
+ * them the recv is cancelled until the client catches up */
+#define URINGRECVMAX 65536
+
+extern int uring_init(struct event_base *base);
+extern int uring_free(void);
+extern int uring_active(void);
+
+extern int uring_accept(int listen_fd, void (*callback)(int fd));
+extern struct bufferevent* uring_bufferevent(int fd);
+extern void uring_close(int fd);
+
+#endif /* _URING_H_ */
@@ -27,6 +27,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fnmatch.h>
+#include <sys/time.h>
 
 #include "util.h"
 
@@ -36,13 +38,69 @@ struct configparam
     char value[CONFIGMAXVALUE];
 };
 
+TAILQ_HEAD(, policy) policies = TAILQ_HEAD_INITIALIZER(policies);
+
+struct nodelist nodes = TAILQ_HEAD_INITIALIZER(nodes);
+
+TAILQ_HEAD(, composite) composites = TAILQ_HEAD_INITIALIZER(composites);
+
+/* Applies to destinations without a matching policy */
+struct policy defaultpolicy;
+
 struct configparam config[] = {
+    { "acceptBatch",   "256" },
     { "authUser",      "" },
     { "authPass",      "" },
+    { "browseBatch",   "100" },
+    { "captureFile",   "" },
+    { "clientByteRate", "0" },
+    { "clientRate",    "0" },
+    { "clusterSelf",   "" },
+    { "compactBatch", "10000" },
+    { "compactInterval", "60000" },
+    { "compactMaxLoad", "1000" },
+    { "compactThreshold", "10000" },
+    { "corkBytes",     "16384" },
+    { "corkDelay",     "0" },
+    { "dbBlockSize",   "4096" },
+    { "dbBloomBits",   "10" },
+    { "dbCacheSize",   "8388608" },
+    { "dbCompression", "snappy" },
     { "dbFile",        "/tmp/redqueue.db" },
+    { "dbFillCache",   "no" },
+    { "dbMaxOpenFiles", "1000" },
+    { "dbSync",        "yes" },
+    { "dbWriteBuffer", "4194304" },
+    { "durableBatch",  "100" },
+    { "durableSync",   "1000" },
+    { "expireBatch",   "1000" },
+    { "expireInterval","1000" },
+    { "fanoutBatch",   "1000" },
+    { "handoffSocket", "" },
+    { "idleTimeout",   "300000" },
+    { "ioBackend",     "sockets" },
+    { "listenBacklog", "1024" },
     { "listenIP",      "127.0.0.1" },
     { "listenPort",    "8080" },
+    { "listenSockets", "1" },
     { "logFile",       "/var/log/redqd.log" },
+    { "loginByteRate", "0" },
+    { "loginRate",     "0" },
+    { "maxRedeliveries", "5" },
+    { "memoryLimit",   "0" },
+    { "memoryPolicy",  "flow" },
+    { "redeliveryDelay", "1000" },
+    { "redeliveryDelayMax", "60000" },
+    { "replicateFrom", "" },
+    { "replicationAck", "async" },
+    { "replicationBuffer", "67108864" },
+    { "replicationFollowers", "" },
+    { "replicationPort", "" },
+    { "replicationQuorum", "1" },
+    { "replicationTimeout", "5000" },
+    { "socketRecvBuffer", "0" },
+    { "socketSendBuffer", "0" },
+    { "tcpNoDelay",    "yes" },
     { "", "" }
 };
 
@@ -72,6 +130,27 @@ int configparse(char *filename)
             if(strlen(line) == 0 || strlen(value) == 0)
                  continue;
 
+            if(strcmp(line, "policy") == 0)
+            {
+                if(policyparse(value) != 0)
+                    return 1;
+                continue;
+            }
+
+            if(strcmp(line, "node") == 0)
+            {
+                if(nodeparse(value) != 0)
+                    return 1;
+                continue;
+            }
+
+            if(strcmp(line, "composite") == 0)
+            {
+                if(compositeparse(value) != 0)
+                    return 1;
+                continue;
+            }
+
             if(configset(line, value) != 0)
                 return 1;
         }
@@ -115,3 +194,191 @@ int configset(char *key, char *value)
     return 1;
 }
 
+
+int policyparse(char *value)
+{
+    struct policy *policy;
+    char *pattern, *option, *optval;
+
+    pattern = strsep(&value, " \t");
+    if(pattern == NULL || strlen(pattern) == 0)
+        return 1;
+
+    policy = calloc(1, sizeof(*policy));
+    if(policy == NULL)
+        return 1;
+
+    policy->pattern = strdup(pattern);
+
+    while((option = strsep(&value, " \t")) != NULL)
+    {
+        if(*option == '\0')
+            continue;
+
+        optval = strchr(option, '=');
+        if(optval == NULL)
+        {
+            printf("policy: Missing value for <%s>\n", option);
+            goto error;
+        }
+
+        *optval++ = '\0';
+
+        if(strcmp(option, "ttl") == 0)
+            policy->ttl = strtoull(optval, NULL, 10);
+        else if(strcmp(option, "memory") == 0)
+            policy->memory = strtoull(optval, NULL, 10);
+        else if(strcmp(option, "maxlength") == 0)
+            policy->maxlength = strtoul(optval, NULL, 10);
+        else if(strcmp(option, "maxbytes") == 0)
+            policy->maxbytes = strtoull(optval, NULL, 10);
+        else if(strcmp(option, "rate") == 0)
+            policy->rate = strtoull(optval, NULL, 10);
+        else if(strcmp(option, "byterate") == 0)
+            policy->byterate = strtoull(optval, NULL, 10);
+        else if(strcmp(option, "dedup") == 0)
+        {
+            policy->dedup = strtoul(optval, NULL, 10);
+            if(policy->dedup > MAXDEDUP)
+            {
+                printf("policy: dedup <%s> is above %u\n", optval, MAXDEDUP);
+                goto error;
+            }
+        }
+        else if(strcmp(option, "overflow") == 0)
+        {
+            if(strcmp(optval, "drop-head") == 0)
+                policy->overflow = OVERFLOW_DROP_HEAD;
+            else if(strcmp(optval, "reject-publish") == 0)
+                policy->overflow = OVERFLOW_REJECT;
+            else if(strcmp(optval, "block-producer") == 0)
+                policy->overflow = OVERFLOW_BLOCK;
+            else
+            {
+                printf("policy: Unknown overflow <%s>\n", optval);
+                goto error;
+            }
+        }
+        else if(strcmp(option, "onmemory") == 0)
+        {
+            if((policy->onmemory = memorypolicyparse(optval)) < 0)
+            {
+                printf("policy: Unknown onmemory <%s>\n", optval);
+                goto error;
+            }
+        }
+        else
+        {
+            printf("policy: Unknown option <%s>\n", option);
+            goto error;
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&policies, policy, entries);
+    return 0;
+
+error:
+    free(policy->pattern);
+    free(policy);
+    return 1;
+}
+
+struct policy* policyfind(const char *queuename)
+{
+    struct policy *policy;
+
+    TAILQ_FOREACH(policy, &policies, entries)
+    {
+        if(fnmatch(policy->pattern, queuename, 0) == 0)
+            return policy;
+    }
+
+    return &defaultpolicy;
+}
+
+int memorypolicyparse(const char *value)
+{
+    if(strcmp(value, "flow") == 0)
+        return MEMORY_FLOW;
+    if(strcmp(value, "reject") == 0)
+        return MEMORY_REJECT;
+    if(strcmp(value, "spill") == 0)
+        return MEMORY_SPILL;
+
+    return -1;
+}
+
+int nodeparse(char *value)
+{
+    struct node *node;
+
+    if(strchr(value, ':') == NULL)
+    {
+        printf("node: Missing port in <%s>\n", value);
+        return 1;
+    }
+
+    node = calloc(1, sizeof(*node));
+    if(node == NULL)
+        return 1;
+
+    node->address = strdup(value);
+
+    TAILQ_INSERT_TAIL(&nodes, node, entries);
+    return 0;
+}
+
+int compositeparse(char *value)
+{
+    struct composite *composite;
+    char *name;
+
+    name = strsep(&value, " \t");
+    while(value != NULL && (*value == ' ' || *value == '\t'))
+        value++;
+
+    if(value == NULL || strlen(value) == 0 || strpbrk(value, " \t") != NULL)
+    {
+        printf("composite: Missing queues for <%s>\n", name);
+        return 1;
+    }
+
+    composite = calloc(1, sizeof(*composite));
+    if(composite == NULL)
+        return 1;
+
+    composite->name = strdup(name);
+    composite->members = strdup(value);
+
+    TAILQ_INSERT_TAIL(&composites, composite, entries);
+    return 0;
+}
+
+/*
+ * Returns the comma separated queues of a composite destination or
+ * NULL if there is none with that name.
+ */
+const char* compositefind(const char *name)
+{
+    struct composite *composite;
+
+    TAILQ_FOREACH(composite, &composites, entries)
+    {
+        if(strcmp(composite->name, name) == 0)
+            return composite->members;
+    }
+
+    return NULL;
+}
+
+/*
+ * Current time in milliseconds since the epoch.
+ */
+u_int64_t mstime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (u_int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
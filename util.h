@@ -27,11 +27,95 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <sys/types.h>
+#include <sys/queue.h>
+
 #define CONFIGMAXKEY 25
 #define CONFIGMAXVALUE 50
 
+/* Responses to an exceeded memory limit, see memory.c */
+enum memory_policy {
+    MEMORY_DEFAULT = 0,
+    MEMORY_FLOW,
+    MEMORY_REJECT,
+    MEMORY_SPILL
+};
+
+/* What happens to a SEND to a queue which reached its length limit */
+enum overflow_policy {
+    OVERFLOW_DROP_HEAD = 0,
+    OVERFLOW_REJECT,
+    OVERFLOW_BLOCK
+};
+
+/**
+ * Per destination settings from "policy <pattern> option=value ..."
+ * lines in the config file. The first policy whose pattern matches
+ * a destination name applies.
+ */
+struct policy {
+    char *pattern;
+
+    /* Time to live of messages in milliseconds */
+    u_int64_t ttl;
+
+    /* Memory quota in bytes and what to do when it is reached */
+    size_t memory;
+    int onmemory;
+
+    /* Limits for undelivered messages of a queue, 0 for none */
+    u_int maxlength;
+    size_t maxbytes;
+    int overflow;
+
+    /* Rate limits of producers per second, 0 for none */
+    u_int64_t rate;
+    u_int64_t byterate;
+
+    /* Number of producer ids to look for duplicates, 0 for none */
+    u_int dedup;
+#define MAXDEDUP (1U << 24)
+
+    TAILQ_ENTRY(policy) entries;
+};
+
+/**
+ * A member of the cluster from a "node <host:port>" config line.
+ * All nodes of a cluster need the same list in the same order.
+ */
+struct node {
+    char *address;
+
+    TAILQ_ENTRY(node) entries;
+};
+
+TAILQ_HEAD(nodelist, node);
+extern struct nodelist nodes;
+
+/**
+ * A virtual destination from a "composite <name> <queue>,<queue>,..."
+ * config line. A SEND to it goes to all the queues.
+ */
+struct composite {
+    char *name;
+    char *members;
+
+    TAILQ_ENTRY(composite) entries;
+};
+
 extern int configparse(char *filename);
 extern char* configget(char *key);
 extern int configset(char *key, char *value);
 
+extern int policyparse(char *value);
+extern struct policy* policyfind(const char *queuename);
+extern int memorypolicyparse(const char *value);
+
+extern int nodeparse(char *value);
+
+extern int compositeparse(char *value);
+extern const char* compositefind(const char *name);
+
+extern u_int64_t mstime(void);
+
 #endif /* _UTIL_H_ */